@@ -0,0 +1,197 @@
+/*
+ * bench.c
+ *
+ * Times each stage of assembling the programs given: scanning alone,
+ * the first pass (labels), the second pass (encoding) and writing
+ * MIF output. Each stage is run a few times and the best is kept.
+ * Rates are over the source, so the stages can be compared.
+ *
+ * Run it from the top of the tree, so .arch finds the cfg directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "asm.h"
+
+/* what a program is measured against */
+struct BenchInput {
+  char *name;
+  char *text;
+  size_t len;
+  unsigned long lines;
+};
+
+static double bench_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double bench_min(double a, double b) {
+  return (a < b) ? a : b;
+}
+
+static int bench_load(struct BenchInput *in, char *name) {
+  FILE *handle;
+  size_t x;
+  long size;
+
+  if ((handle = fopen(name, "r")) == NULL) {
+    perror(name);
+    return -1;
+  }
+  fseek(handle, 0, SEEK_END);
+  size = ftell(handle);
+  rewind(handle);
+  if ((size < 0) || ((in->text = malloc(size + 1)) == NULL) ||
+      (fread(in->text, 1, size, handle) != (size_t)size)) {
+    fprintf(stderr, "Could not read %s\n", name);
+    fclose(handle);
+    return -1;
+  }
+  fclose(handle);
+
+  in->name = name;
+  in->len = size;
+  in->lines = 0;
+  for (x=0; x<in->len; x++) {
+    if (in->text[x] == '\n') {
+      in->lines += 1;
+    }
+  }
+  return 0;
+}
+
+static void bench_report(struct BenchInput *in, char *stage, double secs,
+			 char *extra) {
+  printf("%-24s %-8s %9.4f s %12.0f lines/s %9.2f MB/s  %s\n",
+	 in->name, stage, secs, in->lines / secs, in->len / secs / 1e6,
+	 extra);
+}
+
+static int bench_program(struct BenchInput *in, int reps, int workers) {
+  struct SymTab *syms = NULL;
+  struct ASMSource src;
+  struct ScanData scanner;
+  struct Token tok;
+  struct Image image;
+  struct DiagBuf diag;
+  double start, best[4];
+  unsigned long tokens = 0;
+  char extra[64];
+  int x, y, ret = 0;
+
+  memset(&src, 0, sizeof(src));
+  memset(&diag, 0, sizeof(diag));
+  IMAGE_INIT(&image);
+  for (y=0; y<4; y++) {
+    best[y] = 1e30;
+  }
+
+  /* keep messages out of the timings */
+  diag_capture(&diag);
+
+  for (x=0; (x<reps) && (ret == 0); x++) {
+    /* scanner on its own */
+    start = bench_now();
+    SCANNER_INIT_TEXT(&scanner, in->text, in->len);
+    for (tokens = 0; scan_token(&tok, &scanner) != TOK_EOF; tokens++) { }
+    SCANNER_STOP(&scanner);
+    best[0] = bench_min(best[0], bench_now() - start);
+
+    /* first pass */
+    symtab_clear(&syms);
+    asmgen_free_source(&src);
+    start = bench_now();
+    ret = asmgen_parse_text(&syms, in->text, in->len, in->name, &src);
+    best[1] = bench_min(best[1], bench_now() - start);
+
+    /* second pass */
+    image_free(&image);
+    IMAGE_INIT(&image);
+    start = bench_now();
+    if (ret == 0) {
+      ret = asmgen_assemble(&syms, &src, &image, workers);
+    }
+    best[2] = bench_min(best[2], bench_now() - start);
+
+    /* output */
+    start = bench_now();
+    if (ret == 0) {
+      ret = asmout_make_mif(&syms, "/dev/null", &image, workers);
+    }
+    best[3] = bench_min(best[3], bench_now() - start);
+    diag_clear(&diag);
+  }
+  diag_capture(NULL);
+
+  if (ret != 0) {
+    fprintf(stderr, "%s did not assemble:\n%s", in->name,
+	    (diag.text != NULL) ? diag.text : "");
+  }
+  else {
+    sprintf(extra, "%lu tokens", tokens);
+    bench_report(in, "scan", best[0], extra);
+    sprintf(extra, "%u chunks", src.numChunks);
+    bench_report(in, "pass1", best[1], extra);
+    sprintf(extra, "%d workers", workers);
+    bench_report(in, "pass2", best[2], extra);
+    sprintf(extra, "%llu bytes", image.end);
+    bench_report(in, "output", best[3], extra);
+    bench_report(in, "total", best[1] + best[2] + best[3], "");
+  }
+
+  free(diag.text);
+  asmgen_free_source(&src);
+  image_free(&image);
+  symtab_clear(&syms);
+  return ret;
+}
+
+static void usage(char *name) {
+  printf("Usage:\n\t%s [options] <program.asm> ...\n\n", name);
+  printf("Options:\n");
+  printf("\t-r <count>  runs of each stage, best is kept (default 3)\n");
+  printf("\t-j <count>  threads for the second pass (default 1)\n");
+}
+
+int main(int argc, char **argv) {
+  struct BenchInput in;
+  int ch, reps = 3, workers = 1, ret = 0;
+
+  while ((ch = getopt(argc, argv, "r:j:h")) != -1) {
+    switch (ch) {
+    case 'r':
+      reps = atoi(optarg);
+      break;
+    case 'j':
+      workers = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if ((optind >= argc) || (reps < 1) || (workers < 1)) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  for (; optind < argc; optind++) {
+    if (bench_load(&in, argv[optind]) != 0) {
+      ret = -1;
+      continue;
+    }
+    if (bench_program(&in, reps, workers) != 0) {
+      ret = -1;
+    }
+    free(in.text);
+  }
+
+  asmrec_unload_all();
+  return ret;
+}
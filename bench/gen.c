@@ -0,0 +1,248 @@
+/*
+ * gen.c
+ *
+ * Writes a synthetic assembly program to standard output, for
+ * measuring how caspr scales. The program is made of a chosen
+ * number of instructions for the tiny or wide32 architectures, with
+ * labels spread evenly through it. Label references are a chosen
+ * mix of forward and backward, operands can be parenthesized
+ * expressions, and .org can open gaps in front of labels.
+ *
+ * Label values are cut down with bit limits to fit their fields, so
+ * assembling the output prints no warnings.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* what to generate */
+struct GenOpts {
+  int wide;			/* wide32 rather than tiny */
+  long instrs;			/* instructions */
+  long labels;			/* labels among them */
+  int forward;			/* percent of label references forward */
+  int exprs;			/* percent of operands as expressions */
+  int sparse;			/* percent of labels behind a .org gap */
+  unsigned long seed;
+};
+
+/* small fixed generator, so output is the same everywhere */
+static unsigned long gen_state;
+
+static unsigned long gen_rand(void) {
+  gen_state = gen_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (gen_state >> 33) & 0x7fffffff;
+}
+
+static int gen_percent(int pct) {
+  return (int)(gen_rand() % 100) < pct;
+}
+
+/* a label to reference from the code following label cur */
+static long gen_target(struct GenOpts *opts, long cur) {
+  if ((cur + 1 < opts->labels) &&
+      ((cur < 0) || gen_percent(opts->forward))) {
+    return cur + 1 + gen_rand() % (opts->labels - cur - 1);
+  }
+  return (cur < 0) ? 0 : gen_rand() % (cur + 1);
+}
+
+/* an operand referring to label, high bits cut off to fit width */
+static void gen_label_arg(FILE *out, struct GenOpts *opts, long label,
+			  int low, int width) {
+  if (gen_percent(opts->exprs)) {
+    /* leave room for what gets added */
+    fprintf(out, " (L%ld<%d-%d> + %lu)", label, low, low + width - 2,
+	    gen_rand() % 4);
+  }
+  else {
+    fprintf(out, " L%ld<%d-%d>", label, low, low + width - 1);
+  }
+}
+
+/* a plain number operand, small enough for width bits */
+static void gen_number_arg(FILE *out, struct GenOpts *opts, int width) {
+  unsigned long max = 1UL << (width - 1), add;
+
+  if (gen_percent(opts->exprs)) {
+    /* never goes below zero */
+    add = gen_rand() % 8;
+    fprintf(out, " ((%lu + %lu) - %lu)", gen_rand() % max, add,
+	    gen_rand() % (add + 1));
+  }
+  else {
+    fprintf(out, " %lu", gen_rand() % max);
+  }
+}
+
+/* one tiny instruction, returns its size */
+static int gen_tiny(FILE *out, struct GenOpts *opts, long label) {
+  switch (gen_rand() % 6) {
+  case 0:
+    fprintf(out, "\tadd");
+    gen_number_arg(out, opts, 8);
+    break;
+  case 1:
+    fprintf(out, "\tstr");
+    gen_label_arg(out, opts, gen_target(opts, label), 0, 8);
+    break;
+  case 2:
+    fprintf(out, "\tcla\n");
+    return 1;
+  case 3:
+    fprintf(out, "\tbyte");
+    gen_number_arg(out, opts, 8);
+    fprintf(out, "\n");
+    return 1;
+  default:
+    fprintf(out, "\tjnz");
+    gen_label_arg(out, opts, gen_target(opts, label), 0, 8);
+    break;
+  }
+  fprintf(out, "\n");
+  return 2;
+}
+
+/* one wide32 instruction, returns its size */
+static int gen_wide(FILE *out, struct GenOpts *opts, long label) {
+  static const char *rrr[] = { "add", "sub", "and", "or", "xor" };
+  static const char *rri[] = { "addi", "andi", "ori", "lw", "sw" };
+
+  switch (gen_rand() % 8) {
+  case 0:
+  case 1:
+    fprintf(out, "\t%s %lu %lu %lu\n", rrr[gen_rand() % 5],
+	    gen_rand() % 32, gen_rand() % 32, gen_rand() % 32);
+    break;
+  case 2:
+  case 3:
+    fprintf(out, "\t%s %lu %lu", rri[gen_rand() % 5],
+	    gen_rand() % 32, gen_rand() % 32);
+    gen_number_arg(out, opts, 16);
+    fprintf(out, "\n");
+    break;
+  case 4:
+    fprintf(out, "\t%s %lu %lu", (gen_rand() % 2) ? "beq" : "bne",
+	    gen_rand() % 32, gen_rand() % 32);
+    gen_label_arg(out, opts, gen_target(opts, label), 2, 16);
+    fprintf(out, "\n");
+    break;
+  case 5:
+    fprintf(out, "\t%s", (gen_rand() % 2) ? "j" : "jal");
+    gen_label_arg(out, opts, gen_target(opts, label), 2, 26);
+    fprintf(out, "\n");
+    break;
+  case 6:
+    fprintf(out, "\tclr %lu\n", gen_rand() % 32);
+    break;
+  default:
+    fprintf(out, "\tnop\n");
+    break;
+  }
+  return 4;
+}
+
+static void usage(char *name) {
+  printf("Usage:\n\t%s [options] > program.asm\n\n", name);
+  printf("Options:\n");
+  printf("\t-a <arch>   tiny or wide32 (default tiny)\n");
+  printf("\t-n <count>  instructions (default 100000)\n");
+  printf("\t-l <count>  labels (default one per 8 instructions)\n");
+  printf("\t-f <pct>    label references going forward (default 50)\n");
+  printf("\t-e <pct>    operands given as expressions (default 20)\n");
+  printf("\t-s <pct>    labels with a .org gap before them (default 0)\n");
+  printf("\t-r <seed>   random seed (default 1)\n");
+}
+
+int main(int argc, char **argv) {
+  struct GenOpts opts;
+  FILE *body;
+  char *text;
+  size_t len;
+  unsigned long offset = 0, words;
+  long x, label = -1, nextLabel;
+  int ch;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.instrs = 100000;
+  opts.labels = -1;
+  opts.forward = 50;
+  opts.exprs = 20;
+  opts.seed = 1;
+
+  while ((ch = getopt(argc, argv, "a:n:l:f:e:s:r:h")) != -1) {
+    switch (ch) {
+    case 'a':
+      if (strcmp(optarg, "wide32") == 0) {
+	opts.wide = 1;
+      }
+      else if (strcmp(optarg, "tiny") != 0) {
+	fprintf(stderr, "Unknown architecture %s\n", optarg);
+	return -1;
+      }
+      break;
+    case 'n':
+      opts.instrs = atol(optarg);
+      break;
+    case 'l':
+      opts.labels = atol(optarg);
+      break;
+    case 'f':
+      opts.forward = atoi(optarg);
+      break;
+    case 'e':
+      opts.exprs = atoi(optarg);
+      break;
+    case 's':
+      opts.sparse = atoi(optarg);
+      break;
+    case 'r':
+      opts.seed = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if (opts.instrs < 1) {
+    opts.instrs = 1;
+  }
+  if ((opts.labels < 1) || (opts.labels > opts.instrs)) {
+    opts.labels = (opts.instrs + 7) / 8;
+  }
+  gen_state = opts.seed;
+
+  /* write the body first, the header needs its size */
+  if ((body = open_memstream(&text, &len)) == NULL) {
+    perror("Could not buffer program");
+    return -1;
+  }
+  nextLabel = 0;
+  for (x=0; x<opts.instrs; x++) {
+    if (x == nextLabel) {
+      label += 1;
+      nextLabel = ((label + 1) * opts.instrs) / opts.labels;
+      if (gen_percent(opts.sparse)) {
+	offset += 256 + (gen_rand() % 16) * 256;
+	fprintf(body, ".org %lu\n", offset);
+      }
+      fprintf(body, "L%ld:", label);
+    }
+    offset += opts.wide ? gen_wide(body, &opts, label) :
+      gen_tiny(body, &opts, label);
+  }
+  fclose(body);
+
+  /* header, sized so everything fits */
+  words = opts.wide ? (offset + 3) / 4 : offset;
+  printf("; generated by gen -a %s -n %ld -l %ld -f %d -e %d -s %d -r %lu\n",
+	 opts.wide ? "wide32" : "tiny", opts.instrs, opts.labels,
+	 opts.forward, opts.exprs, opts.sparse, opts.seed);
+  printf(".arch %s\n.mifwords %lu\n", opts.wide ? "wide32" : "tiny",
+	 words + 1);
+  fwrite(text, 1, len, stdout);
+  free(text);
+  return 0;
+}
@@ -1,9 +1,13 @@
 #ifndef ASMGEN_H
 #define ASMGEN_H
 
+#include <pthread.h>
 #include "global.h"
 #include "scan.h"
 #include "symtab.h"
+#include "image.h"
+#include "expr.h"
+#include "diag.h"
 
 /*
  * defines
@@ -17,6 +21,10 @@
 #define ASMREC_OFFSET(ptr, fmtarg) ((ptr)->fmt_args[fmtarg].argOffset)
 #define ASMREC_WIDTH(ptr, fmtarg) ((ptr)->arg_widths[(ptr)->fmt_args[fmtarg].argNum])
 
+/* mask of the low width bits of a field */
+#define FIELD_MASK(width) \
+  (((width) >= 32) ? 0xffffffff : (((uint32_t)1 << (width)) - 1))
+
 /*
  * data structures
  */
@@ -28,37 +36,262 @@ struct ArgFormat {
   int8_t argOffset;	/* how much offset inside the asm */
 };
 
+/* one step of an argument's encoder, (value & mask) << shift */
+struct FieldOp {
+  uint32_t mask;	/* width of the argument */
+  uint8_t  shift;	/* offset of the field inside the asm */
+};
+
 /* holds information for each assembly mnemonic */
 struct ASMRecord {
   struct ASMRecord *next;		     /* linked list */
-  char             mnemonic[MAX_TOKLEN];     /* instruction name */
+  const char       *mnemonic;                /* instruction name, interned */
   uint32_t         asm_mask;                 /* instruction with all fields 0 */
   uint8_t          arg_widths[MAX_ASM_ARGS];
   uint8_t          byte_count;               /* number of bytes */
   uint8_t          num_args;                 /* number fields to fill */
   struct ArgFormat fmt_args[MAX_ASM_ARGS];   /* info for each field to fill */
+  /* the encoder program, built from fmt_args: the fields filled by
+   * argument n are ops[arg_first[n]] up to ops[arg_first[n+1]] */
+  uint8_t          fixed;                    /* each arg fills one field */
+  uint8_t          arg_first[MAX_ASM_ARGS+1];
+  struct FieldOp   ops[MAX_ASM_ARGS];
+};
+
+/* hot fields of a record, packed apart from the mnemonic name
+ * so the encoder only touches what it needs */
+struct ASMEncoding {
+  uint32_t         asm_mask;                 /* instruction with all fields 0 */
+  uint8_t          byte_count;               /* number of bytes */
+  uint8_t          num_args;                 /* number fields to fill */
+  uint8_t          fixed;                    /* each arg fills one field */
+  uint8_t          arg_widths[MAX_ASM_ARGS];
+  uint8_t          arg_first[MAX_ASM_ARGS+1];
+  struct FieldOp   ops[MAX_ASM_ARGS];        /* encoder program */
+};
+
+/* one slot of the mnemonic index */
+struct ASMSlot {
+  uint32_t hash;	/* hash of mnemonic */
+  int32_t  index;	/* which encoding, -1 if slot unused */
+};
+
+/* a symbol the architecture file defines (.outfmt, .mifwords, ..),
+ * applied to the program each time the architecture is selected */
+struct ASMDefault {
+  uint32_t name;		/* offset of name into strings */
+  uint32_t strVal;		/* offset of string value, ASM_NO_STRING if none */
+  int32_t  intVal;
+};
+#define ASM_NO_STRING 0xffffffff
+
+/* a loaded instruction set, compiled for one-probe lookup. these
+ * are shared (read only) once loaded, see asmrec_load */
+struct ASMArch {
+  struct ASMEncoding *enc;	/* encodings, one per mnemonic */
+  uint32_t *names;		/* offset of each mnemonic into strings */
+  char *strings;		/* packed, terminated names and values */
+  struct ASMSlot *slots;	/* open addressing index over mnemonics */
+  struct ASMDefault *defaults;	/* symbols to apply on selection */
+  uint32_t mask;		/* number of slots - 1 */
+  int count;			/* number of mnemonics */
+  int numDefaults;		/* number of default symbols */
+  size_t strSize;		/* bytes in strings */
+  uint32_t *ids;		/* interned name of each mnemonic, never cached */
+  void *map;			/* compiled cache file, if loaded from one */
+  size_t mapLen;
+};
+
+/* architectures loaded so far, by name. the command line has one
+ * for the process, embedders one per context, see asmrec_attach */
+struct ArchRegistry {
+  struct ArchEntry *loaded;	/* handed out to whoever asks */
+  struct ArchEntry *retired;	/* files changed since, kept until freed */
+  pthread_mutex_t lock;
+};
+
+/* header of a compiled architecture cache file ("<name>.cfgc"),
+ * followed by enc, names, slots, defaults and strings in turn */
+#define ASMCACHE_MAGIC "CASPRARC"
+#define ASMCACHE_VERSION 2
+struct ASMCacheHeader {
+  char     magic[8];
+  uint32_t version;
+  uint32_t encSize;		/* sizeof(struct ASMEncoding), layout guard */
+  uint64_t srcSize;		/* size of the .cfg this came from */
+  int64_t  srcMtime;		/* its modification time */
+  uint64_t srcHash;		/* and a hash of its contents */
+  uint32_t count;
+  uint32_t numSlots;
+  uint32_t numDefaults;
+  uint32_t strSize;
 };
 
+/* a field (or a whole .db/.dw/.dd value) left unfilled because
+ * its value was not yet known, to be patched in once all labels
+ * are defined */
+struct Fixup {
+  unsigned int offset;			/* byte offset of the instruction */
+  uint8_t      byte_count;		/* width of the instruction */
+  uint8_t      width;			/* width of the argument */
+  uint8_t      num_fields;		/* fields the argument fills */
+  uint8_t      fieldOffset[MAX_ASM_ARGS];	/* bit offset of each field */
+  uint32_t     file;			/* where it came from, interned */
+  int          linenum;
+  unsigned int first;			/* operand ops, in FixupList code */
+  unsigned int count;
+};
+
+/* pending fixups, along with the compiled operands they need. for
+ * an object file they are its relocations: every operand using a
+ * label is kept, since labels move when the module is linked */
+struct FixupList {
+  struct Fixup *list;
+  unsigned int count;
+  unsigned int size;
+  struct ExprCode code;
+  int relocate;				/* keep them all for the linker */
+  struct SymTab *labels;		/* labels seen, if relocate */
+};
+
+/* start of a run of recorded tokens, so the second pass can pick
+ * up there without going over everything before it */
+struct ASMChunk {
+  unsigned int tok;			/* index of its first token */
+  unsigned int offset;			/* byte offset at that point */
+  const struct ASMArch *arch;		/* architecture in effect */
+  unsigned int data;			/* index of the next ASMData */
+};
+
+/* bytes the program will emit, contiguous from base */
+struct ASMSpan {
+  uint32_t base;
+  uint32_t len;
+};
+
+/* where one instruction line's code went, to redo it in place */
+struct ASMLine {
+  int linenum;
+  unsigned int offset;
+  uint8_t byte_count;
+  const struct ASMArch *arch;
+};
+
+/* a .fill, .space or .incbin as laid out by the first pass, so
+ * the second only has to copy it into place */
+struct ASMData {
+  unsigned int len;			/* bytes placed */
+  uint32_t value;			/* to fill with */
+  uint8_t unit;				/* bytes of value, 1, 2 or 4 */
+  const char *bytes;			/* contents to copy instead, if set */
+  void *map;				/* file mapping holding them */
+  size_t mapLen;
+};
+
+/* what the first pass hands to the second */
+struct ASMSource {
+  uint32_t file;			/* interned name of the input */
+  struct TokenStream toks;		/* every token scanned */
+  struct ASMChunk *chunks;		/* where runs of them start */
+  unsigned int numChunks, sizeChunks;
+  struct ASMSpan *spans;		/* where code will be emitted */
+  unsigned int numSpans, sizeSpans;
+  int overlap;				/* some code is emitted over other code */
+  int keepLines;			/* set to fill in lines */
+  struct ASMLine *lines;		/* every instruction, in line order */
+  unsigned int numLines, sizeLines;
+  struct ASMData *data;			/* bulk data, in source order */
+  unsigned int numData, sizeData;
+};
+
+/* tokens per chunk, enough to make a chunk worth a thread */
+#define ASMGEN_CHUNK_TOKENS 65536
+
+/* an output format, as named by .outfmt */
+struct ASMOutFormat {
+  const char *name;
+  const char *ext;			/* output file extension */
+  int (*make)(struct SymTab **curSyms, char *out, struct Image *img,
+	      int workers);
+};
+
+/* data bytes per Intel HEX record */
+#define ASMOUT_IHEX_BYTES 16
+
+/* words (or ROM rows) an output must have per worker before it is
+ * formatted in parallel */
+#define ASMOUT_PIECE_UNITS 65536
+
 /*
  * prototypes
  */
 
 /* loading configuration records for a given instruction set */
-struct ASMRecord* asmrec_load(struct SymTab **curSyms, char *infile);
+const struct ASMArch* asmrec_load(struct SymTab **curSyms,
+				  const char *infile);
 int asmrec_free(struct ASMRecord *ptr);
+struct ASMArch* asmrec_compile(struct ASMRecord *list,
+			       struct SymTab **defaults);
+const struct ASMEncoding* asmrec_find(const struct ASMArch *arch,
+				      uint32_t mnemonic);
+int asmrec_free_arch(struct ASMArch *arch);
+void asmrec_registry_init(struct ArchRegistry *reg);
+void asmrec_registry_free(struct ArchRegistry *reg);
+struct ArchRegistry *asmrec_attach(struct ArchRegistry *reg);
+void asmrec_unload_all(void);
 
 /* generation of machine code */
 int asmgen_parse_value(struct ScanData *scanner,
 		       struct SymTab **curSyms,
 		       unsigned int *pResult);
 int asmgen_parse_syms(struct SymTab **curSyms,
-		      FILE *handle);
+		      FILE *handle,
+		      const char *name,
+		      struct ASMSource *src);
+int asmgen_parse_text(struct SymTab **curSyms,
+		      const char *text,
+		      size_t len,
+		      const char *name,
+		      struct ASMSource *src);
 int asmgen_assemble(struct SymTab **curSyms,
-		    FILE *input,
-		    char *data);
+		    struct ASMSource *src,
+		    struct Image *image,
+		    int workers);
+void asmgen_free_source(struct ASMSource *src);
+const struct ASMLine *asmgen_find_line(struct ASMSource *src, int linenum);
+int asmgen_reassemble_line(struct SymTab **curSyms,
+			   const struct ASMSource *src,
+			   const struct ASMLine *line,
+			   const char *oldText, size_t oldLen,
+			   const char *newText, size_t newLen,
+			   struct Image *image);
+int asmgen_assemble_onepass(struct SymTab **curSyms,
+			    FILE *input,
+			    const char *name,
+			    struct Image *image);
+int asmgen_assemble_object(struct SymTab **curSyms,
+			   FILE *input,
+			   const char *name,
+			   struct Image *image,
+			   struct FixupList *relocs);
+int asmgen_resolve_fixups(struct SymTab **curSyms,
+			  struct FixupList *fixups,
+			  struct Image *image);
+void asmgen_free_fixups(struct FixupList *fixups);
 
 /* file output */
-int asmout_make_rom(struct SymTab **curSyms, char *out, char *data);
-int asmout_make_mif(struct SymTab **curSyms, char *out, char *data);
+int asmout_make_rom(struct SymTab **curSyms, char *out, struct Image *img,
+		    int workers);
+int asmout_make_mif(struct SymTab **curSyms, char *out, struct Image *img,
+		    int workers);
+int asmout_make_bin(struct SymTab **curSyms, char *out, struct Image *img,
+		    int workers);
+int asmout_make_ihex(struct SymTab **curSyms, char *out, struct Image *img,
+		     int workers);
+int asmout_make_memh(struct SymTab **curSyms, char *out, struct Image *img,
+		     int workers);
+int asmout_make_memb(struct SymTab **curSyms, char *out, struct Image *img,
+		     int workers);
+const struct ASMOutFormat *asmout_find_format(const char *name);
 
 #endif
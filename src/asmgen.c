@@ -1,126 +1,689 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "asm.h"
 #include "directive.h"
+#include "depend.h"
 
+/*
+ * asmgen_parse_value
+ *    read one operand off the scanner and evaluate it straight
+ * away, for directives. instructions compile theirs with
+ * expr_compile, into space kept between operands.
+ *
+ * returns 0 on success, nonzero on failure
+ */
 int asmgen_parse_value(struct ScanData *scanner,
 		       struct SymTab **curSyms,
 		       unsigned int *pResult) {
-  struct Token curToken;
-  unsigned int lval, rval;
+  struct ExprCode code;
+  int ret;
   
-  /* scan next token or expression */
-  switch (get_token(&curToken, scanner)) {
-    
-  case TOK_INT:
-    /* integer value, just pass it back */
-    DEBUG(1) printf("Got an integer - %d\n", curToken.value);
-    lval = curToken.value;
-    if (curToken.limHigh - curToken.limLow < 8*sizeof(lval) - 1) {
-      /* if token is specified with a bitslice, use only those bits */
-      lval = GETBITS(curToken.limLow, curToken.limHigh, lval);
-    }
-    *pResult = lval;
-    return 0;
-    break;
-    
-  case TOK_IDENT:
-    /* identifier, locate it in the symbol table */
-    DEBUG(1) printf("Got a symbol lookup - '%s'\n", curToken.token);
-    if (symtab_lookup(curSyms, curToken.token, NULL, (int*)&lval) == 0) {
-      /* symbol table lookup success */
-      if (curToken.limHigh - curToken.limLow < 8*sizeof(lval) - 1) {
-	/* if token is specified with a bitslice, use only those bits */
-	lval = GETBITS(curToken.limLow, curToken.limHigh, lval);
-      }
-      *pResult = lval;
+  memset(&code, 0, sizeof(code));
+  ret = expr_compile(scanner, &code);
+  if (ret == 0) {
+    ret = expr_eval(curSyms, &code, 0, code.count, pResult);
+  }
+  expr_free(&code);
+  return ret;
+}
+
+/* note that a run of tokens starts here */
+static int asmgen_add_chunk(struct ASMSource *src, unsigned int offset,
+			    const struct ASMArch *arch) {
+  struct ASMChunk *newlist, *chunk;
+  unsigned int newsize;
+
+  if (src->numChunks == src->sizeChunks) {
+    newsize = (src->sizeChunks == 0) ? 64 : 2*src->sizeChunks;
+    newlist = REALLOC(src->chunks, newsize*sizeof(struct ASMChunk));
+    if (newlist == NULL) {
+      diag_printf(stderr, "ERROR - Memory allocation failed\n");
+      return -1;
+    }
+    src->chunks = newlist;
+    src->sizeChunks = newsize;
+  }
+
+  chunk = &src->chunks[src->numChunks++];
+  chunk->tok = src->toks.count;
+  chunk->offset = offset;
+  chunk->arch = arch;
+  chunk->data = src->numData;
+  return 0;
+}
+
+/* note that len bytes of code will be emitted at offset */
+static int asmgen_add_span(struct ASMSource *src, unsigned int offset,
+			   unsigned int len) {
+  struct ASMSpan *newlist, *span;
+  unsigned int newsize;
+
+  /* usually just carries on from the last one */
+  if (src->numSpans > 0) {
+    span = &src->spans[src->numSpans - 1];
+    if ((UINT64)span->base + span->len == offset) {
+      span->len += len;
       return 0;
     }
-    printf("ERROR - Symbol '%s' Not Found\n", curToken.token);
-    break;
-    
-  case TOK_LPAREN:
-    /* left parentheses, beginning of an arithmetic expression */
-    
-    /* start by evaluating first term (may be another expression */
-    if (asmgen_parse_value(scanner, curSyms, &lval) != 0) {
-      /* error parsing sub-expression */
-      printf("ERROR - Cannot Parse Arithmetic Expression\n");
+  }
+
+  if (src->numSpans == src->sizeSpans) {
+    newsize = (src->sizeSpans == 0) ? 16 : 2*src->sizeSpans;
+    newlist = REALLOC(src->spans, newsize*sizeof(struct ASMSpan));
+    if (newlist == NULL) {
+      diag_printf(stderr, "ERROR - Memory allocation failed\n");
       return -1;
     }
-    
-    /* inner loop to evalate left-to-right arithmetic expressions */
-    while (1) {
-      /* get next token */
-      switch (get_token(&curToken, scanner)) {
-	
-      case TOK_RPAREN:
-	/* close parentheses, end of sub-expression */
-	*pResult = lval;
-	return 0;
-	break;
-	
-      case TOK_ARITHOP:
-	/* arithmetic operation (+/-), get right hand value */
-	if (asmgen_parse_value(scanner, curSyms, &rval) != 0) {
-	  /* error parsing sub-expression */
-	  printf("ERROR - Cannot Parse Arithmetic Expression\n");
+    src->spans = newlist;
+    src->sizeSpans = newsize;
+  }
+
+  span = &src->spans[src->numSpans++];
+  span->base = offset;
+  span->len = len;
+  return 0;
+}
+
+/* note where an instruction line's code goes */
+static int asmgen_add_line(struct ASMSource *src, int linenum,
+			   unsigned int offset,
+			   const struct ASMEncoding *enc,
+			   const struct ASMArch *arch) {
+  struct ASMLine *newlist, *line;
+  unsigned int newsize;
+
+  if (src->numLines == src->sizeLines) {
+    newsize = (src->sizeLines == 0) ? 1024 : 2*src->sizeLines;
+    newlist = REALLOC(src->lines, newsize*sizeof(struct ASMLine));
+    if (newlist == NULL) {
+      diag_printf(stderr, "ERROR - Memory allocation failed\n");
+      return -1;
+    }
+    src->lines = newlist;
+    src->sizeLines = newsize;
+  }
+
+  line = &src->lines[src->numLines++];
+  line->linenum = linenum;
+  line->offset = offset;
+  line->byte_count = enc->byte_count;
+  line->arch = arch;
+  return 0;
+}
+
+void asmgen_free_source(struct ASMSource *src) {
+  unsigned int x;
+
+  tokstream_free(&src->toks);
+  free(src->chunks);
+  free(src->spans);
+  free(src->lines);
+  for (x=0; x<src->numData; x++) {
+    if (src->data[x].map != NULL) {
+      munmap(src->data[x].map, src->data[x].mapLen);
+    }
+  }
+  free(src->data);
+  memset(src, 0, sizeof(struct ASMSource));
+}
+
+/* the instruction on a given line, NULL if there is none */
+const struct ASMLine *asmgen_find_line(struct ASMSource *src, int linenum) {
+  int lo = 0, hi = (int)src->numLines - 1, mid;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (src->lines[mid].linenum == linenum) {
+      return &src->lines[mid];
+    }
+    if (src->lines[mid].linenum < linenum) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid - 1;
+    }
+  }
+  return NULL;
+}
+
+/* directives placing data, rather than setting anything up */
+typedef enum {
+  DATA_NONE, DATA_LIST, DATA_FILL, DATA_SPACE, DATA_INCBIN } DataKind;
+
+static const struct {
+  const char *name;
+  DataKind kind;
+  unsigned int unit;		/* bytes per value */
+} asmgen_data_dirs[] = {
+  { ".db", DATA_LIST, 1 },
+  { ".dw", DATA_LIST, 2 },
+  { ".dd", DATA_LIST, 4 },
+  { ".fill", DATA_FILL, 1 },
+  { ".space", DATA_SPACE, 1 },
+  { ".incbin", DATA_INCBIN, 1 },
+  { NULL, DATA_NONE, 0 }
+};
+
+/* most operands a .fill or the like takes */
+#define ASMGEN_DATA_ARGS 3
+
+/* which data directive a token is, DATA_NONE if not one */
+static DataKind asmgen_data_kind(const struct Token *tok, unsigned int *pUnit) {
+  int x;
+
+  for (x=0; asmgen_data_dirs[x].name != NULL; x++) {
+    if (strcmp(asmgen_data_dirs[x].name, TOKSTR(tok)) == 0) {
+      *pUnit = asmgen_data_dirs[x].unit;
+      return asmgen_data_dirs[x].kind;
+    }
+  }
+  return DATA_NONE;
+}
+
+/* get a pointer to len bytes of output at offset. a shared image
+ * is only written where space was reserved for it */
+static char *asmgen_out(struct Image *image,
+			int shared,
+			unsigned int offset,
+			unsigned int len) {
+  char *out;
+
+  out = shared ? image_locate(image, offset, len) :
+    image_span(image, offset, len);
+  if (out == NULL) {
+    diag_printf(stderr, "ERROR - No room for output at offset 0x%x\n", offset);
+  }
+  return out;
+}
+
+/* remember a value to fill in later, its operand is the last thing
+ * compiled into the fixup list's code. the caller adds the fields */
+static struct Fixup *asmgen_new_fixup(struct FixupList *fixups,
+				      unsigned int offset,
+				      unsigned int byte_count,
+				      unsigned int width,
+				      unsigned int first,
+				      const struct Token *at) {
+  struct Fixup *fix, *newlist;
+  unsigned int newsize;
+  
+  if (fixups->count == fixups->size) {
+    newsize = (fixups->size == 0) ? 64 : 2*fixups->size;
+    newlist = REALLOC(fixups->list, newsize*sizeof(struct Fixup));
+    if (newlist == NULL) {
+      diag_printf(stderr, "ERROR - Memory allocation failed\n");
+      return NULL;
+    }
+    fixups->list = newlist;
+    fixups->size = newsize;
+  }
+  
+  fix = &fixups->list[fixups->count++];
+  fix->offset = offset;
+  fix->byte_count = byte_count;
+  fix->width = width;
+  fix->num_fields = 0;
+  fix->file = at->file;
+  fix->linenum = at->linenum;
+  fix->first = first;
+  fix->count = fixups->code.count - first;
+  return fix;
+}
+
+/* check a value fits in unit bytes, taken as signed or unsigned */
+static int asmgen_data_fits(unsigned int unit, uint32_t value) {
+  uint32_t limit;
+
+  if (unit >= 4) {
+    return 1;
+  }
+  limit = (uint32_t)1 << (8*unit - 1);
+  return (value < 2*limit) || (value >= (uint32_t)0 - limit);
+}
+
+/*
+ * asmgen_data_list
+ *    place the values of a .db, .dw or .dd, unit bytes each and most
+ * significant byte first, as instructions are, reading them up to
+ * and including the end of line. .db takes strings as well, a byte
+ * per character. with no image, values are only counted, for the
+ * first pass. if fixups is given, its code is used instead, and
+ * values that cannot be worked out yet (or that use labels, when
+ * relocating) are left zero and kept to be patched later.
+ *
+ * returns 0 on success, nonzero on failure. *pLen is set to the
+ * bytes placed
+ */
+static int asmgen_data_list(struct ScanData *scanner,
+			    struct SymTab **curSyms,
+			    unsigned int unit,
+			    const struct Token *at,
+			    unsigned int offset,
+			    struct ExprCode *code,
+			    struct FixupList *fixups,
+			    struct Image *image,
+			    int shared,
+			    unsigned int *pLen) {
+  struct Token curToken;
+  struct Fixup *fix;
+  unsigned int first, value, n, x;
+  UINT64 len = 0;
+  TokenType ttype;
+  char *out;
+  
+  if (fixups != NULL) {
+    code = &fixups->code;
+  }
+  
+  do {
+    if ((unit == 1) && (peek_token(scanner) == TOK_STRING)) {
+      /* bytes of a string, as they are */
+      get_token(&curToken, scanner);
+      n = INTERN_LEN(curToken.str);
+      if (offset + len + n > 0xffffffffULL) {
+	diag_printf(stderr, "ERROR - Data runs past the end of memory, %s:%d\n",
+		    TOKPOS(at));
+	return -1;
+      }
+      if ((image != NULL) && (n > 0)) {
+	if ((out = asmgen_out(image, shared, offset + len, n)) == NULL) {
 	  return -1;
 	}
-	
-	/* handle arithmetic operation */
-	switch (curToken.token[0]) {
-	case '+':
-	  lval += rval;
-	  break;
-	case '-':
-	  lval -= rval;
-	  break;
-	default:
-	  /* unhandled */
-	  printf("ERROR - Unknown Arithmetic operation '%s'\n", curToken.token);
+	memcpy(out, TOKSTR(&curToken), n);
+      }
+      len += n;
+    }
+    else {
+      first = code->count;
+      if (expr_compile(scanner, code) != 0) {
+	diag_printf(stderr, "ERROR - Bad value in data, %s:%d\n", TOKPOS(at));
+	return -1;
+      }
+      if (offset + len + unit > 0xffffffffULL) {
+	diag_printf(stderr, "ERROR - Data runs past the end of memory, %s:%d\n",
+		    TOKPOS(at));
+	return -1;
+      }
+      if (image == NULL) {
+	/* counting, the value is worked out later */
+	code->count = first;
+	len += unit;
+      }
+      else if ((fixups != NULL) &&
+	       (!expr_resolvable(curSyms, code, first, code->count - first) ||
+		(fixups->relocate &&
+		 expr_uses(&fixups->labels, code, first, code->count - first)))) {
+	/* forward reference or a label to relocate, fill it in later */
+	fix = asmgen_new_fixup(fixups, offset + len, unit, 8*unit, first,
+			       at);
+	if ((fix == NULL) ||
+	    ((out = asmgen_out(image, shared, offset + len, unit)) == NULL)) {
 	  return -1;
-	  break;
 	}
-	break;
-	
-      default:
-	printf("ERROR - Unexpected token '%s' while parsing subexpression\n",
-	       curToken.token);
-	return -1;
-	break;
+	fix->fieldOffset[fix->num_fields++] = 0;
+	memset(out, 0, unit);
+	len += unit;
+      }
+      else {
+	if (expr_eval(curSyms, code, first, code->count - first,
+		      &value) != 0) {
+	  diag_printf(stderr, "ERROR - Bad value in data, %s:%d\n", TOKPOS(at));
+	  return -1;
+	}
+	code->count = first;		/* done with it */
+	if (!asmgen_data_fits(unit, value)) {
+	  diag_printf(stdout, "WARNING - Value 0x%x not representable with %d bits, %s:%d\n",
+		      value, 8*unit, TOKPOS(at));
+	}
+	if ((out = asmgen_out(image, shared, offset + len, unit)) == NULL) {
+	  return -1;
+	}
+	for (x=0; x<unit; x++) {
+	  out[x] = GETBITS(8*(unit-1-x), 8*(unit-1-x)+7, value);
+	}
+	len += unit;
       }
     }
-    break;
-    
-  default:
-    /* unknown token */
-    printf("Unhandled token \'%s\'\n", curToken.token);
-    break;
+    ttype = get_token(&curToken, scanner);
+  } while (ttype == TOK_COMMA);
+  
+  if (ttype != TOK_ENDL) {
+    diag_printf(stderr, "ERROR - Bad token %s at end of line, %s:%d\n",
+		TOKSTR(&curToken), TOKPOS(&curToken));
+    return -1;
   }
-  return -1;
+  *pLen = len;
+  return 0;
 }
 
-int asmgen_parse_syms(struct SymTab **curSyms,
-		      FILE *handle) {
-  struct ScanData asmScan;
-  unsigned int offset = 0;
+/* read the comma separated values ending a .fill or the like, up
+ * to and including the end of line, returning how many or -1 */
+static int asmgen_data_args(struct ScanData *scanner,
+			    struct SymTab **curSyms,
+			    struct SymTab **labels,
+			    const struct Token *at,
+			    int max,
+			    uint32_t *args) {
+  struct ExprCode code;
   struct Token curToken;
   TokenType ttype;
-  struct ASMRecord *rec, *asmrec = NULL;
-  int found;
+  int count = 0, ret = 0;
   
-  /* set up the scanner */
-  SCANNER_INIT(&asmScan,handle);
+  memset(&code, 0, sizeof(code));
+  do {
+    if (count == max) {
+      diag_printf(stderr, "ERROR - Too many operands, %s:%d\n", TOKPOS(at));
+      ret = -1;
+      break;
+    }
+    code.count = 0;
+    if ((expr_compile(scanner, &code) != 0) ||
+	(expr_eval(curSyms, &code, 0, code.count, &args[count]) != 0)) {
+      diag_printf(stderr, "ERROR - Argument %d bad, %s:%d\n",
+		  count, TOKPOS(at));
+      ret = -1;
+      break;
+    }
+    if ((labels != NULL) && expr_uses(labels, &code, 0, code.count)) {
+      diag_printf(stderr, "ERROR - Argument %d uses a label, which an object file cannot move here, %s:%d\n",
+		  count, TOKPOS(at));
+      ret = -1;
+      break;
+    }
+    count += 1;
+    ttype = get_token(&curToken, scanner);
+  } while (ttype == TOK_COMMA);
+  expr_free(&code);
+  
+  if ((ret == 0) && (ttype != TOK_ENDL)) {
+    diag_printf(stderr, "ERROR - Bad token %s at end of line, %s:%d\n",
+		TOKSTR(&curToken), TOKPOS(&curToken));
+    ret = -1;
+  }
+  return (ret == 0) ? count : -1;
+}
+
+/* map (part of) the file a string token names for .incbin, noting
+ * it as something the build depends on. a relative name is taken
+ * from the directory of the file holding the token. off and len
+ * are -1 if not given */
+static int asmgen_data_file(const struct Token *at,
+			    UINT64 off,
+			    UINT64 len,
+			    struct ASMData *data) {
+  const char *name = TOKSTR(at);
+  char where[PATH_MAX], path[PATH_MAX];
+  struct stat info;
+  void *map;
+  int fd;
+  
+  if ((scan_path(where, at->file, name) != 0) ||
+      (realpath(where, path) == NULL) || ((fd = open(path, O_RDONLY)) < 0)) {
+    diag_printf(stderr, "ERROR - Could not open %s, %s:%d\n", name, TOKPOS(at));
+    return -1;
+  }
+  if ((fstat(fd, &info) != 0) || !S_ISREG(info.st_mode)) {
+    diag_printf(stderr, "ERROR - %s is not a file, %s:%d\n", name, TOKPOS(at));
+    close(fd);
+    return -1;
+  }
+  if (off == (UINT64)-1) {
+    off = 0;
+  }
+  if ((off > (UINT64)info.st_size) ||
+      ((len != (UINT64)-1) && (len > (UINT64)info.st_size - off))) {
+    diag_printf(stderr, "ERROR - %s is too short, %s:%d\n", name, TOKPOS(at));
+    close(fd);
+    return -1;
+  }
+  if (len == (UINT64)-1) {
+    len = info.st_size - off;
+  }
+  
+  data->len = len;
+  if (len > 0) {
+    map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      diag_printf(stderr, "ERROR - Could not map %s, %s:%d\n", name, TOKPOS(at));
+      close(fd);
+      return -1;
+    }
+    data->map = map;
+    data->mapLen = info.st_size;
+    data->bytes = (const char *)map + off;
+  }
+  close(fd);
+  return depend_note(path, 0);
+}
+
+static void asmgen_free_data(struct ASMData *data) {
+  if (data->map != NULL) {
+    munmap(data->map, data->mapLen);
+  }
+  memset(data, 0, sizeof(struct ASMData));
+}
+
+/*
+ * asmgen_data_layout
+ *    read the operands of a .fill, .space or .incbin, up to and
+ * including the end of line, and work out what it places. these
+ * take values known where they appear, as .define does, and no
+ * labels when relocating (labels is set then), as they could not
+ * be moved. free the result with asmgen_free_data.
+ *
+ *    .fill count[, size[, value]]	count values of size bytes
+ *    .space count[, value]		count bytes
+ *    .incbin "file"[, offset[, length]]	bytes of a file
+ *
+ * returns 0 on success, nonzero on failure
+ */
+static int asmgen_data_layout(struct ScanData *scanner,
+			      struct SymTab **curSyms,
+			      struct SymTab **labels,
+			      const struct Token *dirToken,
+			      DataKind kind,
+			      unsigned int offset,
+			      struct ASMData *data) {
+  uint32_t args[ASMGEN_DATA_ARGS];
+  struct Token curToken, name;
+  UINT64 len;
+  int count;
+  
+  memset(data, 0, sizeof(struct ASMData));
+  data->unit = 1;
+  
+  if (kind == DATA_INCBIN) {
+    /* file name, then maybe which part of it */
+    if (get_token(&curToken, scanner) != TOK_STRING) {
+      diag_printf(stderr, "ERROR - Unexpected Token %s, %s:%d\n",
+		  TOKSTR(&curToken), TOKPOS(&curToken));
+      return -1;
+    }
+    name = curToken;
+    count = 0;
+    if (get_token(&curToken, scanner) == TOK_COMMA) {
+      count = asmgen_data_args(scanner, curSyms, labels, dirToken,
+			       2, args);
+    }
+    else if (curToken.type != TOK_ENDL) {
+      diag_printf(stderr, "ERROR - Bad token %s at end of line, %s:%d\n",
+		  TOKSTR(&curToken), TOKPOS(&curToken));
+      return -1;
+    }
+    if ((count < 0) ||
+	(asmgen_data_file(&name,
+			  (count > 0) ? args[0] : (UINT64)-1,
+			  (count > 1) ? args[1] : (UINT64)-1, data) != 0)) {
+      return -1;
+    }
+    len = data->len;
+  }
+  else {
+    count = asmgen_data_args(scanner, curSyms, labels, dirToken,
+			     (kind == DATA_FILL) ? 3 : 2, args);
+    if (count < 0) {
+      return -1;
+    }
+    if (kind == DATA_FILL) {
+      data->unit = (count > 1) ? args[1] : 1;
+      data->value = (count > 2) ? args[2] : 0;
+    }
+    else {
+      data->value = (count > 1) ? args[1] : 0;
+    }
+    if ((data->unit != 1) && (data->unit != 2) && (data->unit != 4)) {
+      diag_printf(stderr, "ERROR - Size must be 1, 2 or 4, %s:%d\n",
+		  TOKPOS(dirToken));
+      return -1;
+    }
+    len = (UINT64)args[0] * data->unit;
+    if ((UINT64)offset + len <= 0xffffffffULL) {
+      data->len = len;
+    }
+  }
+  
+  if ((UINT64)offset + len > 0xffffffffULL) {
+    diag_printf(stderr, "ERROR - Data runs past the end of memory, %s:%d\n",
+		TOKPOS(dirToken));
+    asmgen_free_data(data);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * asmgen_data_place
+ *    copy what a .fill, .space or .incbin places into the image at
+ * offset, a multi-byte value most significant byte first.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+static int asmgen_data_place(struct Image *image,
+			     int shared,
+			     unsigned int offset,
+			     const struct ASMData *data) {
+  unsigned int x, done, n;
+  char pattern[4], *out;
+  
+  if (data->len == 0) {
+    return 0;
+  }
+  if ((out = asmgen_out(image, shared, offset, data->len)) == NULL) {
+    return -1;
+  }
+  if (data->bytes != NULL) {
+    memcpy(out, data->bytes, data->len);
+    return 0;
+  }
+  for (x=0; x<data->unit; x++) {
+    pattern[x] = GETBITS(8*(data->unit-1-x), 8*(data->unit-1-x)+7,
+			 data->value);
+  }
+  if (memcmp(pattern, &pattern[1], data->unit - 1) == 0) {
+    /* the same byte throughout */
+    memset(out, pattern[0], data->len);
+    return 0;
+  }
+  
+  /* one value, then copies of what is done so far */
+  memcpy(out, pattern, data->unit);
+  for (done=data->unit; done<data->len; done+=n) {
+    n = (done < data->len - done) ? done : data->len - done;
+    memcpy(&out[done], out, n);
+  }
+  return 0;
+}
+
+/* first pass over a data directive, working out how many bytes it
+ * places, and keeping the layout of any but a list for the second */
+static int asmgen_data_size(struct ScanData *scanner,
+			    struct SymTab **curSyms,
+			    struct ASMSource *src,
+			    const struct Token *dirToken,
+			    DataKind kind,
+			    unsigned int unit,
+			    unsigned int offset,
+			    unsigned int *pLen) {
+  struct ASMData data, *newlist;
+  struct ExprCode code;
+  unsigned int newsize;
+  int ret;
+  
+  if (kind == DATA_LIST) {
+    memset(&code, 0, sizeof(code));
+    ret = asmgen_data_list(scanner, curSyms, unit, dirToken, offset,
+			   &code, NULL, NULL, 0, pLen);
+    expr_free(&code);
+    return ret;
+  }
+  
+  if (asmgen_data_layout(scanner, curSyms, NULL, dirToken, kind, offset,
+			 &data) != 0) {
+    return -1;
+  }
+  *pLen = data.len;
+  if (src == NULL) {
+    asmgen_free_data(&data);
+    return 0;
+  }
+  
+  if (src->numData == src->sizeData) {
+    newsize = (src->sizeData == 0) ? 16 : 2*src->sizeData;
+    newlist = REALLOC(src->data, newsize*sizeof(struct ASMData));
+    if (newlist == NULL) {
+      diag_printf(stderr, "ERROR - Memory allocation failed\n");
+      asmgen_free_data(&data);
+      return -1;
+    }
+    src->data = newlist;
+    src->sizeData = newsize;
+  }
+  src->data[src->numData++] = data;
+  return 0;
+}
+
+/*
+ * asmgen_first_pass
+ *    records labels and the size of the program, reading from the
+ * given scanner until it runs out, then stopping it. if src is
+ * given, every token scanned is appended to it, so the second pass
+ * can replay them instead of scanning the input again, along with
+ * where runs of whole lines start and where code goes, so the
+ * second pass can split the work up.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+static int asmgen_first_pass(struct SymTab **curSyms,
+			     struct ScanData *scanner,
+			     struct ASMSource *src) {
+  unsigned int offset = 0, unit, len;
+  UINT64 highest = 0;
+  struct Token curToken;
+  TokenType ttype;
+  DataKind kind;
+  const struct ASMEncoding *enc;
+  const struct ASMArch *asmrec = NULL;
+  
+  if (src != NULL) {
+    scanner->record = &src->toks;
+    src->file = scanner->file;
+    asmgen_add_chunk(src, 0, NULL);
+  }
   
   /* main loop */
   while (1) {
-    switch (get_token(&curToken, &asmScan)) {
+    switch (get_token(&curToken, scanner)) {
       
     case TOK_EOF:
       /* end of file */
-      SCANNER_STOP(&asmScan);
+      SCANNER_STOP(scanner);
       
       /* make a special symbol to note size of assembled file */
       symtab_record(curSyms, "$filesize", NULL, offset);
@@ -129,7 +692,7 @@ int asmgen_parse_syms(struct SymTab **curSyms,
       
     case TOK_LABEL:
       /* hit a line label */
-      symtab_record(curSyms, curToken.token, NULL, offset);
+      symtab_record_id(curSyms, curToken.str, NULL, offset);
       break;
       
     case TOK_ENDL:
@@ -137,63 +700,365 @@ int asmgen_parse_syms(struct SymTab **curSyms,
       break;
       
     case TOK_DIRECTIVE:
+      if ((kind = asmgen_data_kind(&curToken, &unit)) != DATA_NONE) {
+	/* data, only sized for now */
+	if (asmgen_data_size(scanner, curSyms, src, &curToken, kind, unit,
+			     offset, &len) != 0) {
+	  SCANNER_STOP(scanner);
+	  return -1;
+	}
+	if ((src != NULL) && (len > 0)) {
+	  if (offset < highest) {
+	    src->overlap = 1;
+	  }
+	  asmgen_add_span(src, offset, len);
+	}
+	offset += len;
+	if (offset > highest) {
+	  highest = offset;
+	}
+	break;
+      }
+      
       /* directive, pass current data to directive handler */
-      directive_parse(&asmScan, &curToken, curSyms, &asmrec, &offset);
+      if (directive_parse(scanner, &curToken, curSyms, &asmrec,
+			  &offset) != 0) {
+	SCANNER_STOP(scanner);
+	return -1;
+      }
       break;
       
     case TOK_IDENT:
       /* assume to be an assembly mnemonic */
-      DEBUG(3) printf("Got identifier - %s\n", curToken.token);
+      DEBUG(3) printf("Got identifier - %s\n", TOKSTR(&curToken));
       
-      /* find mnemonic in record */
-      found = 0;
-      for (rec=asmrec; (found==0)&&(rec!=NULL); rec=rec->next) {
-	if (strcmp(curToken.token, rec->mnemonic) == 0) {
-	  found = 1;
-	  offset += rec->byte_count;
-	  /* scan tokens until end of line */
-	  do {
-	    ttype = get_token(&curToken, &asmScan);
-	  } while ((ttype != TOK_EOF) && (ttype != TOK_ENDL));
+      /* find mnemonic in index */
+      if ((enc = asmrec_find(asmrec, curToken.str)) == NULL) {
+	diag_printf(stderr, "ERROR - mnemonic %s not found, %s:%d\n",
+		    TOKSTR(&curToken), TOKPOS(&curToken));
+	SCANNER_STOP(scanner);
+	return -1;
+      }
+      if (src != NULL) {
+	if (offset < highest) {
+	  /* written over later, so order matters in pass 2 */
+	  src->overlap = 1;
+	}
+	asmgen_add_span(src, offset, enc->byte_count);
+	if (src->keepLines && (scanner->depth == 0)) {
+	  /* only lines of the program itself can be redone */
+	  asmgen_add_line(src, curToken.linenum, offset, enc, asmrec);
 	}
       }
-      if (found == 0) {
-	fprintf(stderr, "ERROR - mnemonic %s not found\n", curToken.token);
-	SCANNER_STOP(&asmScan);
-	return -1;
+      offset += enc->byte_count;
+      if (offset > highest) {
+	highest = offset;
       }
+      
+      /* scan tokens until end of line */
+      do {
+	ttype = get_token(&curToken, scanner);
+      } while ((ttype != TOK_EOF) && (ttype != TOK_ENDL));
       break;
       
     default:
-      fprintf(stderr, "Unexpected Token %s, line %d\n",
-	      curToken.token, curToken.linenum);
-      SCANNER_STOP(&asmScan);
+      diag_printf(stderr, "Unexpected Token %s, %s:%d\n",
+		  TOKSTR(&curToken), TOKPOS(&curToken));
+      SCANNER_STOP(scanner);
       return -1;
       break;
     }
+    
+    /* at the start of a line, maybe begin a new chunk */
+    if ((src != NULL) && (scanner->tokCount == 0) &&
+	(src->toks.count - src->chunks[src->numChunks-1].tok >=
+	 ASMGEN_CHUNK_TOKENS)) {
+      asmgen_add_chunk(src, offset, asmrec);
+    }
   }
 }
 
-int asmgen_assemble(struct SymTab **curSyms,
-		    FILE *input,
-		    char *data) {
+/* first pass, over an input file. name is what messages call it,
+ * and where files it names are found from */
+int asmgen_parse_syms(struct SymTab **curSyms,
+		      FILE *handle,
+		      const char *name,
+		      struct ASMSource *src) {
+  struct ScanData asmScan;
+  struct stat info;
+  
+  /* pre-size the symbol table from the size of the source, so
+   * large programs do not rehash as labels are recorded */
+  if ((fstat(fileno(handle), &info) == 0) && S_ISREG(info.st_mode)) {
+    symtab_reserve(curSyms, info.st_size / SYMTAB_BYTES_PER_SYM);
+  }
+  
+  /* set up the scanner */
+  SCANNER_INIT(&asmScan,handle);
+  if (scan_name(&asmScan, name) != 0) {
+    SCANNER_STOP(&asmScan);
+    return -1;
+  }
+  return asmgen_first_pass(curSyms, &asmScan, src);
+}
+
+/* first pass, over source text in memory, named as for
+ * asmgen_parse_syms (NULL if it is not from a file) */
+int asmgen_parse_text(struct SymTab **curSyms,
+		      const char *text,
+		      size_t len,
+		      const char *name,
+		      struct ASMSource *src) {
+  struct ScanData asmScan;
+  
+  symtab_reserve(curSyms, len / SYMTAB_BYTES_PER_SYM);
+  SCANNER_INIT_TEXT(&asmScan, text, len);
+  if (scan_name(&asmScan, name) != 0) {
+    SCANNER_STOP(&asmScan);
+    return -1;
+  }
+  return asmgen_first_pass(curSyms, &asmScan, src);
+}
+
+/* bits to OR into an instruction for every field using an argument,
+ * run straight off the encoder program */
+static uint32_t asmgen_field_bits(const struct ASMEncoding *instr,
+				  unsigned int argCount,
+				  unsigned int value) {
+  const struct FieldOp *op, *end;
+  uint32_t outBits = 0;
+  
+  /* the usual case, one field per argument */
+  if (instr->fixed) {
+    op = &instr->ops[argCount];
+    return (value & op->mask) << op->shift;
+  }
+  
+  end = &instr->ops[instr->arg_first[argCount+1]];
+  for (op = &instr->ops[instr->arg_first[argCount]]; op < end; op++) {
+    DEBUG(1) printf("Field at offset %d uses arg %d (value 0x%x)\n",
+		    op->shift, argCount, value);
+    outBits |= (value & op->mask) << op->shift;
+  }
+  return outBits;
+}
+
+/* remember a field to fill in later, its operand is the last
+ * thing compiled into the fixup list's code */
+static int asmgen_add_fixup(struct FixupList *fixups,
+			    const struct ASMEncoding *instr,
+			    unsigned int argCount,
+			    unsigned int offset,
+			    unsigned int first,
+			    const struct Token *at) {
+  struct Fixup *fix;
+  unsigned int x;
+  
+  fix = asmgen_new_fixup(fixups, offset, instr->byte_count,
+			 instr->arg_widths[argCount], first, at);
+  if (fix == NULL) {
+    return -1;
+  }
+  for (x=instr->arg_first[argCount]; x<instr->arg_first[argCount+1]; x++) {
+    fix->fieldOffset[fix->num_fields++] = instr->ops[x].shift;
+  }
+  return 0;
+}
+
+/* write an assembled instruction out, most significant byte first.
+ * a shared image is only written where space was reserved for it */
+static int asmgen_emit(struct Image *image,
+		       int shared,
+		       unsigned int offset,
+		       const struct ASMEncoding *instr,
+		       uint32_t outBits) {
+  char *out;
+  int x;
+  
+  DEBUG(1) printf("Outputting %d bytes\n", instr->byte_count);
+  out = asmgen_out(image, shared, offset, instr->byte_count);
+  if (out == NULL) {
+    return -1;
+  }
+  for (x=(instr->byte_count-1); x>=0; x--) {
+    *out = GETBITS(8*x,(8*x)+7, outBits);
+    DEBUG(1) printf("Assembled %02x\n", *out);
+    out += 1;
+  }
+  return 0;
+}
+
+/*
+ * asmgen_encode
+ *    assemble the operands of one instruction off the scanner, up to
+ * and including the end of line. operands are compiled into code,
+ * and dropped again once evaluated. if fixups is given, its code is
+ * used instead, and operands that reference symbols not defined yet
+ * (or labels, when relocating) are left zero, and kept to be patched
+ * once they are.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+static int asmgen_encode(struct ScanData *scanner,
+			 struct SymTab **curSyms,
+			 const struct ASMEncoding *instr,
+			 const struct Token *at,
+			 unsigned int offset,
+			 struct ExprCode *code,
+			 struct FixupList *fixups,
+			 uint32_t *pBits) {
+  struct Token curToken;
+  unsigned int argCount, value, first;
+  uint32_t outBits;
+  int ret;
+  
+  if (fixups != NULL) {
+    code = &fixups->code;
+  }
+  
+  outBits = instr->asm_mask;
+  for (argCount=0; argCount<instr->num_args; argCount++) {
+    /* compile next token or parenthesized expression */
+    first = code->count;
+    ret = expr_compile(scanner, code);
+    if ((ret == 0) && (fixups != NULL) &&
+	(!expr_resolvable(curSyms, code, first, code->count - first) ||
+	 (fixups->relocate &&
+	  expr_uses(&fixups->labels, code, first, code->count - first)))) {
+      /* forward reference or a label to relocate, fill it in later */
+      if (asmgen_add_fixup(fixups, instr, argCount, offset,
+			   first, at) != 0) {
+	return -1;
+      }
+      continue;
+    }
+    if (ret == 0) {
+      ret = expr_eval(curSyms, code, first, code->count - first, &value);
+    }
+    code->count = first;		/* done with it */
+    if (ret != 0) {
+      diag_printf(stderr, "ERROR - Argument %d bad, %s:%d\n",
+		  argCount, TOKPOS(at));
+      return -1;
+    }
+    if (CHECK_FIELD_TOO_SMALL(instr->arg_widths[argCount], value)) {
+      diag_printf(stdout, "WARNING - Value 0x%x not representable with %d bits, %s:%d\n",
+		  value, instr->arg_widths[argCount], TOKPOS(at));
+    }
+    
+    /* token OK, fill in all fields using this */
+    outBits |= asmgen_field_bits(instr, argCount, value);
+  }
+  
+  /* expect the newline at the end */
+  if (get_token(&curToken, scanner) != TOK_ENDL) {
+    diag_printf(stderr, "ERROR - Bad token %s at end of line, %s:%d\n",
+		TOKSTR(&curToken), TOKPOS(&curToken));
+    return -1;
+  }
+  
+  *pBits = outBits;
+  return 0;
+}
+
+/*
+ * asmgen_resolve_fixups
+ *    patch every recorded fixup into the image, now that all
+ * symbols are known. the linker uses this for relocations too.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int asmgen_resolve_fixups(struct SymTab **curSyms,
+			  struct FixupList *fixups,
+			  struct Image *image) {
+  struct Fixup *fix;
+  unsigned int x, value;
+  uint32_t outBits;
+  char *out;
+  int y;
+  
+  for (x=0; x<fixups->count; x++) {
+    fix = &fixups->list[x];
+    if (expr_eval(curSyms, &fixups->code, fix->first, fix->count,
+		  &value) != 0) {
+      diag_printf(stderr, "ERROR - Unresolved argument, %s:%d\n",
+		  INTERN_STR(fix->file), fix->linenum);
+      return -1;
+    }
+    if (CHECK_FIELD_TOO_SMALL(fix->width, value)) {
+      diag_printf(stdout, "WARNING - Value 0x%x not representable with %d bits, %s:%d\n",
+		  value, fix->width, INTERN_STR(fix->file), fix->linenum);
+    }
+    
+    /* fields were left zero when emitted, so just OR them in */
+    outBits = 0;
+    for (y=0; y<fix->num_fields; y++) {
+      outBits |= (value & FIELD_MASK(fix->width)) << fix->fieldOffset[y];
+    }
+    if ((out = image_span(image, fix->offset, fix->byte_count)) == NULL) {
+      return -1;
+    }
+    for (y=(fix->byte_count-1); y>=0; y--) {
+      *out |= GETBITS(8*y,(8*y)+7, outBits);
+      out += 1;
+    }
+  }
+  return 0;
+}
+
+/* shared state of a parallel second pass */
+struct AsmgenPool {
+  struct SymTab **curSyms;
+  struct ASMSource *src;
+  struct Image *image;
+  unsigned int next;		/* next chunk to hand out */
+  int failed;
+  struct Stats *stats;		/* caller's, to add the workers' into */
+  struct InternTable *names;	/* caller's, for the ids in the tokens */
+  struct ArchRegistry *archs;	/* caller's, should .arch load any */
+  struct IncludeCache *includes;
+  pthread_mutex_t lock;
+};
+
+/*
+ * asmgen_assemble_chunk
+ *    second pass over tokens first up to last, starting at the given
+ * offset and architecture. the symbol table is only read, and the
+ * image only written where space has been reserved, so chunks can
+ * be assembled side by side.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+static int asmgen_assemble_chunk(struct SymTab **curSyms,
+				 struct ASMSource *src,
+				 unsigned int first,
+				 unsigned int last,
+				 unsigned int offset,
+				 const struct ASMArch *asmcfg,
+				 unsigned int data,
+				 struct Image *image) {
   struct ScanData cfgScan;
   struct Token curToken;
-  struct ASMRecord *instr;
-  struct ASMRecord *asmcfg = NULL;
-  unsigned int argCount, fieldNum, value;
-  unsigned int offset = 0, outBits;
-  int x;
+  struct ExprCode code;
+  const struct ASMEncoding *instr;
+  unsigned int unit, len;
+  uint32_t outBits;
+  TokenType ttype;
+  DataKind kind;
   
-  /* set up the scanner */
-  SCANNER_INIT(&cfgScan, input);
+  /* set up the scanner to replay the first pass */
+  memset(&code, 0, sizeof(code));
+  SCANNER_INIT(&cfgScan, NULL);
+  SCANNER_REPLAY(&cfgScan, &src->toks.toks[first], last - first);
   
   /* try to assemble this thing */
   while (1) {
     switch (get_token(&curToken, &cfgScan)) {
       
     case TOK_EOF:
-      /* end of file, stop assembling */
+      /* end of chunk, stop assembling */
+      SCANNER_STOP(&cfgScan);
+      expr_free(&code);
       return 0;
       break;
       
@@ -203,78 +1068,425 @@ int asmgen_assemble(struct SymTab **curSyms,
       break;
       
     case TOK_DIRECTIVE:
-      /* directive, pass current data to directive handler */
-      directive_parse(&cfgScan, &curToken, NULL, &asmcfg, &offset);
+      kind = asmgen_data_kind(&curToken, &unit);
+      if (kind == DATA_LIST) {
+	if (asmgen_data_list(&cfgScan, curSyms, unit, &curToken,
+			     offset, &code, NULL, image, 1, &len) != 0) {
+	  SCANNER_STOP(&cfgScan);
+	  expr_free(&code);
+	  return -1;
+	}
+	offset += len;
+      }
+      else if (kind != DATA_NONE) {
+	/* laid out by the first pass, just copy it in */
+	do {
+	  ttype = get_token(&curToken, &cfgScan);
+	} while ((ttype != TOK_ENDL) && (ttype != TOK_EOF));
+	if ((data >= src->numData) ||
+	    (asmgen_data_place(image, 1, offset, &src->data[data]) != 0)) {
+	  SCANNER_STOP(&cfgScan);
+	  expr_free(&code);
+	  return -1;
+	}
+	offset += src->data[data++].len;
+      }
+      else {
+	/* directive, pass current data to directive handler */
+	directive_parse(&cfgScan, &curToken, NULL, &asmcfg, &offset);
+      }
       break;
       
     case TOK_IDENT:
       /* assume this is a format entry */
-      DEBUG(1) printf("\nAssembling mnemonic %s\n", curToken.token);
+      DEBUG(1) printf("\nAssembling mnemonic %s\n", TOKSTR(&curToken));
       
       /* find instruction layout */
-      for (instr = asmcfg; (instr!=NULL) &&
-	     (strcmp(instr->mnemonic, curToken.token) != 0);
-	     instr = instr->next) { }
+      instr = asmrec_find(asmcfg, curToken.str);
       
       /* shouldn't happen, but just in case */
       if (instr == NULL) {
-	printf("ERROR - Unexpected instruction %s\n", curToken.token);
+	diag_printf(stdout, "ERROR - Unexpected instruction %s\n", TOKSTR(&curToken));
+	SCANNER_STOP(&cfgScan);
+	expr_free(&code);
 	return -1;
       }
       
       /* got it, so start assembling */
       DEBUG(1) printf("Found format for instruction %s, %d bytes\n",
-		      curToken.token, instr->byte_count);
-
-      outBits = instr->asm_mask;
-      for (argCount=0; argCount<instr->num_args; argCount++) {
-	/* parse next token or parenthesized expression */
-	if (asmgen_parse_value(&cfgScan, curSyms, &value) != 0) {
-	  fprintf(stderr, "ERROR - Argument %d bad, line %d\n",
-		  argCount, curToken.linenum);
-	  return -1;
-	  }
-	if (CHECK_FIELD_TOO_SMALL(instr->arg_widths[argCount], value)) {
-	  printf("WARNING - Value 0x%x not representable with %d bits, line %d\n",
-		 value, instr->arg_widths[argCount], curToken.linenum);
-	}
-	
-	/* token OK, fill in all fields using this */
-	for (fieldNum=0; instr->fmt_args[fieldNum].argNum > -1; fieldNum++) {
-	  if (argCount == instr->fmt_args[fieldNum].argNum) {
-	    DEBUG(1) printf("Field number %d uses arg %d (value 0x%x)\n",
-			    fieldNum, argCount, value);
-	    outBits |= GETBITS(0,instr->arg_widths[argCount], value)
-	      << instr->fmt_args[fieldNum].argOffset;
-	  }
-	}
+		      TOKSTR(&curToken), instr->byte_count);
+      if ((asmgen_encode(&cfgScan, curSyms, instr, &curToken,
+			 offset, &code, NULL, &outBits) != 0) ||
+	  (asmgen_emit(image, 1, offset, instr, outBits) != 0)) {
+	SCANNER_STOP(&cfgScan);
+	expr_free(&code);
+	return -1;
       }
+      offset += instr->byte_count;
+      break;
       
-      /* expect the newline at the end */
-      if (get_token(&curToken, &cfgScan) != TOK_ENDL) {
-	fprintf(stderr, "ERROR - Bad token %s at end of line %d\n",
-		curToken.token, curToken.linenum);
-	return -1;
+    default:
+      /* dunno, this is bad */
+      diag_printf(stderr, "ERROR - Bad token %s, %s:%d\n",
+		    TOKSTR(&curToken), TOKPOS(&curToken));
+      SCANNER_STOP(&cfgScan);
+      expr_free(&code);
+      return -1;
+      break;
+    }
+  }
+  
+  return 0;
+}
+
+/* worker thread, takes chunks until there are none left */
+static void *asmgen_worker(void *arg) {
+  struct AsmgenPool *pool = arg;
+  struct ASMSource *src = pool->src;
+  struct ASMChunk *chunk;
+  struct Stats stats;
+  struct StatsTimer timer;
+  unsigned int idx, last;
+  
+  intern_attach(pool->names);
+  asmrec_attach(pool->archs);
+  include_attach(pool->includes);
+
+  /* count on our own, added to the caller's when done */
+  if (pool->stats != NULL) {
+    memset(&stats, 0, sizeof(stats));
+    stats_attach(&stats);
+    stats_start(&timer);
+  }
+  
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    idx = pool->failed ? src->numChunks : pool->next++;
+    if ((idx >= src->numChunks) && (pool->stats != NULL)) {
+      stats_stop(&timer, STATS_PASS2);
+      stats_merge(pool->stats, &stats);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (idx >= src->numChunks) {
+      return NULL;
+    }
+    
+    chunk = &src->chunks[idx];
+    last = (idx + 1 < src->numChunks) ? src->chunks[idx+1].tok :
+      src->toks.count;
+    if (asmgen_assemble_chunk(pool->curSyms, src, chunk->tok, last,
+			      chunk->offset, chunk->arch, chunk->data,
+			      pool->image) != 0) {
+      pthread_mutex_lock(&pool->lock);
+      pool->failed = 1;
+      pthread_mutex_unlock(&pool->lock);
+    }
+  }
+}
+
+/*
+ * asmgen_assemble
+ *    second pass, replays the tokens recorded by the first and
+ * emits the encoded instructions into the image. space for all
+ * the code is reserved up front, then the chunks noted by the
+ * first pass are handed out to up to workers threads. programs
+ * which emit code over other code are done in order, on one.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int asmgen_assemble(struct SymTab **curSyms,
+		    struct ASMSource *src,
+		    struct Image *image,
+		    int workers) {
+  struct AsmgenPool pool;
+  pthread_t *threads;
+  unsigned int x;
+  int started;
+  
+  /* lay out the image, so nothing moves while it is filled in */
+  for (x=0; x<src->numSpans; x++) {
+    if (image_span(image, src->spans[x].base, src->spans[x].len) == NULL) {
+      diag_printf(stderr, "ERROR - Memory allocation failed\n");
+      return -1;
+    }
+  }
+  
+  if ((workers > (int)src->numChunks) || src->overlap) {
+    workers = src->overlap ? 1 : src->numChunks;
+  }
+  if (workers <= 1) {
+    /* all in one go */
+    return asmgen_assemble_chunk(curSyms, src, 0, src->toks.count, 0,
+				 NULL, 0, image);
+  }
+  
+  pool.curSyms = curSyms;
+  pool.src = src;
+  pool.image = image;
+  pool.next = 0;
+  pool.failed = 0;
+  pool.stats = stats_attach(NULL);
+  stats_attach(pool.stats);
+  pool.names = intern_attach(NULL);
+  intern_attach(pool.names);
+  pool.archs = asmrec_attach(NULL);
+  asmrec_attach(pool.archs);
+  pool.includes = include_attach(NULL);
+  include_attach(pool.includes);
+  pthread_mutex_init(&pool.lock, NULL);
+  if ((threads = CALLOC(pthread_t, workers)) == NULL) {
+    diag_printf(stderr, "ERROR - Memory allocation failed\n");
+    return -1;
+  }
+  
+  for (started=0; started<workers; started++) {
+    if (pthread_create(&threads[started], NULL, asmgen_worker, &pool) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    /* no threads to be had, do it ourselves, already being timed */
+    pool.stats = NULL;
+    asmgen_worker(&pool);
+  }
+  for (x=0; x<(unsigned int)started; x++) {
+    pthread_join(threads[x], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&pool.lock);
+  
+  return pool.failed ? -1 : 0;
+}
+
+/* read the start of an instruction line, an optional label then
+ * the mnemonic. label is left empty if there is none */
+static int asmgen_line_head(struct ScanData *scanner,
+			    uint32_t *label,
+			    struct Token *mnemonic) {
+  *label = INTERN_EMPTY;
+  if (get_token(mnemonic, scanner) == TOK_LABEL) {
+    *label = mnemonic->str;
+    get_token(mnemonic, scanner);
+  }
+  return (mnemonic->type == TOK_IDENT) ? 0 : -1;
+}
+
+/*
+ * asmgen_reassemble_line
+ *    after an edit to the instruction on one line, encode its new
+ * text over the old code in the image. this only works if nothing
+ * else can have changed, so the line must still carry the same
+ * label, and its instruction must be of the same size. both texts
+ * run up to and including the newline.
+ *
+ * returns 0 if done, 1 if the whole program must be reassembled
+ * instead, -1 on error
+ */
+int asmgen_reassemble_line(struct SymTab **curSyms,
+			   const struct ASMSource *src,
+			   const struct ASMLine *line,
+			   const char *oldText, size_t oldLen,
+			   const char *newText, size_t newLen,
+			   struct Image *image) {
+  struct ScanData asmScan;
+  struct Token curToken;
+  struct ExprCode code;
+  const struct ASMEncoding *instr;
+  uint32_t oldLabel, newLabel;
+  uint32_t outBits;
+  int ret;
+  
+  if ((newLen == 0) || (newText[newLen-1] != '\n')) {
+    return 1;
+  }
+  
+  /* old label, the mnemonic was checked by the first pass */
+  SCANNER_INIT_TEXT(&asmScan, oldText, oldLen);
+  asmgen_line_head(&asmScan, &oldLabel, &curToken);
+  SCANNER_STOP(&asmScan);
+  
+  /* new text must be the same kind of line */
+  SCANNER_INIT_TEXT(&asmScan, newText, newLen);
+  asmScan.file = src->file;
+  asmScan.linecount = line->linenum;
+  if ((asmgen_line_head(&asmScan, &newLabel, &curToken) != 0) ||
+      (oldLabel != newLabel) ||
+      ((instr = asmrec_find(line->arch, curToken.str)) == NULL) ||
+      (instr->byte_count != line->byte_count)) {
+    SCANNER_STOP(&asmScan);
+    return 1;
+  }
+  
+  memset(&code, 0, sizeof(code));
+  ret = asmgen_encode(&asmScan, curSyms, instr, &curToken,
+		      line->offset, &code, NULL, &outBits);
+  expr_free(&code);
+  if ((ret == 0) && (get_token(&curToken, &asmScan) != TOK_EOF)) {
+    /* more than one line's worth */
+    ret = 1;
+  }
+  if (ret == 0) {
+    ret = asmgen_emit(image, 0, line->offset, instr, outBits);
+  }
+  SCANNER_STOP(&asmScan);
+  return ret;
+}
+
+void asmgen_free_fixups(struct FixupList *fixups) {
+  free(fixups->list);
+  expr_free(&fixups->code);
+  symtab_clear(&fixups->labels);
+  memset(fixups, 0, sizeof(struct FixupList));
+}
+
+/*
+ * asmgen_onepass
+ *    assemble in a single pass over the input, so it need not be
+ * seekable. labels are recorded as they are seen and instructions
+ * are emitted right away, with forward references left as fixups.
+ * unless relocating, these are patched in once the whole input has
+ * been read.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+static int asmgen_onepass(struct SymTab **curSyms,
+			  FILE *input,
+			  const char *name,
+			  struct Image *image,
+			  struct FixupList *fixups) {
+  struct ScanData asmScan;
+  struct Token curToken;
+  const struct ASMEncoding *instr;
+  const struct ASMArch *asmcfg = NULL;
+  struct ASMData data;
+  unsigned int offset = 0, unit, len;
+  uint32_t outBits;
+  DataKind kind;
+  int ret = -1;
+  
+  /* set up the scanner */
+  SCANNER_INIT(&asmScan, input);
+  if (scan_name(&asmScan, name) != 0) {
+    SCANNER_STOP(&asmScan);
+    return -1;
+  }
+  
+  while (ret == -1) {
+    switch (get_token(&curToken, &asmScan)) {
+      
+    case TOK_EOF:
+      /* end of file, note size and fill in forward references */
+      symtab_record(curSyms, "$filesize", NULL, offset);
+      if (!fixups->relocate &&
+	  (asmgen_resolve_fixups(curSyms, fixups, image) != 0)) {
+	ret = 1;
+      }
+      else {
+	ret = 0;
       }
+      break;
       
-      /* fill in the assembled instruction into the data buffer */
-      DEBUG(1) printf("Outputting %d bytes\n", instr->byte_count);
-      for (x=(instr->byte_count-1); x>=0; x--) {
-	data[offset] = GETBITS(8*x,(8*x)+7, outBits);
-	DEBUG(1) printf("Assembled %02x\n", data[offset]);
-	offset += 1;
+    case TOK_LABEL:
+      /* hit a line label */
+      symtab_record_id(curSyms, curToken.str, NULL, offset);
+      if (fixups->relocate) {
+	symtab_record_id(&fixups->labels, curToken.str, NULL, offset);
       }
+      break;
       
+    case TOK_ENDL:
+      /* end of line at beginning, skip to next */
+      break;
+      
+    case TOK_DIRECTIVE:
+      kind = asmgen_data_kind(&curToken, &unit);
+      if (kind == DATA_LIST) {
+	if (asmgen_data_list(&asmScan, curSyms, unit, &curToken,
+			     offset, NULL, fixups, image, 0, &len) != 0) {
+	  ret = 1;
+	  break;
+	}
+	offset += len;
+      }
+      else if (kind != DATA_NONE) {
+	if (asmgen_data_layout(&asmScan, curSyms,
+			       fixups->relocate ? &fixups->labels : NULL,
+			       &curToken, kind, offset, &data) != 0) {
+	  ret = 1;
+	  break;
+	}
+	if (asmgen_data_place(image, 0, offset, &data) != 0) {
+	  ret = 1;
+	}
+	offset += data.len;
+	asmgen_free_data(&data);
+      }
+      /* directive, pass current data to directive handler */
+      else if (directive_parse(&asmScan, &curToken, curSyms, &asmcfg,
+			       &offset) != 0) {
+	ret = 1;
+      }
+      break;
+      
+    case TOK_IDENT:
+      /* assume to be an assembly mnemonic */
+      DEBUG(1) printf("\nAssembling mnemonic %s\n", TOKSTR(&curToken));
+      if ((instr = asmrec_find(asmcfg, curToken.str)) == NULL) {
+	diag_printf(stderr, "ERROR - mnemonic %s not found, %s:%d\n",
+		    TOKSTR(&curToken), TOKPOS(&curToken));
+	ret = 1;
+	break;
+      }
+      if ((asmgen_encode(&asmScan, curSyms, instr, &curToken,
+			 offset, NULL, fixups, &outBits) != 0) ||
+	  (asmgen_emit(image, 0, offset, instr, outBits) != 0)) {
+	ret = 1;
+	break;
+      }
+      offset += instr->byte_count;
       break;
       
     default:
-      /* dunno, this is bad */
-      fprintf(stderr, "ERROR - Bad token %s at line %d\n",
-		curToken.token, curToken.linenum);
-	return -1;
+      diag_printf(stderr, "Unexpected Token %s, %s:%d\n",
+		  TOKSTR(&curToken), TOKPOS(&curToken));
+      ret = 1;
       break;
     }
   }
   
-  return 0;
+  SCANNER_STOP(&asmScan);
+  return (ret == 0) ? 0 : -1;
+}
+
+/* the whole program in a single pass, see asmgen_onepass */
+int asmgen_assemble_onepass(struct SymTab **curSyms,
+			    FILE *input,
+			    const char *name,
+			    struct Image *image) {
+  struct FixupList fixups;
+  int ret;
+  
+  memset(&fixups, 0, sizeof(fixups));
+  ret = asmgen_onepass(curSyms, input, name, image, &fixups);
+  asmgen_free_fixups(&fixups);
+  return ret;
+}
+
+/*
+ * asmgen_assemble_object
+ *    assemble one module of a program, for an object file. code is
+ * placed as if the module started at 0, and every operand using a
+ * label, or a symbol the module does not define, is left zero and
+ * kept in relocs for the linker. relocs must be empty to begin
+ * with, and is freed with asmgen_free_fixups.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int asmgen_assemble_object(struct SymTab **curSyms,
+			   FILE *input,
+			   const char *name,
+			   struct Image *image,
+			   struct FixupList *relocs) {
+  relocs->relocate = 1;
+  return asmgen_onepass(curSyms, input, name, image, relocs);
 }
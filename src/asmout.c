@@ -1,112 +1,769 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "asm.h"
 
-int asmout_make_mif(struct SymTab **curSyms, char *out, char *data) {
-  FILE *handle;
-  int x, t, datasize, mifwords, mifbytes;
-  int bytewidth, mifwidth = 8;
-  
-  /* sanity check */
-  if (symtab_lookup(curSyms, "$filesize", NULL, &datasize) != 0) {
-    fprintf(stderr, "ERROR - Unknown file size\n");
+/* formats .outfmt can name */
+static const struct ASMOutFormat asmout_formats[] = {
+  { "mif", "mif", asmout_make_mif },
+  { "rom", "rom", asmout_make_rom },
+  { "bin", "bin", asmout_make_bin },
+  { "ihex", "hex", asmout_make_ihex },
+  { "memh", "memh", asmout_make_memh },
+  { "memb", "memb", asmout_make_memb },
+  { NULL, NULL, NULL }
+};
+
+/*
+ * asmout_find_format
+ *    look up an output format by name.
+ *
+ * returns the format, or NULL if unknown
+ */
+const struct ASMOutFormat *asmout_find_format(const char *name) {
+  int x;
+
+  for (x=0; asmout_formats[x].name != NULL; x++) {
+    if (strcmp(asmout_formats[x].name, name) == 0) {
+      return &asmout_formats[x];
+    }
+  }
+  return NULL;
+}
+
+/* bytes per output word, from .mifwidth (default 8 bits) */
+static int asmout_word_bytes(struct SymTab **curSyms) {
+  int mifwidth = 8;
+
+  if (symtab_lookup(curSyms, "$mifwidth", NULL, &mifwidth) == 0) {
+    if ((mifwidth <= 0) || ((mifwidth % 8) != 0) ||
+	(mifwidth / 8 > BUFSIZE)) {
+      diag_printf(stderr, "ERROR - Illegal MIF width size "
+		  "(must be multiple of 8)\n");
+      return -1;
+    }
+  }
+  return mifwidth / 8;
+}
+
+/* check if a word is all zero */
+static int asmout_word_zero(const char *word, int bytewidth) {
+  int t;
+
+  for (t=0; t<bytewidth; t++) {
+    if (word[t] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* a word of the image, pointing into it where possible rather
+ * than copying into scratch */
+static const char *asmout_word(struct Image *img, UINT64 offset,
+			       int bytewidth, char *scratch) {
+  const char *word;
+
+  if ((word = image_locate(img, offset, bytewidth)) == NULL) {
+    image_read(img, offset, scratch, bytewidth);
+    word = scratch;
+  }
+  return word;
+}
+
+/* text being formatted for one piece of the output */
+struct AsmoutBuf {
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+/* make room for more bytes at the end of buf */
+static int asmout_reserve(struct AsmoutBuf *buf, size_t more) {
+  char *newdata;
+  size_t newsize;
+
+  if ((buf->data != NULL) && (buf->len + more <= buf->size)) {
+    return 0;
+  }
+  newsize = (buf->size == 0) ? 65536 : 2*buf->size;
+  while (newsize < buf->len + more) {
+    newsize *= 2;
+  }
+  if ((newdata = REALLOC(buf->data, newsize)) == NULL) {
     return -1;
   }
+  buf->data = newdata;
+  buf->size = newsize;
+  return 0;
+}
+
+static const char asmout_digits[] = "0123456789ABCDEF";
+static const char asmout_digits_lower[] = "0123456789abcdef";
+
+/* bytes as pairs of hex digits, returns the end of what was written */
+static char *asmout_put_bytes(char *p, const char *bytes, int len) {
+  int t;
+
+  for (t=0; t<len; t++) {
+    *p++ = asmout_digits[(bytes[t] >> 4) & 0xf];
+    *p++ = asmout_digits[bytes[t] & 0xf];
+  }
+  return p;
+}
+
+/* an address in hex, at least minDigits long */
+static char *asmout_put_addr(char *p, UINT64 addr, int minDigits,
+			     const char *digits) {
+  char tmp[16];
+  int n = 0;
+
+  do {
+    tmp[n++] = digits[addr & 0xf];
+    addr >>= 4;
+  } while ((addr != 0) || (n < minDigits));
+  while (n > 0) {
+    *p++ = tmp[--n];
+  }
+  return p;
+}
+
+/* a range of the output, formatted by one worker. start and end
+ * are words for MIF and bytes for ROM */
+struct AsmoutPiece {
+  UINT64 start;
+  UINT64 end;
+  UINT64 next;			/* ROM: end of the row before start */
+  struct AsmoutBuf buf;
+  off_t offset;			/* where it goes in the file */
+};
+
+/* an output being formatted and written in pieces */
+struct AsmoutJob {
+  struct Image *img;
+  struct AsmoutPiece *pieces;
+  int count;
+  int bytewidth;		/* MIF only */
+  int ranges;
+  int fd;
+  int phase;			/* 0 to format, 1 to write */
+  int (*format)(struct AsmoutJob *job, struct AsmoutPiece *piece);
+  int next;			/* next piece to hand out */
+  int failed;
+  struct Stats *stats;		/* caller's, to add the workers' into */
+  pthread_mutex_t lock;
+};
+
+/* worker thread, takes pieces until there are none left */
+static void *asmout_worker(void *arg) {
+  struct AsmoutJob *job = arg;
+  struct AsmoutPiece *piece;
+  struct Stats stats;
+  struct StatsTimer timer;
+  ssize_t done;
+  size_t pos;
+  int idx;
+
+  /* count on our own, added to the caller's when done */
+  if (job->stats != NULL) {
+    memset(&stats, 0, sizeof(stats));
+    stats_attach(&stats);
+    stats_start(&timer);
+  }
+
+  while (1) {
+    pthread_mutex_lock(&job->lock);
+    idx = job->failed ? job->count : job->next++;
+    if ((idx >= job->count) && (job->stats != NULL)) {
+      stats_stop(&timer, STATS_OUTPUT);
+      stats_merge(job->stats, &stats);
+    }
+    pthread_mutex_unlock(&job->lock);
+    if (idx >= job->count) {
+      return NULL;
+    }
+
+    piece = &job->pieces[idx];
+    if (job->phase == 0) {
+      if (job->format(job, piece) == 0) {
+	continue;
+      }
+    }
+    else {
+      for (pos = 0; pos < piece->buf.len; pos += done) {
+	done = pwrite(job->fd, &piece->buf.data[pos], piece->buf.len - pos,
+		      piece->offset + pos);
+	if (done < 0) {
+	  if (errno != EINTR) {
+	    break;
+	  }
+	  done = 0;
+	}
+      }
+      if (pos == piece->buf.len) {
+	continue;
+      }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_mutex_unlock(&job->lock);
+  }
+}
+
+/* run one phase of a job over all its pieces */
+static int asmout_run(struct AsmoutJob *job, int phase, int workers) {
+  pthread_t *threads;
+  int x, started = 0;
+
+  job->phase = phase;
+  job->next = 0;
+  job->stats = stats_attach(NULL);
+  stats_attach(job->stats);
+  if (workers > job->count) {
+    workers = job->count;
+  }
+  if ((workers > 1) && ((threads = CALLOC(pthread_t, workers)) != NULL)) {
+    for (started=0; started<workers; started++) {
+      if (pthread_create(&threads[started], NULL, asmout_worker, job) != 0) {
+	break;
+      }
+    }
+    for (x=0; x<started; x++) {
+      pthread_join(threads[x], NULL);
+    }
+    free(threads);
+  }
+  if (started == 0) {
+    /* no threads to be had, do it ourselves, already being timed */
+    job->stats = NULL;
+    asmout_worker(job);
+  }
+  return job->failed ? -1 : 0;
+}
+
+/*
+ * asmout_write_job
+ *    format every piece of a job, on up to workers threads, then
+ * write them to out with the header before the first and the
+ * trailer after the last. pieces go in at offsets summed from
+ * the lengths before them, in parallel when out can seek.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+static int asmout_write_job(struct AsmoutJob *job, char *out,
+			    const char *header, const char *trailer,
+			    int workers) {
+  struct AsmoutBuf *first, *last;
+  size_t pos, len;
+  ssize_t done;
+  off_t offset = 0;
+  int x, ret = -1;
+
+  /* header goes ahead of the first piece, trailer after the last */
+  first = &job->pieces[0].buf;
+  len = strlen(header);
+  if (asmout_reserve(first, len) != 0) {
+    diag_printf(stderr, "ERROR - Memory allocation failed\n");
+    goto done;
+  }
+  memcpy(first->data, header, len);
+  first->len = len;
+
+  job->failed = 0;
+  pthread_mutex_init(&job->lock, NULL);
+  if (asmout_run(job, 0, workers) != 0) {
+    diag_printf(stderr, "ERROR - Memory allocation failed\n");
+    pthread_mutex_destroy(&job->lock);
+    goto done;
+  }
+  last = &job->pieces[job->count - 1].buf;
+  len = strlen(trailer);
+  if (asmout_reserve(last, len) != 0) {
+    diag_printf(stderr, "ERROR - Memory allocation failed\n");
+    pthread_mutex_destroy(&job->lock);
+    goto done;
+  }
+  memcpy(&last->data[last->len], trailer, len);
+  last->len += len;
+
+  /* open output */
+  if ((job->fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+    diag_printf(stderr, "ERROR - Could not open output file %s: %s\n", out,
+		strerror(errno));
+    pthread_mutex_destroy(&job->lock);
+    goto done;
+  }
+  for (x=0; x<job->count; x++) {
+    job->pieces[x].offset = offset;
+    offset += job->pieces[x].buf.len;
+  }
+
+  if ((job->count > 1) && (lseek(job->fd, 0, SEEK_CUR) >= 0)) {
+    ret = asmout_run(job, 1, workers);
+  }
+  else {
+    /* can't seek (a pipe, say), one after the other */
+    ret = 0;
+    for (x=0; (x<job->count) && (ret == 0); x++) {
+      for (pos = 0; pos < job->pieces[x].buf.len; pos += done) {
+	done = write(job->fd, &job->pieces[x].buf.data[pos],
+		     job->pieces[x].buf.len - pos);
+	if (done < 0) {
+	  if (errno != EINTR) {
+	    ret = -1;
+	    break;
+	  }
+	  done = 0;
+	}
+      }
+    }
+  }
+  if (ret != 0) {
+    diag_printf(stderr, "ERROR - Could not write output file %s: %s\n",
+		out, strerror(errno));
+  }
+  close(job->fd);
+  pthread_mutex_destroy(&job->lock);
+
+ done:
+  for (x=0; x<job->count; x++) {
+    free(job->pieces[x].buf.data);
+  }
+  free(job->pieces);
+  return ret;
+}
+
+/* how many pieces to cut units (words or bytes) of output into */
+static int asmout_piece_count(UINT64 units, UINT64 perPiece, int workers) {
+  if ((workers <= 1) || (units < 2*perPiece)) {
+    return 1;
+  }
+  if (units / perPiece < (UINT64)workers * 4) {
+    return (int)(units / perPiece);
+  }
+  return workers * 4;
+}
+
+/* format the MIF lines of one piece, runs of the same value as a
+ * single [start..end] range unless asked not to */
+static int asmout_mif_piece(struct AsmoutJob *job, struct AsmoutPiece *piece) {
+  char curBuf[BUFSIZE], nextBuf[BUFSIZE], *p;
+  const char *cur, *next;
+  int bytewidth = job->bytewidth;
+  UINT64 x, end, skip;
+
+  for (x=piece->start; x<piece->end; x=end) {
+    cur = asmout_word(job->img, x*bytewidth, bytewidth, curBuf);
+    end = x + 1;
+    while (job->ranges && (end < piece->end)) {
+      if (asmout_word_zero(cur, bytewidth)) {
+	/* a zero run goes at least up to the next emitted data */
+	skip = image_next_data(job->img, end*bytewidth);
+	skip = (skip == IMAGE_NO_DATA) ? piece->end : skip / bytewidth;
+	if (skip > end) {
+	  end = (skip < piece->end) ? skip : piece->end;
+	  continue;
+	}
+      }
+      next = asmout_word(job->img, end*bytewidth, bytewidth, nextBuf);
+      if (memcmp(cur, next, bytewidth) != 0) {
+	break;
+      }
+      end += 1;
+    }
+
+    if (asmout_reserve(&piece->buf, 48 + 2*bytewidth) != 0) {
+      return -1;
+    }
+    p = &piece->buf.data[piece->buf.len];
+    *p++ = '\t';
+    if (end - x > 1) {
+      *p++ = '[';
+      p = asmout_put_addr(p, x, 1, asmout_digits_lower);
+      *p++ = '.';
+      *p++ = '.';
+      p = asmout_put_addr(p, end - 1, 1, asmout_digits_lower);
+      *p++ = ']';
+    }
+    else {
+      p = asmout_put_addr(p, x, 1, asmout_digits_lower);
+    }
+    memcpy(p, "  :   ", 6);
+    p = asmout_put_bytes(p + 6, cur, bytewidth);
+    *p++ = ';';
+    *p++ = '\n';
+    piece->buf.len = p - piece->buf.data;
+  }
+  return 0;
+}
+
+/* first word at or after from that differs from the one before,
+ * so no run of equal words is split there */
+static UINT64 asmout_mif_split(struct AsmoutJob *job, UINT64 from,
+			       UINT64 words) {
+  char prevBuf[BUFSIZE], curBuf[BUFSIZE];
+  const char *prev, *cur;
+  int bytewidth = job->bytewidth;
+  UINT64 skip;
+
+  if (!job->ranges || (from == 0) || (from >= words)) {
+    return (from < words) ? from : words;
+  }
+  prev = asmout_word(job->img, (from - 1)*bytewidth, bytewidth, prevBuf);
+  while (from < words) {
+    if (asmout_word_zero(prev, bytewidth)) {
+      skip = image_next_data(job->img, from*bytewidth);
+      skip = (skip == IMAGE_NO_DATA) ? words : skip / bytewidth;
+      if (skip > from) {
+	from = (skip < words) ? skip : words;
+	continue;
+      }
+    }
+    cur = asmout_word(job->img, from*bytewidth, bytewidth, curBuf);
+    if (memcmp(prev, cur, bytewidth) != 0) {
+      break;
+    }
+    from += 1;
+  }
+  return from;
+}
+
+int asmout_make_mif(struct SymTab **curSyms, char *out, struct Image *img,
+		    int workers) {
+  struct AsmoutJob job;
+  char header[256];
+  int x, mifwords, mifwidth;
+
+  memset(&job, 0, sizeof(job));
+  job.img = img;
+  job.ranges = 1;
+  job.format = asmout_mif_piece;
+
+  /* sanity check */
   if (symtab_lookup(curSyms, "$mifwords", NULL, &mifwords) != 0) {
-    fprintf(stderr, "ERROR - Unknown MIF output size\n");
+    diag_printf(stderr, "ERROR - Unknown MIF output size\n");
     return -1;
   }
-  if (symtab_lookup(curSyms, "$mifwidth", NULL, &mifwidth) == 0) {
-    if ((mifwidth == 0) && ((mifwidth % 8) != 0)) {
-      fprintf(stderr, "ERROR - Illegal MIF width size "
-	      "(must be multiple of 8)\n");
+  if ((job.bytewidth = asmout_word_bytes(curSyms)) < 0) {
+    return -1;
+  }
+  symtab_lookup(curSyms, "$mifranges", NULL, &job.ranges);
+
+  mifwidth = job.bytewidth * 8;
+  if (img->end > (UINT64)mifwords * job.bytewidth) {
+    diag_printf(stderr, "ERROR - Assembled file will not fit within "
+		"mif filesize\n");
+    return -1;
+  }
+
+  /* cut the words into pieces, each starting a new run */
+  job.count = asmout_piece_count(mifwords, ASMOUT_PIECE_UNITS, workers);
+  if ((job.pieces = CALLOC(struct AsmoutPiece, job.count)) == NULL) {
+    diag_printf(stderr, "ERROR - Memory allocation failed\n");
+    return -1;
+  }
+  for (x=0; x<job.count; x++) {
+    job.pieces[x].start = (x == 0) ? 0 : job.pieces[x - 1].end;
+    job.pieces[x].end = (x + 1 == job.count) ? (UINT64)mifwords :
+      asmout_mif_split(&job, ((UINT64)mifwords * (x + 1)) / job.count,
+		       mifwords);
+    if (job.pieces[x].end < job.pieces[x].start) {
+      job.pieces[x].end = job.pieces[x].start;
+    }
+  }
+
+  /* MIF header */
+  snprintf(header, sizeof(header),
+	   "-- caspr\n\n"
+	   "WIDTH=%d;\n"
+	   "DEPTH=%d;\n\n"
+	   "ADDRESS_RADIX=HEX;\n"
+	   "DATA_RADIX=HEX;\n\n"
+	   "CONTENT BEGIN\n",
+	   mifwidth, mifwords);
+
+  return asmout_write_job(&job, out, header, "END;\n", workers);
+}
+
+/* format the ROM rows of one piece, with a '*' where rows of
+ * nothing were skipped */
+static int asmout_rom_piece(struct AsmoutJob *job, struct AsmoutPiece *piece) {
+  char row[8], *p;
+  UINT64 x, next = piece->next;
+
+  for (x = image_next_data(job->img, piece->start) & ~7ULL; x < piece->end;
+       x = image_next_data(job->img, x + 8) & ~7ULL) {
+    if (asmout_reserve(&piece->buf, 64) != 0) {
       return -1;
     }
+    p = &piece->buf.data[piece->buf.len];
+    if (x > next) {
+      *p++ = '*';
+      *p++ = '\n';
+    }
+    *p++ = '0';
+    *p++ = 'x';
+    p = asmout_put_addr(p, x, 4, asmout_digits);
+    *p++ = ' ';
+    *p++ = '|';
+    image_read(job->img, x, row, 8);
+    p[0] = ' ';
+    p[3] = ' ';
+    p[6] = ' ';
+    p[9] = ' ';
+    p[12] = ' ';
+    p[15] = ' ';
+    p[18] = ' ';
+    p[21] = ' ';
+    asmout_put_bytes(p + 1, row, 1);
+    asmout_put_bytes(p + 4, row + 1, 1);
+    asmout_put_bytes(p + 7, row + 2, 1);
+    asmout_put_bytes(p + 10, row + 3, 1);
+    asmout_put_bytes(p + 13, row + 4, 1);
+    asmout_put_bytes(p + 16, row + 5, 1);
+    asmout_put_bytes(p + 19, row + 6, 1);
+    asmout_put_bytes(p + 22, row + 7, 1);
+    p[24] = '\n';
+    piece->buf.len = p + 25 - piece->buf.data;
+    next = x + 8;
   }
-  
-  bytewidth = mifwidth / 8;
-  mifbytes = mifwords * bytewidth;
-  if (datasize > mifbytes) {
-    fprintf(stderr, "ERROR - Assembled file will not fit within "
-	    "mif filesize\n");
+  return 0;
+}
+
+int asmout_make_rom(struct SymTab **curSyms, char *out, struct Image *img,
+		    int workers) {
+  struct AsmoutJob job;
+  UINT64 rows, start;
+  int x;
+
+  memset(&job, 0, sizeof(job));
+  job.img = img;
+  job.format = asmout_rom_piece;
+
+  DEBUG(1) printf("Max Address %llu\n", img->end);
+
+  /* cut the rows into pieces, each knowing whether the row before
+   * it held data, for the '*' */
+  rows = (img->end + 7) / 8;
+  job.count = asmout_piece_count(rows, ASMOUT_PIECE_UNITS, workers);
+  if ((job.pieces = CALLOC(struct AsmoutPiece, job.count)) == NULL) {
+    diag_printf(stderr, "ERROR - Memory allocation failed\n");
     return -1;
   }
-  
-  /* open output */
-  if ((handle = fopen(out, "w")) == NULL) {
-    perror("ERROR - Could not open output file");
+  for (x=0; x<job.count; x++) {
+    start = (rows * x / job.count) * 8;
+    job.pieces[x].start = start;
+    job.pieces[x].end = (x + 1 == job.count) ? img->end :
+      (rows * (x + 1) / job.count) * 8;
+    job.pieces[x].next = ((start == 0) ||
+			  (image_next_data(img, start - 8) < start)) ?
+      start : start - 1;
+  }
+
+  /* no ROM header or trailer for now */
+  return asmout_write_job(&job, out, "", "", workers);
+}
+
+/* write all of len bytes, returns 0 on success */
+static int asmout_write_all(int fd, const char *buf, size_t len) {
+  ssize_t done;
+
+  while (len > 0) {
+    if ((done = write(fd, buf, len)) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return -1;
+    }
+    buf += done;
+    len -= done;
+  }
+  return 0;
+}
+
+/*
+ * asmout_make_bin
+ *    write the image as raw bytes from address 0, gaps as zero. each
+ * segment is written where it goes, and gaps are seeked over so they
+ * take no memory and (on most file systems) no disk, even for code
+ * placed high in memory. outputs that cannot seek, such as pipes,
+ * get the zeros written out.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int asmout_make_bin(struct SymTab **curSyms, char *out, struct Image *img,
+		    int workers) {
+  static const char zeros[4096];
+  UINT64 pos = 0, gap;
+  unsigned int x;
+  int fd, seekable, ret = 0;
+
+  if ((fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+    diag_printf(stderr, "ERROR - Could not open output file %s: %s\n", out,
+		strerror(errno));
     return -1;
   }
-  
-  /* dump MIF header */
-  fprintf(handle,
-	  "-- caspr\n\n"
-	  "WIDTH=%d;\n"
-	  "DEPTH=%d;\n\n"
-	  "ADDRESS_RADIX=HEX;\n"
-	  "DATA_RADIX=HEX;\n\n"
-	  "CONTENT BEGIN\n",
-	  mifwidth, mifwords);
-  
-  /* output each assembled unit (no optimization for now) */
-  for (x=0; x<mifbytes; x+=bytewidth) {
-    fprintf(handle, "\t%x  :   ", x / bytewidth);
-    for (t=0; t<bytewidth; t++) {
-      if ((x+t) < datasize) {
-	fprintf(handle, "%02X", data[x+t] & 0xff);
+  seekable = (lseek(fd, 0, SEEK_CUR) == 0);
+
+  for (x=0; (ret == 0) && (x<img->count); x++) {
+    /* up to the segment */
+    if (seekable) {
+      if (lseek(fd, img->segs[x].base, SEEK_SET) < 0) {
+	ret = -1;
       }
-      else {
-	fprintf(handle, "00");
+    }
+    else {
+      for (; (ret == 0) && (pos < img->segs[x].base); pos += gap) {
+	gap = img->segs[x].base - pos;
+	gap = (gap > sizeof(zeros)) ? sizeof(zeros) : gap;
+	ret = asmout_write_all(fd, zeros, gap);
       }
     }
-    fprintf(handle, ";\n");
+    if (ret == 0) {
+      ret = asmout_write_all(fd, img->segs[x].data, img->segs[x].len);
+      pos = (UINT64)img->segs[x].base + img->segs[x].len;
+    }
+  }
+
+  /* out to the end, should it not finish with data */
+  if ((ret == 0) && seekable && (ftruncate(fd, img->end) != 0)) {
+    ret = -1;
+  }
+  for (; (ret == 0) && !seekable && (pos < img->end); pos += gap) {
+    gap = img->end - pos;
+    gap = (gap > sizeof(zeros)) ? sizeof(zeros) : gap;
+    ret = asmout_write_all(fd, zeros, gap);
+  }
+
+  if (ret != 0) {
+    diag_printf(stderr, "ERROR - Could not write output file %s: %s\n",
+		out, strerror(errno));
   }
-  
-  /* dump MIF trailer */
-  fprintf(handle, "END;\n");
-  
+  close(fd);
+  return ret;
+}
+
+/* one Intel HEX record, with its checksum */
+static void asmout_ihex_record(FILE *handle, int type, unsigned int addr,
+			       unsigned char *data, int len) {
+  unsigned int sum;
+  int t;
+
+  sum = len + ((addr >> 8) & 0xff) + (addr & 0xff) + type;
+  fprintf(handle, ":%02X%04X%02X", len, addr & 0xffff, type);
+  for (t=0; t<len; t++) {
+    fprintf(handle, "%02X", data[t]);
+    sum += data[t];
+  }
+  fprintf(handle, "%02X\n", (0x100 - (sum & 0xff)) & 0xff);
+}
+
+/*
+ * asmout_make_ihex
+ *    write the image as Intel HEX, data records only where something
+ * was emitted and extended linear address records above 64K.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int asmout_make_ihex(struct SymTab **curSyms, char *out, struct Image *img,
+		     int workers) {
+  FILE *handle;
+  unsigned char row[ASMOUT_IHEX_BYTES], upper[2];
+  unsigned int page = 0;
+  UINT64 x, len = 0;
+
+  /* open output */
+  if ((handle = fopen(out, "w")) == NULL) {
+    diag_printf(stderr, "ERROR - Could not open output file %s: %s\n", out,
+		strerror(errno));
+    return -1;
+  }
+
+  for (x = image_next_data(img, 0); x < img->end;
+       x = image_next_data(img, x + len)) {
+    if ((x >> 16) != page) {
+      page = x >> 16;
+      upper[0] = (page >> 8) & 0xff;
+      upper[1] = page & 0xff;
+      asmout_ihex_record(handle, 4, 0, upper, 2);
+    }
+
+    /* records stay within what was emitted, and the current 64K page */
+    len = image_data_end(img, x) - x;
+    if (len > ASMOUT_IHEX_BYTES) {
+      len = ASMOUT_IHEX_BYTES;
+    }
+    if ((x & 0xffff) + len > 0x10000) {
+      len = 0x10000 - (x & 0xffff);
+    }
+    image_read(img, x, (char *)row, len);
+    asmout_ihex_record(handle, 0, x, row, len);
+  }
+  asmout_ihex_record(handle, 1, 0, NULL, 0);
+
   /* done */
   fclose(handle);
   return 0;
 }
 
-int asmout_make_rom(struct SymTab **curSyms, char *out, char *data) {
+/* Verilog $readmemh/$readmemb file, one word per line with an
+ * @address wherever words were skipped */
+static int asmout_make_readmem(struct SymTab **curSyms, char *out,
+			       struct Image *img, int binary) {
   FILE *handle;
-  int x, y, t, datasize;
-  
-  /* sanity check */
-  if (symtab_lookup(curSyms, "$filesize", NULL, &datasize) != 0) {
-    fprintf(stderr, "ERROR - Unknown file size\n");
+  char cur[BUFSIZE];
+  int t, b, bytewidth;
+  UINT64 x, words, next = 0;
+
+  if ((bytewidth = asmout_word_bytes(curSyms)) < 0) {
     return -1;
   }
+  words = (img->end + bytewidth - 1) / bytewidth;
 
   /* open output */
   if ((handle = fopen(out, "w")) == NULL) {
-    perror("ERROR - Could not open output file");
+    diag_printf(stderr, "ERROR - Could not open output file %s: %s\n", out,
+		strerror(errno));
     return -1;
   }
-  
-  /* dump ROM header (none for now) */
+  fprintf(handle, "// caspr\n");
 
-
-  DEBUG(1) printf("Max Address %d\n", datasize);
-  /* output each row */
-  for (x=0; x<datasize; x+=8) {
-    fprintf(handle, "0x%04X |", x);
-    for (y=0; y<8; y++) {
-      if ((x+y)<datasize) {
-	t = (data[x+y] & 0xff);
-	fprintf(handle, " %02X", t);
+  for (x = image_next_data(img, 0) / bytewidth; x < words;
+       x = image_next_data(img, (x + 1) * bytewidth) / bytewidth) {
+    if (x != next) {
+      fprintf(handle, "@%llx\n", x);
+    }
+    image_read(img, x*bytewidth, cur, bytewidth);
+    for (t=0; t<bytewidth; t++) {
+      if (binary) {
+	for (b=7; b>=0; b--) {
+	  fputc((cur[t] & (1 << b)) ? '1' : '0', handle);
+	}
       }
       else {
-	fprintf(handle, " 00");
+	fprintf(handle, "%02X", cur[t] & 0xff);
       }
     }
-    fprintf(handle, "\n");
+    fputc('\n', handle);
+    next = x + 1;
   }
-  
-  /* dump ROM trailer (none for now) */
-  
+
   /* done */
   fclose(handle);
   return 0;
 }
+
+int asmout_make_memh(struct SymTab **curSyms, char *out, struct Image *img,
+		     int workers) {
+  return asmout_make_readmem(curSyms, out, img, 0);
+}
+
+int asmout_make_memb(struct SymTab **curSyms, char *out, struct Image *img,
+		     int workers) {
+  return asmout_make_readmem(curSyms, out, img, 1);
+}
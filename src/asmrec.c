@@ -1,8 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "asm.h"
 #include "directive.h"
+#include "depend.h"
 
 static char *cfg_file_formats[4] =
   { "%s.cfg",
@@ -10,6 +17,27 @@ static char *cfg_file_formats[4] =
     "/home/tim/dev/caspr/cfg/%s.cfg",
     NULL };
 
+/* suffix for compiled architecture cache files */
+#define ASMCACHE_SUFFIX "c"
+
+/* one loaded architecture, see struct ArchRegistry */
+struct ArchEntry {
+  char *name;
+  int found;			/* which of cfg_file_formats it was */
+  struct timespec mtime;	/* of that file, when it was loaded */
+  off_t size;
+  struct ASMArch *arch;
+  struct ArchEntry *next;
+};
+
+/* the process wide registry, and the one this thread loads into.
+ * architectures whose files have changed since are retired, no
+ * longer handed out but kept, as programs may still be using them */
+static struct ArchRegistry arch_global = {
+  NULL, NULL, PTHREAD_MUTEX_INITIALIZER
+};
+static __thread struct ArchRegistry *arch_cur = &arch_global;
+
 /* allocate one empty asm record */
 int asmrec_init(struct ASMRecord *ptr) {
   int x;
@@ -54,9 +82,8 @@ int asmrec_add_arg(struct ASMRecord *ptr, int width) {
   return 0;
 }
 
-int asmrec_parse_format(struct ASMRecord *ptr, char *fmt) {
+int asmrec_parse_format(struct ASMRecord *ptr, const char *fmt) {
   int x, i, fmt_count, bitcount, bitinc, argused;
-  char buf[MAX_TOKLEN];
   uint32_t imask = 0x00000000;
   
   /* sanity check */
@@ -89,29 +116,29 @@ int asmrec_parse_format(struct ASMRecord *ptr, char *fmt) {
       
     case '(':
       /* convert "(X)" into numeric 'X' */
-      i = 0;
-      memset(buf, 0, MAX_TOKLEN);	/* clear string */
-      for (x++; fmt[x]!=')'; x++) {
-	buf[i++] = fmt[x];
+      i = (int)strtol(&fmt[x+1], (char **)NULL, 0);
+      while (fmt[x] != ')') {
+	x++;
       }
-      
-      /* convert this to a numeric value */
-      i = (int)strtol(buf, (char **)NULL, 0);
-      if ((i >= 0) && (i < ptr->num_args)) {
+      if (fmt_count >= MAX_ASM_ARGS) {
+	diag_printf(stdout, "ERROR - Too many subfields, at most %d\n", MAX_ASM_ARGS);
+	return -1;
+      }
+      else if ((i >= 0) && (i < ptr->num_args)) {
 	ptr->fmt_args[fmt_count].argNum = i;
 	imask = imask << ptr->arg_widths[i];
 	bitinc = ptr->arg_widths[i];
 	argused = fmt_count++; /* save this for a bit */
       }
       else {
-	printf("ERROR - Invalid subfield specifier, \"(%d)\"\n", i);
+	diag_printf(stdout, "ERROR - Invalid subfield specifier, \"(%d)\"\n", i);
       }
       break;
     }
     
     /* update known offsets */
     bitcount += bitinc;
-    for (i=0; i<ptr->num_args; i++) {
+    for (i=0; i<fmt_count; i++) {
       if (ptr->fmt_args[i].argOffset != -1) {
 	ptr->fmt_args[i].argOffset += bitinc;
       }
@@ -125,11 +152,30 @@ int asmrec_parse_format(struct ASMRecord *ptr, char *fmt) {
   
   /* check that its multiple of 8 (byte aligned) */
   if ((bitcount % 8) != 0) {
-    printf("ERROR - Instruction format is not byte aligned\n");
+    diag_printf(stdout, "ERROR - Instruction format is not byte aligned\n");
     return -1;
   }
   ptr->byte_count = bitcount / 8;
   ptr->asm_mask = imask;
+  
+  /* flatten the fields into an encoder program, grouped by the
+   * argument that fills them */
+  i = 0;
+  ptr->fixed = 1;
+  for (x=0; x<ptr->num_args; x++) {
+    ptr->arg_first[x] = i;
+    for (bitinc=0; bitinc<fmt_count; bitinc++) {
+      if (ptr->fmt_args[bitinc].argNum == x) {
+	ptr->ops[i].mask = FIELD_MASK(ptr->arg_widths[x]);
+	ptr->ops[i].shift = ptr->fmt_args[bitinc].argOffset;
+	i += 1;
+      }
+    }
+    if (i - ptr->arg_first[x] != 1) {
+      ptr->fixed = 0;
+    }
+  }
+  ptr->arg_first[ptr->num_args] = i;
   DEBUG(1) printf("Instruction is %d bytes wide\n", ptr->byte_count);
   DEBUG(1) printf("Instruction mask is %04X\n", ptr->asm_mask);
   
@@ -146,39 +192,429 @@ int asmrec_free(struct ASMRecord *ptr) {
   return 0;
 }
 
-struct ASMRecord* asmrec_load(struct SymTab **curSyms, char *infile) {
+/* compile a list of parsed records into a lookup index, with the
+ * hot encoding fields packed into one array. where a mnemonic is
+ * defined twice, the head of the list (the later definition) wins.
+ * any symbols in defaults are kept to apply when selected */
+struct ASMArch* asmrec_compile(struct ASMRecord *list,
+			       struct SymTab **defaults) {
+  struct ASMArch *arch;
+  struct ASMRecord *rec;
+  struct ASMSlot *slot;
+  const struct SymEntry *sym;
+  unsigned int iter;
+  int count, numDefaults, slots, x;
+  size_t strsize, stroff;
+  uint32_t hash;
+
+  /* size everything up first */
+  count = 0;
+  strsize = 0;
+  for (rec = list; rec != NULL; rec = rec->next) {
+    count += 1;
+    strsize += strlen(rec->mnemonic) + 1;
+  }
+  numDefaults = 0;
+  for (iter = 0; (sym = symtab_next(defaults, &iter)) != NULL; ) {
+    numDefaults += 1;
+    strsize += strlen(sym->name) + 1;
+    if (sym->strVal != NULL) {
+      strsize += strlen(sym->strVal) + 1;
+    }
+  }
+
+  /* index is kept at most half full */
+  for (slots = 16; slots < 2*count; slots <<= 1) { }
+
+  if ((arch = CALLOC(struct ASMArch, 1)) == NULL) {
+    return NULL;
+  }
+  arch->enc = CALLOC(struct ASMEncoding, count ? count : 1);
+  arch->names = CALLOC(uint32_t, count ? count : 1);
+  arch->strings = CALLOC(char, strsize ? strsize : 1);
+  arch->slots = CALLOC(struct ASMSlot, slots);
+  arch->defaults = CALLOC(struct ASMDefault, numDefaults ? numDefaults : 1);
+  if ((arch->enc == NULL) || (arch->names == NULL) ||
+      (arch->strings == NULL) || (arch->slots == NULL) ||
+      (arch->defaults == NULL)) {
+    asmrec_free_arch(arch);
+    return NULL;
+  }
+  arch->mask = slots - 1;
+  arch->count = 0;
+  arch->strSize = strsize;
+  for (x=0; x<slots; x++) {
+    arch->slots[x].index = -1;
+  }
+
+  stroff = 0;
+  for (rec = list; rec != NULL; rec = rec->next) {
+    /* find its slot, skipping redefinitions */
+    hash = intern_hash(rec->mnemonic, strlen(rec->mnemonic));
+    for (x = hash & arch->mask; ; x = (x + 1) & arch->mask) {
+      slot = &arch->slots[x];
+      if ((slot->index == -1) ||
+	  ((slot->hash == hash) &&
+	   (strcmp(&arch->strings[arch->names[slot->index]],
+		   rec->mnemonic) == 0))) {
+	break;
+      }
+    }
+    if (slot->index != -1) {
+      DEBUG(1) printf("Mnemonic %s redefined, using later one\n",
+		      rec->mnemonic);
+      continue;
+    }
+
+    /* pack it in */
+    slot->hash = hash;
+    slot->index = arch->count;
+    arch->names[arch->count] = stroff;
+    strcpy(&arch->strings[stroff], rec->mnemonic);
+    stroff += strlen(rec->mnemonic) + 1;
+    arch->enc[arch->count].asm_mask = rec->asm_mask;
+    arch->enc[arch->count].byte_count = rec->byte_count;
+    arch->enc[arch->count].num_args = rec->num_args;
+    memcpy(arch->enc[arch->count].arg_widths, rec->arg_widths,
+	   sizeof(rec->arg_widths));
+    arch->enc[arch->count].fixed = rec->fixed;
+    memcpy(arch->enc[arch->count].arg_first, rec->arg_first,
+	   sizeof(rec->arg_first));
+    memcpy(arch->enc[arch->count].ops, rec->ops, sizeof(rec->ops));
+    arch->count += 1;
+  }
+
+  /* and the symbols it defines */
+  for (iter = 0; (sym = symtab_next(defaults, &iter)) != NULL; ) {
+    arch->defaults[arch->numDefaults].name = stroff;
+    strcpy(&arch->strings[stroff], sym->name);
+    stroff += strlen(sym->name) + 1;
+    if (sym->strVal != NULL) {
+      arch->defaults[arch->numDefaults].strVal = stroff;
+      strcpy(&arch->strings[stroff], sym->strVal);
+      stroff += strlen(sym->strVal) + 1;
+    }
+    else {
+      arch->defaults[arch->numDefaults].strVal = ASM_NO_STRING;
+    }
+    arch->defaults[arch->numDefaults].intVal = sym->intVal;
+    arch->numDefaults += 1;
+  }
+
+  return arch;
+}
+
+/* one probe (or a short run) to find a mnemonic's encoding, by
+ * the interned id of its name */
+const struct ASMEncoding* asmrec_find(const struct ASMArch *arch,
+				      uint32_t mnemonic) {
+  const struct ASMSlot *slot;
+  uint32_t x, hash;
+
+  if ((arch == NULL) || (mnemonic == INTERN_NONE)) {
+    return NULL;
+  }
+
+  STATS_COUNT(asmLookups, 1);
+  hash = INTERN_HASH(mnemonic);
+  for (x = hash & arch->mask; ; x = (x + 1) & arch->mask) {
+    STATS_COUNT(asmProbes, 1);
+    slot = &arch->slots[x];
+    if (slot->index == -1) {
+      return NULL;
+    }
+    if ((slot->hash == hash) && (arch->ids[slot->index] == mnemonic)) {
+      return &arch->enc[slot->index];
+    }
+  }
+}
+
+/* intern every mnemonic, so lookups compare ids. this is done on
+ * each load, ids are not kept in the cache file */
+static int asmrec_intern_names(struct ASMArch *arch) {
+  const char *name;
+  int x;
+
+  if ((arch->ids = CALLOC(uint32_t, arch->count ? arch->count : 1)) == NULL) {
+    return -1;
+  }
+  for (x=0; x<arch->count; x++) {
+    name = &arch->strings[arch->names[x]];
+    if ((arch->ids[x] = intern_string(name, strlen(name))) == INTERN_NONE) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int asmrec_free_arch(struct ASMArch *arch) {
+  if (arch == NULL) {
+    return 0;
+  }
+  free(arch->ids);
+  if (arch->map != NULL) {
+    /* everything points into the cache file */
+    munmap(arch->map, arch->mapLen);
+  }
+  else {
+    free(arch->enc);
+    free(arch->names);
+    free(arch->strings);
+    free(arch->slots);
+    free(arch->defaults);
+  }
+  free(arch);
+  return 0;
+}
+
+/* apply the symbols an architecture defines to a program */
+static void asmrec_apply_defaults(const struct ASMArch *arch,
+				  struct SymTab **curSyms) {
+  const struct ASMDefault *def;
+  int x;
+
+  if (curSyms == NULL) {
+    return;
+  }
+  for (x=0; x<arch->numDefaults; x++) {
+    def = &arch->defaults[x];
+    symtab_record(curSyms, &arch->strings[def->name],
+		  (def->strVal == ASM_NO_STRING) ?
+		  NULL : &arch->strings[def->strVal],
+		  def->intVal);
+  }
+}
+
+/* 64 bit FNV-1a over a whole file, to validate cached copies */
+static int asmrec_hash_file(FILE *handle, struct stat *info, uint64_t *pHash) {
+  void *map;
+  uint64_t hash = DEPEND_HASH_INIT;
+
+  if (info->st_size > 0) {
+    map = mmap(NULL, info->st_size, PROT_READ, MAP_PRIVATE, fileno(handle), 0);
+    if (map == MAP_FAILED) {
+      return -1;
+    }
+    hash = depend_hash(hash, map, info->st_size);
+    munmap(map, info->st_size);
+  }
+  *pHash = hash;
+  return 0;
+}
+
+/* check an offset lands inside an architecture's strings */
+#define ASMCACHE_STRING_OK(arch, off) ((off) < (arch)->strSize)
+
+/* check nothing in a mapped cache file points outside it, and that
+ * every lookup in its index ends, as the file may be damaged */
+static int asmrec_check_cache(const struct ASMArch *arch) {
+  const struct ASMEncoding *enc;
+  const struct ASMDefault *def;
+  int x, y, empty = 0;
+
+  if ((arch->strSize == 0) || (arch->strings[arch->strSize - 1] != '\0')) {
+    return -1;
+  }
+  for (x=0; x<arch->count; x++) {
+    enc = &arch->enc[x];
+    if (!ASMCACHE_STRING_OK(arch, arch->names[x]) ||
+	(enc->num_args > MAX_ASM_ARGS) ||
+	(enc->byte_count > sizeof(enc->asm_mask))) {
+      return -1;
+    }
+    for (y=0; y<enc->num_args; y++) {
+      if ((enc->arg_first[y] > enc->arg_first[y+1]) ||
+	  (enc->arg_first[y+1] > MAX_ASM_ARGS)) {
+	return -1;
+      }
+    }
+    for (y=0; y<enc->arg_first[enc->num_args]; y++) {
+      if (enc->ops[y].shift >= 32) {
+	return -1;
+      }
+    }
+  }
+  for (x=0; x<=(int)arch->mask; x++) {
+    if (arch->slots[x].index == -1) {
+      empty += 1;
+    }
+    else if ((arch->slots[x].index < 0) ||
+	     (arch->slots[x].index >= arch->count)) {
+      return -1;
+    }
+  }
+  for (x=0; x<arch->numDefaults; x++) {
+    def = &arch->defaults[x];
+    if (!ASMCACHE_STRING_OK(arch, def->name) ||
+	((def->strVal != ASM_NO_STRING) &&
+	 !ASMCACHE_STRING_OK(arch, def->strVal))) {
+      return -1;
+    }
+  }
+  /* asmrec_find stops at an unused slot */
+  return (empty > 0) ? 0 : -1;
+}
+
+/* try to map a compiled copy of the architecture in filename,
+ * returning NULL if there is none, it is out of date or damaged */
+static struct ASMArch* asmrec_load_cache(char *filename, FILE *handle) {
+  struct ASMCacheHeader *hdr;
+  struct ASMArch *arch;
+  struct stat info, cinfo;
+  char cachename[PATH_MAX + 8];
+  uint64_t hash;
+  UINT64 expect;
+  char *map;
+  int fd;
+
+  if ((fstat(fileno(handle), &info) != 0) ||
+      (asmrec_hash_file(handle, &info, &hash) != 0)) {
+    return NULL;
+  }
+
+  snprintf(cachename, sizeof(cachename), "%s" ASMCACHE_SUFFIX, filename);
+  if ((fd = open(cachename, O_RDONLY)) < 0) {
+    return NULL;
+  }
+  if ((fstat(fd, &cinfo) != 0) ||
+      (cinfo.st_size < (off_t)sizeof(struct ASMCacheHeader))) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, cinfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  /* check it is ours, the same layout, and from this exact source */
+  hdr = (struct ASMCacheHeader*)map;
+  expect = sizeof(struct ASMCacheHeader) +
+    (UINT64)hdr->count * (sizeof(struct ASMEncoding) + sizeof(uint32_t)) +
+    (UINT64)hdr->numSlots * sizeof(struct ASMSlot) +
+    (UINT64)hdr->numDefaults * sizeof(struct ASMDefault) + hdr->strSize;
+  if ((memcmp(hdr->magic, ASMCACHE_MAGIC, 8) != 0) ||
+      (hdr->version != ASMCACHE_VERSION) ||
+      (hdr->encSize != sizeof(struct ASMEncoding)) ||
+      (hdr->srcSize != (uint64_t)info.st_size) ||
+      (hdr->srcMtime != (int64_t)info.st_mtime) ||
+      (hdr->srcHash != hash) ||
+      (hdr->numSlots == 0) || ((hdr->numSlots & (hdr->numSlots - 1)) != 0) ||
+      (hdr->count > INT_MAX) || (hdr->numDefaults > INT_MAX) ||
+      (expect != (UINT64)cinfo.st_size)) {
+    DEBUG(2) printf("Cached architecture %s is stale\n", cachename);
+    munmap(map, cinfo.st_size);
+    return NULL;
+  }
+
+  /* good, point straight into it */
+  if ((arch = CALLOC(struct ASMArch, 1)) == NULL) {
+    munmap(map, cinfo.st_size);
+    return NULL;
+  }
+  arch->map = map;
+  arch->mapLen = cinfo.st_size;
+  arch->count = hdr->count;
+  arch->mask = hdr->numSlots - 1;
+  arch->numDefaults = hdr->numDefaults;
+  arch->strSize = hdr->strSize;
+  map += sizeof(struct ASMCacheHeader);
+  arch->enc = (struct ASMEncoding*)map;
+  map += hdr->count * sizeof(struct ASMEncoding);
+  arch->names = (uint32_t*)map;
+  map += hdr->count * sizeof(uint32_t);
+  arch->slots = (struct ASMSlot*)map;
+  map += hdr->numSlots * sizeof(struct ASMSlot);
+  arch->defaults = (struct ASMDefault*)map;
+  map += hdr->numDefaults * sizeof(struct ASMDefault);
+  arch->strings = map;
+  if (asmrec_check_cache(arch) != 0) {
+    DEBUG(2) printf("Cached architecture %s is damaged\n", cachename);
+    asmrec_free_arch(arch);
+    return NULL;
+  }
+
+  DEBUG(2) printf("Loaded compiled architecture %s\n", cachename);
+  return arch;
+}
+
+/* write a compiled copy of an architecture next to its source, so
+ * later runs can skip parsing. failure here is not an error */
+static void asmrec_save_cache(char *filename, FILE *handle,
+			      const struct ASMArch *arch) {
+  struct ASMCacheHeader hdr;
+  struct stat info;
+  char cachename[PATH_MAX + 8], tmpname[PATH_MAX + 32];
+  FILE *out;
+  int ok;
+
+  memset(&hdr, 0, sizeof(hdr));
+  if ((fstat(fileno(handle), &info) != 0) ||
+      (asmrec_hash_file(handle, &info, &hdr.srcHash) != 0)) {
+    return;
+  }
+  memcpy(hdr.magic, ASMCACHE_MAGIC, 8);
+  hdr.version = ASMCACHE_VERSION;
+  hdr.encSize = sizeof(struct ASMEncoding);
+  hdr.srcSize = info.st_size;
+  hdr.srcMtime = info.st_mtime;
+  hdr.count = arch->count;
+  hdr.numSlots = arch->mask + 1;
+  hdr.numDefaults = arch->numDefaults;
+  hdr.strSize = arch->strSize;
+
+  /* write aside and rename, so readers never see half a file */
+  snprintf(cachename, sizeof(cachename), "%s" ASMCACHE_SUFFIX, filename);
+  snprintf(tmpname, sizeof(tmpname), "%s.%d", cachename, (int)getpid());
+  if ((out = fopen(tmpname, "wb")) == NULL) {
+    DEBUG(2) printf("Cannot write architecture cache %s\n", cachename);
+    return;
+  }
+  ok = (fwrite(&hdr, sizeof(hdr), 1, out) == 1);
+  ok = ok && (fwrite(arch->enc, sizeof(struct ASMEncoding),
+		     arch->count, out) == (size_t)arch->count);
+  ok = ok && (fwrite(arch->names, sizeof(uint32_t),
+		     arch->count, out) == (size_t)arch->count);
+  ok = ok && (fwrite(arch->slots, sizeof(struct ASMSlot),
+		     hdr.numSlots, out) == hdr.numSlots);
+  ok = ok && (fwrite(arch->defaults, sizeof(struct ASMDefault),
+		     arch->numDefaults, out) == (size_t)arch->numDefaults);
+  ok = ok && (fwrite(arch->strings, 1, arch->strSize, out) == arch->strSize);
+  ok = (fclose(out) == 0) && ok;
+  if (!ok || (rename(tmpname, cachename) != 0)) {
+    unlink(tmpname);
+  }
+}
+
+/* parse an architecture file, collecting the symbols it defines.
+ * name is what messages call it */
+static struct ASMArch* asmrec_parse(FILE *handle, const char *name) {
   struct ScanData cfgScan;
   struct ASMRecord *entry, *stack = NULL;
+  struct ASMArch *arch;
+  struct SymTab *defaults = NULL;
   struct Token curToken;
-  char filename[256], **fmt;
-  FILE *handle = NULL;
   TokenType ttype;		/* type of current token */
   int x;
   
-  /* try to open file */
-  for (fmt = cfg_file_formats; handle == NULL; fmt = &(fmt[1])) {
-    if (*fmt == NULL) {
-      DEBUG(2) fprintf(stderr, "Tried to open %s, but could not\n", infile);
-      return NULL;
-    }
-    else {
-      sprintf(filename, *fmt, infile);
-      DEBUG(2) printf("Trying to open %s\n", filename);
-      handle = fopen(filename, "r");
-    }
-  }
-  
   /* file is open */
   DEBUG(2) printf("file open\n");
   SCANNER_INIT(&cfgScan,handle);
+  if (scan_name(&cfgScan, name) != 0) {
+    SCANNER_STOP(&cfgScan);
+    return NULL;
+  }
   
   while (1) {
     switch (get_token(&curToken, &cfgScan)) {
       
     case TOK_EOF:
-      /* end of file */
+      /* end of file, compile what we found for lookup */
       SCANNER_STOP(&cfgScan);
-      return stack;
+      arch = asmrec_compile(stack, &defaults);
+      asmrec_free(stack);
+      symtab_clear(&defaults);
+      return arch;
       break;
       
     case TOK_ENDL:
@@ -187,19 +623,19 @@ struct ASMRecord* asmrec_load(struct SymTab **curSyms, char *infile) {
       
     case TOK_DIRECTIVE:
       /* directive, pass current data to directive handler */
-      directive_parse(&cfgScan, &curToken, curSyms, NULL, NULL);
+      directive_parse(&cfgScan, &curToken, &defaults, NULL, NULL);
       break;
       
     case TOK_IDENT:
       /* assume this is a format entry */
-      DEBUG(1) printf("\nGot a format entry for %s\n", curToken.token);
+      DEBUG(1) printf("\nGot a format entry for %s\n", TOKSTR(&curToken));
       
       /* set up a record for it */
       entry = MALLOC(struct ASMRecord);
       asmrec_init(entry);
       
       /* set name */
-      strncpy(entry->mnemonic, curToken.token, MAX_TOKLEN);
+      entry->mnemonic = TOKSTR(&curToken);
       
       /* add argument widths as needed */
       ttype = scan_token(&curToken, &cfgScan);
@@ -210,10 +646,10 @@ struct ASMRecord* asmrec_load(struct SymTab **curSyms, char *infile) {
       
       /* the format should be next */
       if (ttype == TOK_FORMAT) {
-	if (asmrec_parse_format(entry, curToken.token) != 0) {
+	if (asmrec_parse_format(entry, TOKSTR(&curToken)) != 0) {
 	  /* could not parse, forget it */
-	  printf("ERROR - Format unusable for %s, attempting "
-		 "to continue without it\n", entry->mnemonic);
+	  diag_printf(stdout, "ERROR - Format unusable for %s, attempting "
+		      "to continue without it\n", entry->mnemonic);
 	  free(entry);
 	}
 	else {
@@ -232,23 +668,237 @@ struct ASMRecord* asmrec_load(struct SymTab **curSyms, char *infile) {
 	}
       }
       else {
-	printf("FATAL - Unexpected Token %s, line %d\n",
-	       curToken.token, curToken.linenum);
+	diag_printf(stdout, "FATAL - Unexpected Token %s, %s:%d\n",
+		    TOKSTR(&curToken), TOKPOS(&curToken));
 	free(entry);
 	SCANNER_STOP(&cfgScan);
 	asmrec_free(stack);
+	symtab_clear(&defaults);
 	return NULL;
       }
       break;
       
     default:
-      printf("Unexpected Token %s, line %d\n",
-	     curToken.token, curToken.linenum);
+      diag_printf(stdout, "Unexpected Token %s, %s:%d\n",
+		  TOKSTR(&curToken), TOKPOS(&curToken));
       SCANNER_STOP(&cfgScan);
       asmrec_free(stack);
+      symtab_clear(&defaults);
       return NULL;
       break;
     }
   }
   return NULL;
 }
+
+/* the name of an architecture's file in one of cfg_file_formats,
+ * returning nonzero if it does not fit in PATH_MAX */
+static int asmrec_cfg_name(char *filename, int fmt, const char *infile) {
+  int len;
+
+  len = snprintf(filename, PATH_MAX, cfg_file_formats[fmt], infile);
+  return ((len < 0) || (len >= PATH_MAX)) ? -1 : 0;
+}
+
+/* note the architecture file a build used, and those looked for
+ * before it, which would be used instead if they turned up */
+static void asmrec_note_depends(const char *infile, int found) {
+  char filename[PATH_MAX];
+  int x;
+
+  for (x=0; x<=found; x++) {
+    if (asmrec_cfg_name(filename, x, infile) == 0) {
+      depend_note(filename, x < found);
+    }
+  }
+}
+
+/* check a loaded architecture still matches its file: it has not
+ * changed, and no file looked for before it has turned up */
+static int asmrec_current(const struct ArchEntry *entry) {
+  char filename[PATH_MAX];
+  struct stat info;
+  int x;
+
+  for (x=0; x<entry->found; x++) {
+    if ((asmrec_cfg_name(filename, x, entry->name) == 0) &&
+	(stat(filename, &info) == 0)) {
+      return 0;
+    }
+  }
+  return (asmrec_cfg_name(filename, entry->found, entry->name) == 0) &&
+    (stat(filename, &info) == 0) && (info.st_size == entry->size) &&
+    (info.st_mtim.tv_sec == entry->mtime.tv_sec) &&
+    (info.st_mtim.tv_nsec == entry->mtime.tv_nsec);
+}
+
+/* find or load an architecture, see asmrec_load */
+static const struct ASMArch* asmrec_get(struct SymTab **curSyms,
+					const char *infile) {
+  struct ArchRegistry *reg = arch_cur;
+  struct ArchEntry *entry, **link;
+  struct ASMArch *arch;
+  struct stat info;
+  char filename[PATH_MAX], **fmt;
+  FILE *handle = NULL;
+  int found;
+
+  /* names too long for a path could never be opened */
+  for (found=0; cfg_file_formats[found] != NULL; found++) {
+    if (asmrec_cfg_name(filename, found, infile) != 0) {
+      diag_printf(stderr, "ERROR - Architecture name %.32s... is too long\n",
+		  infile);
+      return NULL;
+    }
+  }
+
+  /* already have it, and its file is as it was? */
+  pthread_mutex_lock(&reg->lock);
+  for (link = &reg->loaded; (entry = *link) != NULL; link = &entry->next) {
+    if (strcmp(entry->name, infile) != 0) {
+      continue;
+    }
+    if (asmrec_current(entry)) {
+      pthread_mutex_unlock(&reg->lock);
+      asmrec_note_depends(infile, entry->found);
+      asmrec_apply_defaults(entry->arch, curSyms);
+      return entry->arch;
+    }
+    *link = entry->next;
+    entry->next = reg->retired;
+    reg->retired = entry;
+    break;
+  }
+  
+  /* try to open file */
+  for (fmt = cfg_file_formats; handle == NULL; fmt = &(fmt[1])) {
+    if (*fmt == NULL) {
+      DEBUG(2) fprintf(stderr, "Tried to open %s, but could not\n", infile);
+      pthread_mutex_unlock(&reg->lock);
+      return NULL;
+    }
+    else {
+      asmrec_cfg_name(filename, fmt - cfg_file_formats, infile);
+      DEBUG(2) printf("Trying to open %s\n", filename);
+      handle = fopen(filename, "r");
+    }
+  }
+  found = fmt - cfg_file_formats - 1;
+  asmrec_note_depends(infile, found);
+  if (fstat(fileno(handle), &info) != 0) {
+    memset(&info, 0, sizeof(info));
+  }
+
+  /* use the compiled copy if it is current, else parse and save one */
+  if ((arch = asmrec_load_cache(filename, handle)) == NULL) {
+    if ((arch = asmrec_parse(handle, filename)) != NULL) {
+      asmrec_save_cache(filename, handle, arch);
+    }
+  }
+  fclose(handle);
+  if ((arch != NULL) && (asmrec_intern_names(arch) != 0)) {
+    asmrec_free_arch(arch);
+    arch = NULL;
+  }
+
+  /* remember it for next time */
+  if ((arch != NULL) &&
+      (((entry = MALLOC(struct ArchEntry)) == NULL) ||
+       ((entry->name = STRDUP(infile)) == NULL))) {
+    free(entry);
+    asmrec_free_arch(arch);
+    arch = NULL;
+  }
+  if (arch != NULL) {
+    entry->found = found;
+    entry->mtime = info.st_mtim;
+    entry->size = info.st_size;
+    entry->arch = arch;
+    entry->next = reg->loaded;
+    reg->loaded = entry;
+  }
+  pthread_mutex_unlock(&reg->lock);
+  if (arch == NULL) {
+    return NULL;
+  }
+
+  asmrec_apply_defaults(arch, curSyms);
+  return arch;
+}
+
+/*
+ * asmrec_load
+ *    select an architecture by name. each one is loaded once per
+ * registry (see asmrec_attach), and again should its file change,
+ * and kept until asmrec_unload_all, so the returned architecture is
+ * shared and must not be freed or modified. a compiled copy is kept
+ * beside the .cfg file, and used instead of parsing it whenever it
+ * matches the file's size, time and contents. the symbols the file
+ * defines are recorded into curSyms. safe to call from several
+ * threads, a first load holds up the others.
+ *
+ * returns the architecture, NULL if it cannot be loaded
+ */
+const struct ASMArch* asmrec_load(struct SymTab **curSyms,
+				  const char *infile) {
+  const struct ASMArch *arch;
+  struct StatsTimer timer;
+
+  stats_start(&timer);
+  arch = asmrec_get(curSyms, infile);
+  stats_stop(&timer, STATS_ARCH);
+  return arch;
+}
+
+/* free a list of loaded architectures */
+static void asmrec_free_entries(struct ArchEntry *list) {
+  struct ArchEntry *temp;
+
+  while (list != NULL) {
+    temp = list->next;
+    asmrec_free_arch(list->arch);
+    free(list->name);
+    free(list);
+    list = temp;
+  }
+}
+
+/* drop every architecture in a registry */
+static void asmrec_clear(struct ArchRegistry *reg) {
+  pthread_mutex_lock(&reg->lock);
+  asmrec_free_entries(reg->loaded);
+  asmrec_free_entries(reg->retired);
+  reg->loaded = NULL;
+  reg->retired = NULL;
+  pthread_mutex_unlock(&reg->lock);
+}
+
+/* set up an empty registry, for architectures kept apart from the
+ * rest of the process */
+void asmrec_registry_init(struct ArchRegistry *reg) {
+  reg->loaded = NULL;
+  reg->retired = NULL;
+  pthread_mutex_init(&reg->lock, NULL);
+}
+
+/* release a registry made by asmrec_registry_init, and everything
+ * loaded into it. no thread may be using it */
+void asmrec_registry_free(struct ArchRegistry *reg) {
+  asmrec_clear(reg);
+  pthread_mutex_destroy(&reg->lock);
+}
+
+/* load architectures into reg from now on, on this thread only,
+ * NULL for the process wide one. returns the one used before */
+struct ArchRegistry *asmrec_attach(struct ArchRegistry *reg) {
+  struct ArchRegistry *old = arch_cur;
+
+  arch_cur = (reg != NULL) ? reg : &arch_global;
+  return old;
+}
+
+/* drop every architecture this thread's registry has loaded, once
+ * no program is using them */
+void asmrec_unload_all(void) {
+  asmrec_clear(arch_cur);
+}
@@ -0,0 +1,895 @@
+/*
+ * build.c
+ *
+ * Drives a whole assembly: read a program, run the passes and
+ * write the output. Batch runs hand a list of programs to a pool
+ * of worker threads, which share the loaded architectures (see
+ * asmrec_load) but nothing else.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "asm.h"
+#include "object.h"
+#include "cache.h"
+#include "build.h"
+
+/* shared state of a batch run */
+struct BuildPool {
+  struct BuildList *list;
+  struct BuildOpts *opts;
+  int next;			/* next job to hand out */
+  pthread_mutex_t lock;
+};
+
+/* replace the extension of out with ext, or add one */
+static void guess_output(char *out, size_t size, const char *ext) {
+  int x, pIdx = -1;
+
+  for (x=0; out[x] != '\0'; x++) {
+    if (out[x] == '.') {
+      pIdx = x;
+    }
+    else if (out[x] == '/') {
+      pIdx = -1;
+    }
+  }
+
+  if (pIdx == -1) {
+    pIdx = x;
+  }
+  snprintf(&out[pIdx], size - pIdx, ".%s", ext);
+}
+
+/* report how writing an output went, after cache_finish_write, and
+ * note it in outputs (if given) */
+static int build_wrote(char *target, int ret, struct DependList *outputs) {
+  if (ret < 0) {
+    fprintf(stderr, "FATAL - File output failed\n");
+    return -1;
+  }
+  if (ret == 1) {
+    printf("Output '%s' is unchanged\n", target);
+  }
+  if ((outputs != NULL) && (depend_add(outputs, target, 0) != 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+/* write out an assembled program in each of its output formats.
+ * if outName is NULL the names are made from the input name, and
+ * if there are several formats its extension is replaced. files
+ * already holding the same bytes are left alone */
+static int build_output(struct SymTab **prgSyms, struct Image *image,
+			char *inName, char *outName, struct BuildOpts *opts,
+			struct DependList *outputs) {
+  const struct ASMOutFormat *fmt;
+  char outfmt[MAX_TOKLEN], guessed[1024], tmpname[1100];
+  char *name, *rest, *target, *written;
+  int count = 0, ret;
+
+  /* display known symbols */
+  if (0) {
+    symtab_show(prgSyms);
+  }
+
+  /* which formats to write, the command line winning */
+  if (opts->formats != NULL) {
+    strncpy(outfmt, opts->formats, sizeof(outfmt) - 1);
+    outfmt[sizeof(outfmt) - 1] = '\0';
+  }
+  else if (symtab_lookup(prgSyms, "$outfmt", outfmt, NULL) != 0) {
+    if (outName == NULL) {
+      printf("INFO: Unknown output format, defaulting to mif\n");
+    }
+    strcpy(outfmt, "mif");
+  }
+  for (name = outfmt; *name != '\0'; name++) {
+    if ((*name != ',') && (*name != ' ') &&
+	((name == outfmt) || (name[-1] == ',') || (name[-1] == ' '))) {
+      count += 1;
+    }
+  }
+
+  if ((outName == NULL) && (strcmp(inName, "-") == 0)) {
+    fprintf(stderr, "FATAL - Output name required when reading stdin\n");
+    return -1;
+  }
+  if (opts->noRanges) {
+    /* command line wins over any .mifranges */
+    symtab_record(prgSyms, "$mifranges", NULL, 0);
+  }
+
+  for (name = strtok_r(outfmt, ", ", &rest); name != NULL;
+       name = strtok_r(NULL, ", ", &rest)) {
+    fmt = asmout_find_format(name);
+
+    /* identify output filename */
+    if ((outName != NULL) && (count == 1)) {
+      target = outName;
+    }
+    else {
+      strncpy(guessed, (outName != NULL) ? outName : inName,
+	      sizeof(guessed) - 1);
+      guessed[sizeof(guessed) - 1] = '\0';
+      guess_output(guessed, sizeof(guessed),
+		   (fmt != NULL) ? fmt->ext : name);
+      target = guessed;
+    }
+    printf("Output name is \'%s\'\n", target);
+
+    /* write file, unknown formats as a hex dump */
+    written = cache_write_name(target, tmpname, sizeof(tmpname));
+    ret = (fmt != NULL) ?
+      fmt->make(prgSyms, written, image, opts->passWorkers) :
+      asmout_make_rom(prgSyms, written, image, opts->passWorkers);
+    if (build_wrote(target, cache_finish_write(target, written, ret == 0),
+		    outputs) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* write out an assembled module as an object file, named after the
+ * input if outName is NULL */
+static int build_object(struct SymTab **prgSyms, struct Image *image,
+			struct FixupList *relocs, char *inName,
+			char *outName, struct DependList *outputs) {
+  char guessed[1024], tmpname[1100], *written;
+  int ret;
+
+  if (outName == NULL) {
+    if (strcmp(inName, "-") == 0) {
+      fprintf(stderr, "FATAL - Output name required when reading stdin\n");
+      return -1;
+    }
+    strncpy(guessed, inName, sizeof(guessed) - 1);
+    guessed[sizeof(guessed) - 1] = '\0';
+    guess_output(guessed, sizeof(guessed), OBJECT_SUFFIX);
+    outName = guessed;
+  }
+  printf("Output name is \'%s\'\n", outName);
+  written = cache_write_name(outName, tmpname, sizeof(tmpname));
+  ret = object_write(prgSyms, image, relocs, written);
+  return build_wrote(outName, cache_finish_write(outName, written, ret == 0),
+		     outputs);
+}
+
+/* a file name in a make rule, with make's special characters escaped */
+static void build_make_name(FILE *handle, const char *name) {
+  const char *c;
+
+  for (c = name; *c != '\0'; c++) {
+    if ((*c == ' ') || (*c == '#')) {
+      fputc('\\', handle);
+    }
+    else if (*c == '$') {
+      fputc('$', handle);
+    }
+    fputc(*c, handle);
+  }
+}
+
+/* write a make rule saying the outputs depend on the source and
+ * the files it used, with an empty rule for each of those so make
+ * carries on if one goes away. named after the first output */
+static int build_write_deps(char *inName, struct DependList *outputs,
+			    struct DependList *deps) {
+  char name[1024], tmpname[1100], *written;
+  FILE *handle;
+  unsigned int x;
+  int ok;
+
+  if (outputs->count == 0) {
+    return 0;
+  }
+  strncpy(name, outputs->files[0].name, sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  guess_output(name, sizeof(name), "d");
+
+  written = cache_write_name(name, tmpname, sizeof(tmpname));
+  if ((handle = fopen(written, "w")) == NULL) {
+    fprintf(stderr, "FATAL - Could not write dependencies %s\n", name);
+    return -1;
+  }
+  for (x=0; x<outputs->count; x++) {
+    fputs((x == 0) ? "" : " ", handle);
+    build_make_name(handle, outputs->files[x].name);
+  }
+  fputs(": ", handle);
+  build_make_name(handle, inName);
+  for (x=0; x<deps->count; x++) {
+    if (!deps->files[x].missing) {
+      fputs(" \\\n  ", handle);
+      build_make_name(handle, deps->files[x].name);
+    }
+  }
+  fputc('\n', handle);
+  for (x=0; x<deps->count; x++) {
+    if (!deps->files[x].missing) {
+      fputc('\n', handle);
+      build_make_name(handle, deps->files[x].name);
+      fputs(":\n", handle);
+    }
+  }
+  ok = !ferror(handle);
+  ok = (fclose(handle) == 0) && ok;
+  return build_wrote(name, cache_finish_write(name, written, ok), NULL);
+}
+
+/* assemble one program and write its output, see build_file. the
+ * files written are noted in outputs */
+static int build_assemble(char *inName, char *outName, struct BuildOpts *opts,
+			  long *srcBytes, struct Stats *stats,
+			  struct DependList *outputs) {
+  struct SymTab *prgSyms = NULL;
+  struct Image image;
+  struct ASMSource src;
+  struct FixupList relocs;
+  struct Stats *oldStats, archBefore;
+  struct StatsTimer timer;
+  struct stat info;
+  FILE *inFile;
+  int ret = -1;
+
+  IMAGE_INIT(&image);
+  memset(&src, 0, sizeof(src));
+  memset(&relocs, 0, sizeof(relocs));
+  if (stats != NULL) {
+    memset(stats, 0, sizeof(*stats));
+  }
+  oldStats = stats_attach(stats);
+
+  /* open input file */
+  if (strcmp(inName, "-") == 0) {
+    inFile = stdin;
+  }
+  else if ((inFile = fopen(inName, "r")) == NULL) {
+    fprintf(stderr, "FATAL - Could not open input file %s\n", inName);
+    stats_attach(oldStats);
+    return -1;
+  }
+  if (srcBytes != NULL) {
+    *srcBytes = ((fstat(fileno(inFile), &info) == 0) &&
+		 S_ISREG(info.st_mode)) ? (long)info.st_size : 0;
+  }
+
+  /* architectures are loaded from within the first pass, and
+   * timed on their own */
+  if (stats != NULL) {
+    archBefore = *stats;
+  }
+  stats_start(&timer);
+  if (opts->object) {
+    /* a module, in one pass keeping its relocations */
+    if (asmgen_assemble_object(&prgSyms, inFile, inName, &image, &relocs) != 0) {
+      fprintf(stderr, "FATAL - Could not assemble %s\n", inName);
+      goto done;
+    }
+  }
+  else if (opts->onePass) {
+    /* assemble everything as it comes in, counted as the first pass */
+    if (asmgen_assemble_onepass(&prgSyms, inFile, inName, &image) != 0) {
+      fprintf(stderr, "FATAL - Could not assemble %s\n", inName);
+      goto done;
+    }
+  }
+  else {
+    /* load the symbol table from the input file given, keeping
+     * its tokens for the second pass */
+    if (asmgen_parse_syms(&prgSyms, inFile, inName, &src) != 0) {
+      fprintf(stderr, "FATAL - Could not parse input %s\n", inName);
+      goto done;
+    }
+  }
+  stats_stop(&timer, STATS_PASS1);
+  if (stats != NULL) {
+    stats->wall[STATS_PASS1] -= stats->wall[STATS_ARCH] -
+      archBefore.wall[STATS_ARCH];
+    stats->cpu[STATS_PASS1] -= stats->cpu[STATS_ARCH] -
+      archBefore.cpu[STATS_ARCH];
+  }
+
+  if (!opts->onePass && !opts->object) {
+    /* attempt to assemble */
+    stats_start(&timer);
+    if (asmgen_assemble(&prgSyms, &src, &image, opts->passWorkers) != 0) {
+      fprintf(stderr, "FATAL - Could not assemble %s\n", inName);
+      goto done;
+    }
+    stats_stop(&timer, STATS_PASS2);
+  }
+
+  stats_start(&timer);
+  ret = opts->object ?
+    build_object(&prgSyms, &image, &relocs, inName, outName, outputs) :
+    build_output(&prgSyms, &image, inName, outName, opts, outputs);
+  stats_stop(&timer, STATS_OUTPUT);
+
+ done:
+  if (inFile != stdin) {
+    fclose(inFile);
+  }
+  asmgen_free_source(&src);
+  asmgen_free_fixups(&relocs);
+  image_free(&image);
+  symtab_clear(&prgSyms);
+  stats_attach(oldStats);
+  return ret;
+}
+
+/*
+ * build_file
+ *    assemble one program, or one module of one if opts->object is
+ * set, and write its output. if outName is NULL it is made from the
+ * input name and output format. the size of the source is passed
+ * back in srcBytes, if given. if stats is given, the phases are
+ * timed and counted into it. with a cache, a build already done
+ * from the same files is put back from it instead.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int build_file(char *inName, char *outName, struct BuildOpts *opts,
+	       long *srcBytes, struct Stats *stats) {
+  struct DependList deps, outputs, *oldDeps;
+  struct stat info;
+  uint64_t key;
+  int cached = 0, ret = 1;
+
+  memset(&deps, 0, sizeof(deps));
+  memset(&outputs, 0, sizeof(outputs));
+  if ((opts->cacheDir != NULL) && (strcmp(inName, "-") != 0) &&
+      (cache_key(inName, outName, opts, &key) == 0)) {
+    cached = 1;
+    ret = cache_restore(opts->cacheDir, key, &deps, &outputs);
+  }
+
+  if (ret == 0) {
+    /* nothing to do but report */
+    if (stats != NULL) {
+      memset(stats, 0, sizeof(*stats));
+    }
+    if (srcBytes != NULL) {
+      *srcBytes = (stat(inName, &info) == 0) ? (long)info.st_size : 0;
+    }
+  }
+  else if (ret > 0) {
+    /* note what the assembly opens, to check it next time */
+    oldDeps = depend_attach(&deps);
+    ret = build_assemble(inName, outName, opts, srcBytes, stats, &outputs);
+    depend_attach(oldDeps);
+    if ((ret == 0) && cached) {
+      cache_save(opts->cacheDir, key, &deps, &outputs);
+    }
+  }
+
+  if ((ret == 0) && opts->deps) {
+    ret = build_write_deps(inName, &outputs, &deps);
+  }
+  depend_free(&deps);
+  depend_free(&outputs);
+  return ret;
+}
+
+/*
+ * build_link
+ *    link object files into one program and write its output, in
+ * the formats its settings (or opts) ask for. if outName is NULL it
+ * is made from the name of the first object.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int build_link(char **names, int count, char *outName,
+	       struct BuildOpts *opts) {
+  struct SymTab *prgSyms = NULL;
+  struct Image image;
+  struct DependList deps, outputs;
+  int x, ret = -1;
+
+  IMAGE_INIT(&image);
+  memset(&deps, 0, sizeof(deps));
+  memset(&outputs, 0, sizeof(outputs));
+  if (object_link(names, count, &prgSyms, &image) != 0) {
+    fprintf(stderr, "FATAL - Could not link %s\n", names[0]);
+  }
+  else {
+    ret = build_output(&prgSyms, &image, names[0], outName, opts, &outputs);
+  }
+  if ((ret == 0) && opts->deps) {
+    /* the program depends on each of its objects */
+    for (x=1; (ret == 0) && (x<count); x++) {
+      ret = depend_add(&deps, names[x], 0);
+    }
+    if (ret == 0) {
+      ret = build_write_deps(names[0], &outputs, &deps);
+    }
+  }
+  depend_free(&deps);
+  depend_free(&outputs);
+  image_free(&image);
+  symtab_clear(&prgSyms);
+  return ret;
+}
+
+/* add a program to a job list, copying the names */
+int build_add_job(struct BuildList *list, char *inName, char *outName) {
+  struct BuildJob *newjobs, *job;
+  int newsize;
+
+  if (list->count == list->size) {
+    newsize = (list->size == 0) ? 64 : 2*list->size;
+    newjobs = REALLOC(list->jobs, newsize*sizeof(struct BuildJob));
+    if (newjobs == NULL) {
+      fprintf(stderr, "ERROR - Memory allocation failed\n");
+      return -1;
+    }
+    list->jobs = newjobs;
+    list->size = newsize;
+  }
+
+  job = &list->jobs[list->count];
+  job->inName = STRDUP(inName);
+  job->outName = (outName != NULL) ? STRDUP(outName) : NULL;
+  job->status = -1;
+  job->srcBytes = 0;
+  memset(&job->stats, 0, sizeof(job->stats));
+  if ((job->inName == NULL) || ((outName != NULL) && (job->outName == NULL))) {
+    fprintf(stderr, "ERROR - Memory allocation failed\n");
+    free(job->inName);
+    free(job->outName);
+    return -1;
+  }
+  list->count += 1;
+  return 0;
+}
+
+/*
+ * build_read_manifest
+ *    add the programs listed in a manifest file, one per line as
+ * "<input> [<output>]". blank lines and lines starting with '#'
+ * are skipped.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int build_read_manifest(struct BuildList *list, char *manifest) {
+  FILE *handle;
+  char line[2048], *inName, *outName;
+
+  if ((handle = fopen(manifest, "r")) == NULL) {
+    fprintf(stderr, "ERROR - Could not open manifest %s\n", manifest);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), handle) != NULL) {
+    inName = strtok(line, " \t\r\n");
+    if ((inName == NULL) || (inName[0] == '#')) {
+      continue;
+    }
+    outName = strtok(NULL, " \t\r\n");
+    if (build_add_job(list, inName, outName) != 0) {
+      fclose(handle);
+      return -1;
+    }
+  }
+
+  fclose(handle);
+  return 0;
+}
+
+void build_free_list(struct BuildList *list) {
+  int x;
+
+  for (x=0; x<list->count; x++) {
+    free(list->jobs[x].inName);
+    free(list->jobs[x].outName);
+  }
+  free(list->jobs);
+  list->jobs = NULL;
+  list->count = 0;
+  list->size = 0;
+}
+
+/* write a string as a JSON string */
+static void build_json_string(FILE *out, char *str) {
+  unsigned char *c;
+
+  fputc('"', out);
+  for (c = (unsigned char *)str; *c != '\0'; c++) {
+    if ((*c == '"') || (*c == '\\')) {
+      fprintf(out, "\\%c", *c);
+    }
+    else if (*c < 0x20) {
+      fprintf(out, "\\u%04x", *c);
+    }
+    else {
+      fputc(*c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/*
+ * build_write_stats
+ *    write the costs of every job in the list as JSON to the file
+ * statsName, or standard output if it is "-".
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int build_write_stats(struct BuildList *list, char *statsName) {
+  FILE *out;
+  int x;
+
+  if (strcmp(statsName, "-") == 0) {
+    out = stdout;
+  }
+  else if ((out = fopen(statsName, "w")) == NULL) {
+    fprintf(stderr, "ERROR - Could not open stats file %s\n", statsName);
+    return -1;
+  }
+
+  fprintf(out, "{\n  \"programs\": [");
+  for (x=0; x<list->count; x++) {
+    fprintf(out, "%s\n    {\n      \"input\": ", x ? "," : "");
+    build_json_string(out, list->jobs[x].inName);
+    fprintf(out, ",\n      \"output\": ");
+    if (list->jobs[x].outName != NULL) {
+      build_json_string(out, list->jobs[x].outName);
+    }
+    else {
+      fprintf(out, "null");
+    }
+    fprintf(out, ",\n      \"status\": %d,\n      \"source_bytes\": %ld,\n",
+	    list->jobs[x].status, list->jobs[x].srcBytes);
+    stats_write_json(out, &list->jobs[x].stats, "      ");
+    fprintf(out, "\n    }");
+  }
+  fprintf(out, "\n  ],\n  \"peak_rss_kb\": %ld\n}\n", stats_peak_rss());
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
+
+/* worker thread, takes jobs until there are none left */
+static void *build_worker(void *arg) {
+  struct BuildPool *pool = arg;
+  struct BuildJob *job;
+  int idx;
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    idx = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (idx >= pool->list->count) {
+      return NULL;
+    }
+
+    job = &pool->list->jobs[idx];
+    job->status = build_file(job->inName, job->outName, pool->opts,
+			     &job->srcBytes,
+			     (pool->opts->statsName != NULL) ? &job->stats :
+			     NULL);
+  }
+}
+
+/*
+ * build_batch
+ *    assemble every job in the list on a pool of worker threads,
+ * then print a summary of how it went.
+ *
+ * returns 0 if all succeeded, nonzero if any failed
+ */
+int build_batch(struct BuildList *list, int workers, struct BuildOpts *opts) {
+  struct BuildPool pool;
+  struct timespec start, stop;
+  pthread_t *threads;
+  double secs, bytes = 0;
+  int x, started, failed = 0;
+
+  if (workers < 1) {
+    workers = 1;
+  }
+  if (workers > list->count) {
+    workers = list->count;
+  }
+
+  pool.list = list;
+  pool.opts = opts;
+  pool.next = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+  if ((threads = CALLOC(pthread_t, workers ? workers : 1)) == NULL) {
+    fprintf(stderr, "ERROR - Memory allocation failed\n");
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (started=0; started<workers; started++) {
+    if (pthread_create(&threads[started], NULL, build_worker, &pool) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    /* no threads to be had, do it ourselves */
+    build_worker(&pool);
+  }
+  for (x=0; x<started; x++) {
+    pthread_join(threads[x], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  free(threads);
+  pthread_mutex_destroy(&pool.lock);
+
+  /* summary */
+  for (x=0; x<list->count; x++) {
+    if (list->jobs[x].status != 0) {
+      failed += 1;
+      fprintf(stderr, "FAILED - %s\n", list->jobs[x].inName);
+    }
+    bytes += list->jobs[x].srcBytes;
+  }
+  secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+  if (secs <= 0) {
+    secs = 1e-9;
+  }
+  printf("Assembled %d of %d programs on %d workers in %.3f s "
+	 "(%.1f programs/s, %.2f MB/s of source)\n",
+	 list->count - failed, list->count, started ? started : 1, secs,
+	 list->count / secs, bytes / secs / 1e6);
+
+  return (failed == 0) ? 0 : -1;
+}
+
+/* a program kept assembled between edits, for watch mode */
+struct WatchState {
+  struct SymTab *syms;
+  struct ASMSource src;
+  struct Image image;
+  char *text;			/* source it was assembled from */
+  size_t len;
+  int ok;			/* assembled without error */
+  struct DependList deps;	/* other files the last full build used */
+  uint64_t stamp;		/* of those files, see build_watch_stamp */
+};
+
+/* fold the time and size of every file in a list (zero for any
+ * missing) into one value, which changes when any of them does */
+static uint64_t build_watch_stamp(struct DependList *deps) {
+  struct stat info;
+  uint64_t hash = DEPEND_HASH_INIT;
+  unsigned int x;
+
+  for (x=0; x<deps->count; x++) {
+    if (stat(deps->files[x].name, &info) != 0) {
+      memset(&info, 0, sizeof(info));
+    }
+    hash = depend_hash(hash, &info.st_mtim, sizeof(info.st_mtim));
+    hash = depend_hash(hash, &info.st_size, sizeof(info.st_size));
+  }
+  return hash;
+}
+
+/* read a whole file into memory */
+static int build_slurp(char *inName, char **pText, size_t *pLen) {
+  FILE *handle;
+  char *text = NULL, *newtext;
+  size_t len = 0, size = 0, count;
+
+  if ((handle = fopen(inName, "r")) == NULL) {
+    return -1;
+  }
+  do {
+    if (len == size) {
+      size = (size == 0) ? 65536 : 2*size;
+      if ((newtext = REALLOC(text, size)) == NULL) {
+	fprintf(stderr, "ERROR - Memory allocation failed\n");
+	free(text);
+	fclose(handle);
+	return -1;
+      }
+      text = newtext;
+    }
+    count = fread(text + len, 1, size - len, handle);
+    len += count;
+  } while (count > 0);
+  fclose(handle);
+
+  *pText = text;
+  *pLen = len;
+  return 0;
+}
+
+/* where each line starts, with one more entry for the end */
+static size_t *build_split_lines(char *text, size_t len, unsigned int *count) {
+  size_t *starts, x;
+  unsigned int lines = 1;
+
+  for (x=0; x<len; x++) {
+    if ((text[x] == '\n') && (x + 1 < len)) {
+      lines += 1;
+    }
+  }
+  if ((starts = CALLOC(size_t, lines + 1)) == NULL) {
+    return NULL;
+  }
+  lines = 1;
+  for (x=0; x<len; x++) {
+    if ((text[x] == '\n') && (x + 1 < len)) {
+      starts[lines++] = x + 1;
+    }
+  }
+  starts[lines] = len;
+  *count = lines;
+  return starts;
+}
+
+/* assemble the whole of the new text from scratch, noting the
+ * files it uses to watch them too */
+static int build_watch_full(struct WatchState *st, char *inName,
+			    char *text, size_t len,
+			    struct BuildOpts *opts) {
+  struct DependList *oldDeps;
+  int ret = 0;
+
+  symtab_clear(&st->syms);
+  asmgen_free_source(&st->src);
+  image_free(&st->image);
+  IMAGE_INIT(&st->image);
+  depend_free(&st->deps);
+
+  st->src.keepLines = 1;
+  oldDeps = depend_attach(&st->deps);
+  if ((asmgen_parse_text(&st->syms, text, len, inName, &st->src) != 0) ||
+      (asmgen_assemble(&st->syms, &st->src, &st->image,
+		       opts->passWorkers) != 0)) {
+    ret = -1;
+  }
+  depend_attach(oldDeps);
+  st->stamp = build_watch_stamp(&st->deps);
+  return ret;
+}
+
+/* re-encode just the lines that differ from the text last assembled.
+ * returns how many there were, or -1 if it has to be done in full */
+static int build_watch_patch(struct WatchState *st, char *text, size_t len) {
+  const struct ASMLine *line;
+  size_t *oldStarts, *newStarts, oldLen, newLen;
+  unsigned int x, oldCount, newCount;
+  int patched = 0;
+
+  if (!st->ok || st->src.overlap) {
+    return -1;
+  }
+  oldStarts = build_split_lines(st->text, st->len, &oldCount);
+  newStarts = build_split_lines(text, len, &newCount);
+  if ((oldStarts == NULL) || (newStarts == NULL) || (oldCount != newCount)) {
+    patched = -1;
+  }
+
+  for (x=0; (patched >= 0) && (x<newCount); x++) {
+    oldLen = oldStarts[x+1] - oldStarts[x];
+    newLen = newStarts[x+1] - newStarts[x];
+    if ((oldLen == newLen) &&
+	(memcmp(&st->text[oldStarts[x]], &text[newStarts[x]], newLen) == 0)) {
+      continue;
+    }
+
+    /* only lines holding an instruction can be redone alone */
+    if (((line = asmgen_find_line(&st->src, x + 1)) == NULL) ||
+	(asmgen_reassemble_line(&st->syms, &st->src, line,
+				&st->text[oldStarts[x]], oldLen,
+				&text[newStarts[x]], newLen,
+				&st->image) != 0)) {
+      patched = -1;
+      break;
+    }
+    patched += 1;
+  }
+
+  free(oldStarts);
+  free(newStarts);
+  return patched;
+}
+
+/*
+ * build_watch
+ *    assemble a program, then keep it in memory and look for changes
+ * to the source, and to the files it uses (architecture, includes
+ * and .incbin data), every BUILD_WATCH_POLL ms. when only
+ * instructions in the source have been edited, and none has changed
+ * size, those lines alone are encoded again; anything else is
+ * reassembled in full. the output file is written again after each
+ * change. runs until killed.
+ *
+ * returns nonzero if watching could not start
+ */
+int build_watch(char *inName, char *outName, struct BuildOpts *opts) {
+  struct WatchState st;
+  struct stat info;
+  struct timespec pause, start, stop;
+  time_t lastSec = 0;
+  long lastNsec = 0;
+  off_t lastSize = -1;
+  char *text;
+  size_t len;
+  int patched, changed;
+
+  if (strcmp(inName, "-") == 0) {
+    fprintf(stderr, "FATAL - Cannot watch standard input\n");
+    return -1;
+  }
+  memset(&st, 0, sizeof(st));
+  IMAGE_INIT(&st.image);
+  pause.tv_sec = BUILD_WATCH_POLL / 1000;
+  pause.tv_nsec = (BUILD_WATCH_POLL % 1000) * 1000000L;
+  printf("Watching %s for changes\n", inName);
+
+  while (1) {
+    /* anything new? (the source may be missing while an editor
+     * saves, files it uses are checked all the same) */
+    changed = (st.deps.count > 0) &&
+      (build_watch_stamp(&st.deps) != st.stamp);
+    if ((stat(inName, &info) != 0) ||
+	((info.st_mtim.tv_sec == lastSec) &&
+	 (info.st_mtim.tv_nsec == lastNsec) && (info.st_size == lastSize))) {
+      if (!changed) {
+	nanosleep(&pause, NULL);
+	continue;
+      }
+    }
+    else {
+      lastSec = info.st_mtim.tv_sec;
+      lastNsec = info.st_mtim.tv_nsec;
+      lastSize = info.st_size;
+    }
+
+    if (build_slurp(inName, &text, &len) != 0) {
+      nanosleep(&pause, NULL);
+      continue;
+    }
+    if (!changed && (st.text != NULL) && (len == st.len) &&
+	(memcmp(text, st.text, len) == 0)) {
+      /* touched, but the same */
+      free(text);
+      continue;
+    }
+
+    /* an edit elsewhere can change any line */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    patched = changed ? -1 : build_watch_patch(&st, text, len);
+    if (patched < 0) {
+      st.ok = (build_watch_full(&st, inName, text, len, opts) == 0);
+    }
+    free(st.text);
+    st.text = text;
+    st.len = len;
+    if (!st.ok) {
+      fprintf(stderr, "FAILED - %s, waiting for it to change\n", inName);
+      continue;
+    }
+
+    if (build_output(&st.syms, &st.image, inName, outName, opts,
+		     NULL) != 0) {
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (patched >= 0) {
+      printf("Reassembled %d line(s) in place", patched);
+    }
+    else {
+      printf("Reassembled %s", inName);
+    }
+    printf(" in %.1f ms\n", (stop.tv_sec - start.tv_sec) * 1e3 +
+	   (stop.tv_nsec - start.tv_nsec) / 1e6);
+    fflush(stdout);
+  }
+
+  return 0;
+}
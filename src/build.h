@@ -0,0 +1,50 @@
+#ifndef BUILD_H
+#define BUILD_H
+
+#include "global.h"
+
+/* how to assemble, as picked from the command line */
+struct BuildOpts {
+  int onePass;			/* single pass, with fixups */
+  int object;			/* write an object file, to link later */
+  int noRanges;			/* no [start..end] ranges in MIF output */
+  char *formats;		/* output formats, NULL for .outfmt's */
+  int passWorkers;		/* threads for the second pass */
+  char *statsName;		/* where to write --stats, NULL for none */
+  char *cacheDir;		/* build cache, NULL for none */
+  int deps;			/* write a make .d file of what was used */
+};
+
+/* one program to assemble, for batch runs */
+struct BuildJob {
+  char *inName;			/* source, "-" for stdin */
+  char *outName;		/* output, NULL to guess from the source */
+  int status;			/* result, 0 on success */
+  long srcBytes;		/* size of the source */
+  struct Stats stats;		/* costs, if asked for */
+};
+
+/* list of jobs */
+struct BuildList {
+  struct BuildJob *jobs;
+  int count;
+  int size;
+};
+
+/* how often watch mode looks for changes, in milliseconds */
+#define BUILD_WATCH_POLL 200
+
+/* prototypes */
+
+int build_file(char *inName, char *outName, struct BuildOpts *opts,
+	       long *srcBytes, struct Stats *stats);
+int build_add_job(struct BuildList *list, char *inName, char *outName);
+int build_read_manifest(struct BuildList *list, char *manifest);
+int build_batch(struct BuildList *list, int workers, struct BuildOpts *opts);
+void build_free_list(struct BuildList *list);
+int build_write_stats(struct BuildList *list, char *statsName);
+int build_watch(char *inName, char *outName, struct BuildOpts *opts);
+int build_link(char **names, int count, char *outName,
+	       struct BuildOpts *opts);
+
+#endif
@@ -0,0 +1,364 @@
+/*
+ * cache.c
+ *
+ * Keeping outputs as they are when nothing has changed, so whatever
+ * runs on them next (synthesis, say) is not set off for nothing.
+ * Every output is written beside its target and only moved over it
+ * if the bytes differ.
+ *
+ * With --cache, builds are also looked up before being done. A
+ * manifest, named by a key made from the source, its name and the
+ * options, lists the architecture and include files the build used
+ * (and those it looked for and did not find) with hashes of their
+ * contents, and the outputs it wrote. Outputs are stored by the
+ * hash of their contents, so any build that produced the same bytes
+ * shares them. A build whose files all still hash the same has its
+ * outputs put back from the cache instead of being assembled. The
+ * cache directory is never pruned.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "diag.h"
+
+/* bytes compared or copied at a time */
+#define CACHE_CHUNK 16384
+
+/*
+ * cache_write_name
+ *    pick the name to write a new version of target under: a file
+ * beside it, unless target is something other than a regular file
+ * (a pipe, say), which is written directly. buf holds the name.
+ *
+ * returns the name, to hand to cache_finish_write when written
+ */
+char *cache_write_name(char *target, char *buf, size_t size) {
+  struct stat info;
+
+  if ((stat(target, &info) == 0) && !S_ISREG(info.st_mode)) {
+    return target;
+  }
+  snprintf(buf, size, "%s.%d.%lx", target, (int)getpid(),
+	   (unsigned long)pthread_self());
+  return buf;
+}
+
+/* check if two files hold the same bytes */
+static int cache_same_file(char *a, char *b) {
+  char bufA[CACHE_CHUNK], bufB[CACHE_CHUNK];
+  struct stat infoA, infoB;
+  ssize_t lenA, lenB;
+  int fdA, fdB, same = 0;
+
+  if ((fdA = open(a, O_RDONLY)) < 0) {
+    return 0;
+  }
+  if ((fdB = open(b, O_RDONLY)) < 0) {
+    close(fdA);
+    return 0;
+  }
+  if ((fstat(fdA, &infoA) == 0) && (fstat(fdB, &infoB) == 0) &&
+      (infoA.st_size == infoB.st_size)) {
+    do {
+      lenA = read(fdA, bufA, sizeof(bufA));
+      lenB = read(fdB, bufB, sizeof(bufB));
+      same = (lenA == lenB) && (lenA >= 0) &&
+	(memcmp(bufA, bufB, lenA) == 0);
+    } while (same && (lenA > 0));
+  }
+  close(fdA);
+  close(fdB);
+  return same;
+}
+
+/*
+ * cache_finish_write
+ *    once target has been written under the name from
+ * cache_write_name (ok if that worked), move it into place, unless
+ * target already holds the same bytes, which are left alone.
+ *
+ * returns 0 if target was written, 1 if it was left alone, -1 on
+ * failure
+ */
+int cache_finish_write(char *target, char *written, int ok) {
+  if (written == target) {
+    return ok ? 0 : -1;
+  }
+  if (!ok) {
+    unlink(written);
+    return -1;
+  }
+  if (cache_same_file(written, target)) {
+    unlink(written);
+    return 1;
+  }
+  if (rename(written, target) != 0) {
+    diag_printf(stderr, "ERROR - Could not replace output file %s: %s\n",
+		target, strerror(errno));
+    unlink(written);
+    return -1;
+  }
+  return 0;
+}
+
+/* copy a file, returning nonzero on failure */
+static int cache_copy(char *from, char *to) {
+  FILE *in, *out;
+  char *buf;
+  size_t len;
+  int ok = 1;
+
+  if ((buf = MALLOC_BYTES(CACHE_CHUNK)) == NULL) {
+    return -1;
+  }
+  if ((in = fopen(from, "rb")) == NULL) {
+    free(buf);
+    return -1;
+  }
+  if ((out = fopen(to, "wb")) == NULL) {
+    fclose(in);
+    free(buf);
+    return -1;
+  }
+  while (ok && ((len = fread(buf, 1, CACHE_CHUNK, in)) > 0)) {
+    ok = (fwrite(buf, 1, len, out) == len);
+  }
+  ok = ok && !ferror(in);
+  ok = (fclose(out) == 0) && ok;
+  fclose(in);
+  free(buf);
+  return ok ? 0 : -1;
+}
+
+/* copy a file to where other threads or processes may look for it,
+ * so it appears all at once */
+static int cache_copy_aside(char *from, char *to) {
+  char tmpname[CACHE_LINE + 32];
+
+  snprintf(tmpname, sizeof(tmpname), "%s.%d.%lx", to, (int)getpid(),
+	   (unsigned long)pthread_self());
+  if ((cache_copy(from, tmpname) != 0) || (rename(tmpname, to) != 0)) {
+    unlink(tmpname);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * cache_key
+ *    the key of a build, from the source's name and contents, the
+ * output name if one was given, and the options changing output.
+ *
+ * returns 0 on success, nonzero if the source cannot be read
+ */
+int cache_key(char *inName, char *outName, struct BuildOpts *opts,
+	      uint64_t *pKey) {
+  uint64_t key = DEPEND_HASH_INIT, srcHash;
+  char flags[2];
+
+  if (depend_hash_file(inName, &srcHash) != 0) {
+    return -1;
+  }
+  flags[0] = opts->noRanges;
+  flags[1] = opts->object;
+  key = depend_hash(key, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  key = depend_hash(key, inName, strlen(inName) + 1);
+  if (outName != NULL) {
+    key = depend_hash(key, outName, strlen(outName));
+  }
+  key = depend_hash(key, "", 1);
+  if (opts->formats != NULL) {
+    key = depend_hash(key, opts->formats, strlen(opts->formats));
+  }
+  key = depend_hash(key, "", 1);
+  key = depend_hash(key, flags, sizeof(flags));
+  *pKey = depend_hash(key, &srcHash, sizeof(srcHash));
+  return 0;
+}
+
+/* check a manifest against the files as they are now, gathering
+ * what it lists. returns 0 if it all still holds */
+static int cache_check(FILE *handle, char *dir, struct DependList *deps,
+		       struct DependList *outputs) {
+  char line[CACHE_LINE], blob[CACHE_LINE], *name, *end;
+  struct DependList *list;
+  uint64_t hash, now;
+  size_t len;
+
+  if ((fgets(line, sizeof(line), handle) == NULL) ||
+      (strncmp(line, CACHE_MAGIC "\n", sizeof(CACHE_MAGIC)) != 0)) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), handle) != NULL) {
+    len = strlen(line);
+    if ((len == 0) || (line[len-1] != '\n')) {
+      return -1;
+    }
+    line[len-1] = '\0';
+
+    if (strncmp(line, "missing ", 8) == 0) {
+      /* must still not be there */
+      if ((access(&line[8], F_OK) == 0) ||
+	  (depend_add(deps, &line[8], 1) != 0)) {
+	return -1;
+      }
+      continue;
+    }
+
+    /* "dep <hash> <name>" or "out <hash> <name>" */
+    if ((strncmp(line, "dep ", 4) != 0) && (strncmp(line, "out ", 4) != 0)) {
+      return -1;
+    }
+    hash = strtoull(&line[4], &end, 16);
+    if ((end == &line[4]) || (*end != ' ')) {
+      return -1;
+    }
+    name = end + 1;
+    if (line[0] == 'd') {
+      /* must still hold the same */
+      if ((depend_hash_file(name, &now) != 0) || (now != hash)) {
+	return -1;
+      }
+      list = deps;
+    }
+    else {
+      /* must still be in the cache */
+      snprintf(blob, sizeof(blob), "%s/%016llx", dir, (UINT64)hash);
+      if (access(blob, R_OK) != 0) {
+	return -1;
+      }
+      list = outputs;
+    }
+    if (depend_add(list, name, 0) != 0) {
+      return -1;
+    }
+    list->files[list->count - 1].hash = hash;
+  }
+  return (outputs->count > 0) ? 0 : -1;
+}
+
+/*
+ * cache_restore
+ *    look a build up by its key. if nothing it used has changed,
+ * put back any of its outputs which no longer hold what it wrote,
+ * leaving the others alone, and fill in what it used and wrote.
+ *
+ * returns 0 if restored, 1 if the build has to be done, -1 if
+ * putting back an output failed
+ */
+int cache_restore(char *dir, uint64_t key, struct DependList *deps,
+		  struct DependList *outputs) {
+  char manifest[CACHE_LINE], blob[CACHE_LINE], tmpname[CACHE_LINE + 32];
+  char *written;
+  struct DependFile *out;
+  FILE *handle;
+  uint64_t now;
+  unsigned int x;
+  int ret;
+
+  snprintf(manifest, sizeof(manifest), "%s/%016llx.m", dir, (UINT64)key);
+  if ((handle = fopen(manifest, "r")) == NULL) {
+    return 1;
+  }
+  ret = cache_check(handle, dir, deps, outputs);
+  fclose(handle);
+  if (ret != 0) {
+    DEBUG(1) printf("Cache miss on %s\n", manifest);
+    depend_free(deps);
+    depend_free(outputs);
+    return 1;
+  }
+
+  for (x=0; x<outputs->count; x++) {
+    out = &outputs->files[x];
+    if ((depend_hash_file(out->name, &now) == 0) && (now == out->hash)) {
+      printf("Output \'%s\' is up to date\n", out->name);
+      continue;
+    }
+    printf("Output name is \'%s\' (from cache)\n", out->name);
+    snprintf(blob, sizeof(blob), "%s/%016llx", dir, (UINT64)out->hash);
+    written = cache_write_name(out->name, tmpname, sizeof(tmpname));
+    if (cache_finish_write(out->name, written,
+			   cache_copy(blob, written) == 0) < 0) {
+      diag_printf(stderr, "ERROR - Could not restore %s from cache\n",
+		  out->name);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * cache_save
+ *    store a finished build's outputs under their hashes, and a
+ * manifest of what it used and wrote under its key. failing to is
+ * not an error, the build is just done again next time.
+ *
+ * returns 0 if saved, nonzero if not
+ */
+int cache_save(char *dir, uint64_t key, struct DependList *deps,
+	       struct DependList *outputs) {
+  char manifest[CACHE_LINE], tmpname[CACHE_LINE + 32], blob[CACHE_LINE];
+  struct DependFile *file;
+  FILE *handle;
+  unsigned int x;
+  int ok;
+
+  if ((mkdir(dir, 0777) != 0) && (errno != EEXIST)) {
+    DEBUG(1) printf("Cannot make cache directory %s\n", dir);
+    return -1;
+  }
+
+  /* anything unreadable can't be checked next time */
+  for (x=0; x<deps->count; x++) {
+    file = &deps->files[x];
+    if (!file->missing && (depend_hash_file(file->name, &file->hash) != 0)) {
+      return -1;
+    }
+  }
+  for (x=0; x<outputs->count; x++) {
+    file = &outputs->files[x];
+    if (depend_hash_file(file->name, &file->hash) != 0) {
+      return -1;
+    }
+    snprintf(blob, sizeof(blob), "%s/%016llx", dir, (UINT64)file->hash);
+    if ((access(blob, F_OK) != 0) && (cache_copy_aside(file->name, blob) != 0)) {
+      return -1;
+    }
+  }
+
+  snprintf(manifest, sizeof(manifest), "%s/%016llx.m", dir, (UINT64)key);
+  snprintf(tmpname, sizeof(tmpname), "%s.%d.%lx", manifest, (int)getpid(),
+	   (unsigned long)pthread_self());
+  if ((handle = fopen(tmpname, "w")) == NULL) {
+    return -1;
+  }
+  fprintf(handle, "%s\n", CACHE_MAGIC);
+  for (x=0; x<deps->count; x++) {
+    file = &deps->files[x];
+    if (file->missing) {
+      fprintf(handle, "missing %s\n", file->name);
+    }
+    else {
+      fprintf(handle, "dep %016llx %s\n", (UINT64)file->hash, file->name);
+    }
+  }
+  for (x=0; x<outputs->count; x++) {
+    fprintf(handle, "out %016llx %s\n", (UINT64)outputs->files[x].hash,
+	    outputs->files[x].name);
+  }
+  ok = !ferror(handle);
+  ok = (fclose(handle) == 0) && ok;
+  if (!ok || (rename(tmpname, manifest) != 0)) {
+    unlink(tmpname);
+    return -1;
+  }
+  return 0;
+}
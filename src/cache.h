@@ -0,0 +1,26 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "global.h"
+#include "depend.h"
+#include "build.h"
+
+/* first line of a manifest, changed whenever what goes into a key
+ * or the outputs for it would */
+#define CACHE_MAGIC "caspr-cache 1"
+
+/* longest line in a manifest */
+#define CACHE_LINE 4200
+
+/* prototypes */
+
+char *cache_write_name(char *target, char *buf, size_t size);
+int cache_finish_write(char *target, char *written, int ok);
+int cache_key(char *inName, char *outName, struct BuildOpts *opts,
+	      uint64_t *pKey);
+int cache_restore(char *dir, uint64_t key, struct DependList *deps,
+		  struct DependList *outputs);
+int cache_save(char *dir, uint64_t key, struct DependList *deps,
+	       struct DependList *outputs);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * caspr.c
+ *
+ * The embedding interface, see caspr.h. A context holds everything
+ * one program needs, its own interned names (see intern.c), loaded
+ * architectures (asmrec_load) and included files (include.c) too,
+ * so contexts share nothing. Those three are attached to the thread
+ * for as long as it works for the context, and emptied along with
+ * everything else before each assembly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "asm.h"
+#include "caspr.h"
+
+struct Caspr {
+  struct SymTab *syms;		/* labels and defines */
+  struct ASMSource src;		/* first pass results */
+  struct Image image;		/* assembled program */
+  struct DiagBuf diag;		/* messages from the last assembly */
+  unsigned char *flat;		/* image flattened, for caspr_image */
+  size_t flatLen;
+  int flatValid;
+  struct InternTable names;	/* text of every name, ids into here */
+  struct ArchRegistry archs;	/* architectures loaded */
+  struct IncludeCache includes;	/* files included */
+};
+
+/* what a thread was using before working for a context */
+struct CasprSaved {
+  struct InternTable *names;
+  struct ArchRegistry *archs;
+  struct IncludeCache *includes;
+};
+
+/* have this thread use the context's tables, until caspr_leave */
+static void caspr_enter(struct Caspr *ctx, struct CasprSaved *saved) {
+  saved->names = intern_attach(&ctx->names);
+  saved->archs = asmrec_attach(&ctx->archs);
+  saved->includes = include_attach(&ctx->includes);
+}
+
+static void caspr_leave(struct CasprSaved *saved) {
+  intern_attach(saved->names);
+  asmrec_attach(saved->archs);
+  include_attach(saved->includes);
+}
+
+struct Caspr *caspr_new(void) {
+  struct Caspr *ctx;
+
+  if ((ctx = CALLOC(struct Caspr, 1)) == NULL) {
+    return NULL;
+  }
+  IMAGE_INIT(&ctx->image);
+  intern_init(&ctx->names);
+  asmrec_registry_init(&ctx->archs);
+  include_cache_init(&ctx->includes);
+  return ctx;
+}
+
+/* drop the results of the last assembly, and the names, files and
+ * architectures it used, so a context only ever holds one program */
+static void caspr_reset(struct Caspr *ctx) {
+  struct CasprSaved saved;
+
+  symtab_clear(&ctx->syms);
+  asmgen_free_source(&ctx->src);
+  image_free(&ctx->image);
+  IMAGE_INIT(&ctx->image);
+  diag_clear(&ctx->diag);
+  ctx->flatValid = 0;
+
+  caspr_enter(ctx, &saved);
+  asmrec_unload_all();
+  include_flush();
+  intern_flush();
+  caspr_leave(&saved);
+}
+
+void caspr_free(struct Caspr *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+  caspr_reset(ctx);
+  asmrec_registry_free(&ctx->archs);
+  include_cache_free(&ctx->includes);
+  intern_free(&ctx->names);
+  free(ctx->diag.text);
+  free(ctx->flat);
+  free(ctx);
+}
+
+int caspr_assemble(struct Caspr *ctx, const char *src, size_t len) {
+  struct CasprSaved saved;
+  struct DiagBuf *old;
+  int ret;
+
+  caspr_reset(ctx);
+  caspr_enter(ctx, &saved);
+
+  /* keep anything said along the way */
+  old = diag_capture(&ctx->diag);
+  ret = asmgen_parse_text(&ctx->syms, src, len, NULL, &ctx->src);
+  if (ret == 0) {
+    ret = asmgen_assemble(&ctx->syms, &ctx->src, &ctx->image, 1);
+  }
+  diag_capture(old);
+
+  /* no need for the tokens any more */
+  asmgen_free_source(&ctx->src);
+  caspr_leave(&saved);
+  return (ret == 0) ? 0 : -1;
+}
+
+const unsigned char *caspr_image(struct Caspr *ctx, size_t *len) {
+  unsigned char *newflat;
+
+  if (!ctx->flatValid) {
+    if (ctx->image.end > ctx->flatLen) {
+      if ((newflat = REALLOC(ctx->flat, ctx->image.end)) == NULL) {
+	return NULL;
+      }
+      ctx->flat = newflat;
+    }
+    ctx->flatLen = ctx->image.end;
+    image_read(&ctx->image, 0, (char*)ctx->flat, ctx->flatLen);
+    ctx->flatValid = 1;
+  }
+
+  *len = ctx->flatLen;
+  return ctx->flat;
+}
+
+size_t caspr_read(struct Caspr *ctx, uint64_t offset, void *buf, size_t len) {
+  image_read(&ctx->image, offset, buf, len);
+  return len;
+}
+
+int caspr_symbol(struct Caspr *ctx, const char *name, int *value) {
+  struct CasprSaved saved;
+  int ret;
+
+  caspr_enter(ctx, &saved);
+  ret = symtab_lookup(&ctx->syms, (char*)name, NULL, value);
+  caspr_leave(&saved);
+  return (ret == 0) ? 0 : -1;
+}
+
+const char *caspr_next_symbol(struct Caspr *ctx, unsigned int *iter,
+			      int *value) {
+  const struct SymEntry *entry;
+
+  if ((entry = symtab_next(&ctx->syms, iter)) == NULL) {
+    return NULL;
+  }
+  if (value != NULL) {
+    *value = entry->intVal;
+  }
+  return entry->name;
+}
+
+const char *caspr_error(struct Caspr *ctx) {
+  return (ctx->diag.text != NULL) ? ctx->diag.text : "";
+}
@@ -0,0 +1,55 @@
+#ifndef CASPR_H
+#define CASPR_H
+
+/*
+ * caspr.h
+ *
+ * Interface for programs embedding the assembler (libcaspr.a).
+ * Source is assembled from memory into memory, and messages are
+ * kept with the context instead of being printed. Files are still
+ * touched, though: .arch reads an architecture file and writes a
+ * compiled copy beside it (<name>.cfgc), and .include and .incbin
+ * read whatever files they name.
+ *
+ * Contexts share nothing, not even loaded architectures, included
+ * files or the text of names, so different contexts may be used
+ * from different threads at once, and all a context holds goes
+ * with caspr_free. Nothing is kept from one caspr_assemble to the
+ * next either, so a context reused for ever new sources does not
+ * grow. A single context must only be used by one thread at a time.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Caspr;
+
+/* set up and release an assembler context */
+struct Caspr *caspr_new(void);
+void caspr_free(struct Caspr *ctx);
+
+/* assemble len bytes of source, replacing anything assembled before.
+ * returns 0 on success, nonzero on failure (see caspr_error) */
+int caspr_assemble(struct Caspr *ctx, const char *src, size_t len);
+
+/* the assembled program, from address 0 on with zeros in any gaps.
+ * good until the next caspr_assemble or caspr_free */
+const unsigned char *caspr_image(struct Caspr *ctx, size_t *len);
+
+/* copy len bytes at offset out of the program, zero where nothing
+ * was assembled. returns the bytes copied */
+size_t caspr_read(struct Caspr *ctx, uint64_t offset, void *buf, size_t len);
+
+/* value of a label or define, returns 0 if found */
+int caspr_symbol(struct Caspr *ctx, const char *name, int *value);
+
+/* walk every symbol, in no particular order. start with *iter set
+ * to 0, returns the name or NULL once all have been seen. names
+ * starting with '$' are settings such as $mifwords */
+const char *caspr_next_symbol(struct Caspr *ctx, unsigned int *iter,
+			      int *value);
+
+/* errors and warnings from the last caspr_assemble, "" if none */
+const char *caspr_error(struct Caspr *ctx);
+
+#endif
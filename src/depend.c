@@ -0,0 +1,125 @@
+/*
+ * depend.c
+ *
+ * What a build depends on. Each thread notes the files it opens
+ * into the DependList it has attached, if any, as it does with
+ * stats, so programs of a batch are kept apart. Architectures are
+ * loaded and includes tokenized once per process, so both note
+ * their files each time a program asks for them, not only when
+ * they are read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "depend.h"
+#include "diag.h"
+
+static __thread struct DependList *depend_cur = NULL;
+
+/* note files into list from now on (NULL to stop), returning what
+ * this thread was noting into before */
+struct DependList *depend_attach(struct DependList *list) {
+  struct DependList *old = depend_cur;
+
+  depend_cur = list;
+  return old;
+}
+
+/* add a file to a list, unless it is there already */
+int depend_add(struct DependList *list, const char *name, int missing) {
+  struct DependFile *newfiles, *file;
+  unsigned int x, newsize;
+
+  for (x=0; x<list->count; x++) {
+    if (strcmp(list->files[x].name, name) == 0) {
+      return 0;
+    }
+  }
+
+  if (list->count == list->size) {
+    newsize = (list->size == 0) ? 16 : 2*list->size;
+    newfiles = REALLOC(list->files, newsize*sizeof(struct DependFile));
+    if (newfiles == NULL) {
+      diag_printf(stderr, "ERROR - Memory allocation failed\n");
+      return -1;
+    }
+    list->files = newfiles;
+    list->size = newsize;
+  }
+  file = &list->files[list->count];
+  if ((file->name = STRDUP(name)) == NULL) {
+    diag_printf(stderr, "ERROR - Memory allocation failed\n");
+    return -1;
+  }
+  file->missing = missing;
+  file->hash = 0;
+  list->count += 1;
+  return 0;
+}
+
+/* note a file this thread's build used, or looked for and did not
+ * find, if anything is attached */
+int depend_note(const char *name, int missing) {
+  if (depend_cur == NULL) {
+    return 0;
+  }
+  return depend_add(depend_cur, name, missing);
+}
+
+void depend_free(struct DependList *list) {
+  unsigned int x;
+
+  for (x=0; x<list->count; x++) {
+    free(list->files[x].name);
+  }
+  free(list->files);
+  memset(list, 0, sizeof(struct DependList));
+}
+
+/* carry a hash on over len more bytes */
+uint64_t depend_hash(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *p = data;
+
+  while (len-- > 0) {
+    hash ^= *p++;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+/*
+ * depend_hash_file
+ *    hash the whole contents of a file.
+ *
+ * returns 0 on success, nonzero if it cannot be read
+ */
+int depend_hash_file(const char *name, uint64_t *pHash) {
+  struct stat info;
+  void *map;
+  int fd;
+
+  if ((fd = open(name, O_RDONLY)) < 0) {
+    return -1;
+  }
+  if ((fstat(fd, &info) != 0) || !S_ISREG(info.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  *pHash = DEPEND_HASH_INIT;
+  if (info.st_size > 0) {
+    map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    *pHash = depend_hash(*pHash, map, info.st_size);
+    munmap(map, info.st_size);
+  }
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef DEPEND_H
+#define DEPEND_H
+
+#include "global.h"
+
+/* one file a build used */
+struct DependFile {
+  char *name;
+  int missing;			/* looked for but not there */
+  uint64_t hash;		/* of its contents, once known */
+};
+
+/* files a build opened (architectures and includes), or wrote */
+struct DependList {
+  struct DependFile *files;
+  unsigned int count;
+  unsigned int size;
+};
+
+/* 64 bit FNV-1a, started from DEPEND_HASH_INIT */
+#define DEPEND_HASH_INIT 14695981039346656037ull
+
+/* prototypes */
+
+struct DependList *depend_attach(struct DependList *list);
+int depend_note(const char *name, int missing);
+int depend_add(struct DependList *list, const char *name, int missing);
+void depend_free(struct DependList *list);
+uint64_t depend_hash(uint64_t hash, const void *data, size_t len);
+int depend_hash_file(const char *name, uint64_t *pHash);
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * diag.c
+ *
+ * Error and warning messages. They normally go straight to the
+ * stream given, but a thread can instead collect them into a
+ * buffer, so a program embedding the assembler gets them back
+ * rather than finding them on its terminal.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "global.h"
+#include "diag.h"
+
+/* where this thread's messages are going, NULL for the streams */
+static __thread struct DiagBuf *diag_sink = NULL;
+
+/* print a message, or add it to this thread's buffer */
+void diag_printf(FILE *stream, const char *fmt, ...) {
+  va_list args;
+  char *newtext;
+  size_t newsize;
+  int need;
+
+  va_start(args, fmt);
+  if (diag_sink == NULL) {
+    vfprintf(stream, fmt, args);
+    va_end(args);
+    return;
+  }
+
+  need = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  if (need < 0) {
+    return;
+  }
+  if (diag_sink->len + need + 1 > diag_sink->size) {
+    for (newsize = (diag_sink->size == 0) ? 256 : diag_sink->size;
+	 newsize < diag_sink->len + need + 1; newsize *= 2) { }
+    if ((newtext = REALLOC(diag_sink->text, newsize)) == NULL) {
+      /* drop it, there is nowhere to put it */
+      return;
+    }
+    diag_sink->text = newtext;
+    diag_sink->size = newsize;
+  }
+
+  va_start(args, fmt);
+  vsnprintf(&diag_sink->text[diag_sink->len], need + 1, fmt, args);
+  va_end(args);
+  diag_sink->len += need;
+}
+
+/* send this thread's messages to buf from now on (NULL to print
+ * them again), returning where they were going before */
+struct DiagBuf *diag_capture(struct DiagBuf *buf) {
+  struct DiagBuf *old = diag_sink;
+
+  diag_sink = buf;
+  return old;
+}
+
+/* empty a buffer, keeping its space */
+void diag_clear(struct DiagBuf *buf) {
+  buf->len = 0;
+  if (buf->text != NULL) {
+    buf->text[0] = '\0';
+  }
+}
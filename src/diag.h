@@ -0,0 +1,21 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* growing buffer of collected messages */
+struct DiagBuf {
+  char *text;			/* NUL terminated, NULL if nothing yet */
+  size_t len;
+  size_t size;
+};
+
+/* prototypes */
+
+void diag_printf(FILE *stream, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+struct DiagBuf *diag_capture(struct DiagBuf *buf);
+void diag_clear(struct DiagBuf *buf);
+
+#endif
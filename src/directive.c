@@ -7,87 +7,100 @@
 int directive_parse(struct ScanData *scanInfo,
 		    struct Token *dirToken,
 		    struct SymTab **curSyms,
-		    struct ASMRecord **asmrec,
+		    const struct ASMArch **asmrec,
 		    unsigned int *offset) {
   char tokName[MAX_TOKLEN];
-  struct Token newToken;
+  struct Token newToken, tokEnd;
+  uint32_t name;
+  TokenType ttype;
   unsigned int value;
   
   /* architecture selection directive */
-  if ((strcmp(dirToken->token, ".arch") == 0)) {
+  if ((strcmp(TOKSTR(dirToken), ".arch") == 0)) {
     /* next token should be an identifier to our architecture file */
     if (get_token(&newToken, scanInfo) != TOK_IDENT) {
-      fprintf(stderr, "ERROR - Unexpected Token %s, line %d\n",
-	      newToken.token, newToken.linenum);
+      diag_printf(stderr, "ERROR - Unexpected Token %s, %s:%d\n",
+		  TOKSTR(&newToken), TOKPOS(&newToken));
       return -1;
     }
     
     /* check that we have a valid pointer to write to */
     if (asmrec != NULL) {
-      if (*asmrec != NULL) {
-	asmrec_free(*asmrec);
-      }
-      DEBUG(1) printf("Loading architecture %s\n", newToken.token);
-      *asmrec = asmrec_load(curSyms, newToken.token);
+      DEBUG(1) printf("Loading architecture %s\n", TOKSTR(&newToken));
+      *asmrec = asmrec_load(curSyms, TOKSTR(&newToken));
       if (*asmrec == NULL) {
-	printf("Could not load architecture file for %s\n", newToken.token);
+	diag_printf(stdout, "Could not load architecture file for %s, %s:%d\n",
+		    TOKSTR(&newToken), TOKPOS(&newToken));
       }
     }
   }
   
   /* define directive */
-  else if ((strcmp(dirToken->token, ".define") == 0)) {
+  else if ((strcmp(TOKSTR(dirToken), ".define") == 0)) {
     /* next token should be an string to define */
     if (get_token(&newToken, scanInfo) != TOK_IDENT) {
-      fprintf(stderr, "ERROR - Unexpected Token %s, line %d\n",
-	      newToken.token, newToken.linenum);
+      diag_printf(stderr, "ERROR - Unexpected Token %s, %s:%d\n",
+		  TOKSTR(&newToken), TOKPOS(&newToken));
       return -1;
     }
-    strcpy(tokName, newToken.token);
+    name = newToken.str;
     
     /* check that we have a valid pointer to write to */
     if (curSyms != NULL) {
       /* next token(s) should be a numeric value/expression to set */
       if (1) {
 	if (asmgen_parse_value(scanInfo, curSyms, &value) != 0) {
-	  fprintf(stderr, "ERROR - Invalid Define, line %d\n",
-		  newToken.linenum);
+	  diag_printf(stderr, "ERROR - Invalid Define, %s:%d\n",
+		      TOKPOS(&newToken));
 	  return -1;
 	}
-	symtab_record(curSyms, tokName, NULL, value);
+	symtab_record_id(curSyms, name, NULL, value);
       }
       else {
 	if (get_token(&newToken, scanInfo) != TOK_INT) {
-	  fprintf(stderr, "ERROR - Unexpected Token %s, line %d\n",
-		  newToken.token, newToken.linenum);
+	  diag_printf(stderr, "ERROR - Unexpected Token %s, %s:%d\n",
+		      TOKSTR(&newToken), TOKPOS(&newToken));
 	  return -1;
 	}
-	symtab_record(curSyms, tokName, NULL, newToken.value);
+	symtab_record_id(curSyms, name, NULL, newToken.value);
       }
     }
   }
   
   /* output specifier define */
-  else if ((strcmp(dirToken->token, ".outfmt") == 0)) {
-    /* next token should be an string specifying output */
-    if (get_token(&newToken, scanInfo) != TOK_IDENT) {
-      fprintf(stderr, "ERROR - Unexpected Token %s, line %d\n",
-	      newToken.token, newToken.linenum);
-      return -1;
-    }
+  else if ((strcmp(TOKSTR(dirToken), ".outfmt") == 0)) {
+    /* next token(s) should be strings specifying outputs, all of
+     * which are written */
+    tokName[0] = '\0';
+    do {
+      if (get_token(&newToken, scanInfo) != TOK_IDENT) {
+	diag_printf(stderr, "ERROR - Unexpected Token %s, %s:%d\n",
+		    TOKSTR(&newToken), TOKPOS(&newToken));
+	return -1;
+      }
+      if (strlen(tokName) + strlen(TOKSTR(&newToken)) + 2 > MAX_TOKLEN) {
+	diag_printf(stderr, "ERROR - Too many output formats, %s:%d\n",
+		    TOKPOS(&newToken));
+	return -1;
+      }
+      if (tokName[0] != '\0') {
+	strcat(tokName, " ");
+      }
+      strcat(tokName, TOKSTR(&newToken));
+    } while (peek_token(scanInfo) == TOK_IDENT);
     
     /* check that we have a valid pointer to write to */
     if (curSyms != NULL) {
-      symtab_record(curSyms, "$outfmt", newToken.token, -1);
+      symtab_record(curSyms, "$outfmt", tokName, -1);
     }
   }
   
   /* output position define */
-  else if ((strcmp(dirToken->token, ".org") == 0)) {
+  else if ((strcmp(TOKSTR(dirToken), ".org") == 0)) {
     /* next token should be an string specifying output */
     if (get_token(&newToken, scanInfo) != TOK_INT) {
-      fprintf(stderr, "ERROR - Unexpected Token %s, line %d\n",
-	      newToken.token, newToken.linenum);
+      diag_printf(stderr, "ERROR - Unexpected Token %s, %s:%d\n",
+		  TOKSTR(&newToken), TOKPOS(&newToken));
       return -1;
     }
     
@@ -97,12 +110,32 @@ int directive_parse(struct ScanData *scanInfo,
     }
   }
   
+  /* include another file */
+  else if ((strcmp(TOKSTR(dirToken), ".include") == 0)) {
+    /* next token should be a string naming the file */
+    if (get_token(&newToken, scanInfo) != TOK_STRING) {
+      diag_printf(stderr, "ERROR - Unexpected Token %s, %s:%d\n",
+		  TOKSTR(&newToken), TOKPOS(&newToken));
+      return -1;
+    }
+    
+    /* its tokens come after this line. replaying a recorded pass
+     * (no symbols to write to) they are already there */
+    do {
+      ttype = get_token(&tokEnd, scanInfo);
+    } while ((ttype != TOK_ENDL) && (ttype != TOK_EOF));
+    if (curSyms != NULL) {
+      return include_push(scanInfo, &newToken);
+    }
+    return 0;
+  }
+  
   /* output specifier define */
-  else if ((strcmp(dirToken->token, ".mifwords") == 0)) {
+  else if ((strcmp(TOKSTR(dirToken), ".mifwords") == 0)) {
     /* next token should be an integer specifying size */
     if (get_token(&newToken, scanInfo) != TOK_INT) {
-      fprintf(stderr, "ERROR - Unexpected Token %s, line %d\n",
-	      newToken.token, newToken.linenum);
+      diag_printf(stderr, "ERROR - Unexpected Token %s, %s:%d\n",
+		  TOKSTR(&newToken), TOKPOS(&newToken));
       return -1;
     }
     
@@ -113,11 +146,11 @@ int directive_parse(struct ScanData *scanInfo,
   }
   
   /* output specifier define */
-  else if ((strcmp(dirToken->token, ".mifwidth") == 0)) {
+  else if ((strcmp(TOKSTR(dirToken), ".mifwidth") == 0)) {
     /* next token should be an integer specifying size */
     if (get_token(&newToken, scanInfo) != TOK_INT) {
-      fprintf(stderr, "ERROR - Unexpected Token %s, line %d\n",
-	      newToken.token, newToken.linenum);
+      diag_printf(stderr, "ERROR - Unexpected Token %s, %s:%d\n",
+		  TOKSTR(&newToken), TOKPOS(&newToken));
       return -1;
     }
     
@@ -127,14 +160,31 @@ int directive_parse(struct ScanData *scanInfo,
     }
   }
   
+  /* mif run length output, on unless set to 0 */
+  else if ((strcmp(TOKSTR(dirToken), ".mifranges") == 0)) {
+    /* next token should be an integer, zero to turn ranges off */
+    if (get_token(&newToken, scanInfo) != TOK_INT) {
+      diag_printf(stderr, "ERROR - Unexpected Token %s, %s:%d\n",
+		  TOKSTR(&newToken), TOKPOS(&newToken));
+      return -1;
+    }
+    
+    /* check that we have a valid pointer to write to */
+    if (curSyms != NULL) {
+      symtab_record(curSyms, "$mifranges", NULL, newToken.value);
+    }
+  }
+  
   /* unknown directive */
   else {
-    printf("ERROR - Unknown directive %s\n", dirToken->token);
+    diag_printf(stdout, "ERROR - Unknown directive %s, %s:%d\n",
+		TOKSTR(dirToken), TOKPOS(dirToken));
   }
   
-  /* chew tokens until end of line */
-  while (get_token(&newToken, scanInfo) != TOK_ENDL) {
-    DEBUG(3) printf("-> ignoring token %s\n", newToken.token);
+  /* chew tokens until end of line, or of the source */
+  while (((ttype = get_token(&newToken, scanInfo)) != TOK_ENDL) &&
+	 (ttype != TOK_EOF)) {
+    DEBUG(3) printf("-> ignoring token %s\n", TOKSTR(&newToken));
   }
   
   return 0;
@@ -10,7 +10,7 @@
 int directive_parse(struct ScanData *scanInfo,
 		    struct Token *dirToken,
 		    struct SymTab **curSyms,
-		    struct ASMRecord **asmrec,
+		    const struct ASMArch **asmrec,
 		    unsigned int *offset);
 
 #endif
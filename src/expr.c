@@ -0,0 +1,315 @@
+/*
+ * expr.c
+ *
+ * Operand expressions. An operand is a number, a symbol, either of
+ * those behind a unary '-' or '~', or a parenthesized expression
+ * of them joined by binary operators with C precedence. Operands
+ * are compiled to postfix ops as they are read, folding anything
+ * made only of numbers, so evaluating one later (a forward
+ * reference, say) needs no tokens and does little besides look up
+ * its symbols. Arithmetic is unsigned 32 bit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "expr.h"
+#include "diag.h"
+
+/* binary operators, tightest binding first */
+static const struct {
+  const char *token;
+  ExprOpcode code;
+  int prec;
+} expr_binary[] = {
+  { "*", EXPR_MUL, 6 },
+  { "/", EXPR_DIV, 6 },
+  { "%", EXPR_MOD, 6 },
+  { "+", EXPR_ADD, 5 },
+  { "-", EXPR_SUB, 5 },
+  { "<<", EXPR_SHL, 4 },
+  { ">>", EXPR_SHR, 4 },
+  { "&", EXPR_AND, 3 },
+  { "^", EXPR_XOR, 2 },
+  { "|", EXPR_OR, 1 },
+  { NULL, EXPR_CONST, 0 }
+};
+
+/* find a binary operator, returns its precedence or 0 if not one */
+static int expr_find_binary(struct Token *tok, ExprOpcode *pCode) {
+  int x;
+
+  if (tok->type != TOK_ARITHOP) {
+    return 0;
+  }
+  for (x=0; expr_binary[x].token != NULL; x++) {
+    if (strcmp(expr_binary[x].token, TOKSTR(tok)) == 0) {
+      *pCode = expr_binary[x].code;
+      return expr_binary[x].prec;
+    }
+  }
+  return 0;
+}
+
+/* value of a number or symbol, cut down to its bit limit if any */
+static uint32_t expr_limit(uint32_t value, int limLow, int limHigh) {
+  if (limHigh - limLow < 8*sizeof(value) - 1) {
+    value = GETBITS(limLow, limHigh, value);
+  }
+  return value;
+}
+
+/* do one operator, b unused for unary ones */
+static int expr_apply(int code, uint32_t a, uint32_t b, uint32_t *pResult) {
+  switch (code) {
+  case EXPR_NEG: *pResult = -a; break;
+  case EXPR_NOT: *pResult = ~a; break;
+  case EXPR_MUL: *pResult = a * b; break;
+  case EXPR_ADD: *pResult = a + b; break;
+  case EXPR_SUB: *pResult = a - b; break;
+  case EXPR_SHL: *pResult = (b < 32) ? a << b : 0; break;
+  case EXPR_SHR: *pResult = (b < 32) ? a >> b : 0; break;
+  case EXPR_AND: *pResult = a & b; break;
+  case EXPR_XOR: *pResult = a ^ b; break;
+  case EXPR_OR: *pResult = a | b; break;
+  case EXPR_DIV:
+  case EXPR_MOD:
+    if (b == 0) {
+      diag_printf(stdout, "ERROR - Division by zero\n");
+      return -1;
+    }
+    *pResult = (code == EXPR_DIV) ? a / b : a % b;
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+/* append one op */
+static int expr_emit(struct ExprCode *code, int opcode, uint32_t value,
+		     int limLow, int limHigh) {
+  struct ExprOp *newops, *op;
+  unsigned int newsize;
+
+  if (code->count == code->size) {
+    newsize = (code->size == 0) ? 64 : 2*code->size;
+    if ((newops = REALLOC(code->ops, newsize*sizeof(struct ExprOp))) == NULL) {
+      diag_printf(stderr, "ERROR - Memory allocation failed\n");
+      return -1;
+    }
+    code->ops = newops;
+    code->size = newsize;
+  }
+  op = &code->ops[code->count++];
+  op->code = opcode;
+  op->limLow = limLow;
+  op->limHigh = limHigh;
+  op->value = value;
+  return 0;
+}
+
+/* append an operator, folding it right away if its operands are
+ * numbers. an operand that is a number is always a single op, so
+ * the ops just before are exactly the operands if they are numbers */
+static int expr_emit_op(struct ExprCode *code, unsigned int start,
+			int opcode) {
+  struct ExprOp *ops = code->ops;
+  unsigned int n = code->count;
+  uint32_t value;
+
+  if ((opcode == EXPR_NEG) || (opcode == EXPR_NOT)) {
+    if ((n > start) && (ops[n-1].code == EXPR_CONST)) {
+      return expr_apply(opcode, ops[n-1].value, 0, &ops[n-1].value);
+    }
+  }
+  else if ((n >= start + 2) && (ops[n-1].code == EXPR_CONST) &&
+	   (ops[n-2].code == EXPR_CONST)) {
+    if (expr_apply(opcode, ops[n-2].value, ops[n-1].value, &value) != 0) {
+      return -1;
+    }
+    ops[n-2].value = value;
+    code->count -= 1;
+    return 0;
+  }
+  return expr_emit(code, opcode, 0, 0, 31);
+}
+
+static int expr_parse_binary(struct ScanData *scanner, struct ExprCode *code,
+			     unsigned int start, int minPrec,
+			     struct Token *next);
+
+/* a number, symbol, unary operator or parenthesized expression */
+static int expr_parse_operand(struct ScanData *scanner, struct ExprCode *code,
+			      unsigned int start) {
+  struct Token curToken;
+  int opcode;
+
+  switch (get_token(&curToken, scanner)) {
+
+  case TOK_INT:
+    /* integer value, folded with its bit limit */
+    DEBUG(1) printf("Got an integer - %d\n", curToken.value);
+    return expr_emit(code, EXPR_CONST,
+		     expr_limit(curToken.value, curToken.limLow,
+				curToken.limHigh), 0, 31);
+
+  case TOK_IDENT:
+    /* identifier, looked up when evaluated */
+    DEBUG(1) printf("Got a symbol lookup - '%s'\n", TOKSTR(&curToken));
+    return expr_emit(code, EXPR_SYMBOL, curToken.str, curToken.limLow,
+		     curToken.limHigh);
+
+  case TOK_ARITHOP:
+    /* unary operator, applies to the operand after it */
+    if (strcmp(TOKSTR(&curToken), "+") == 0) {
+      return expr_parse_operand(scanner, code, start);
+    }
+    opcode = (strcmp(TOKSTR(&curToken), "-") == 0) ? EXPR_NEG :
+      (strcmp(TOKSTR(&curToken), "~") == 0) ? EXPR_NOT : -1;
+    if ((opcode == -1) || (expr_parse_operand(scanner, code, start) != 0)) {
+      diag_printf(stdout, "ERROR - Cannot Parse Arithmetic Expression\n");
+      return -1;
+    }
+    return expr_emit_op(code, start, opcode);
+
+  case TOK_LPAREN:
+    /* left parentheses, beginning of an arithmetic expression */
+    if (expr_parse_binary(scanner, code, start, 1, &curToken) != 0) {
+      diag_printf(stdout, "ERROR - Cannot Parse Arithmetic Expression\n");
+      return -1;
+    }
+    if (curToken.type != TOK_RPAREN) {
+      diag_printf(stdout, "ERROR - Unexpected token '%s' while parsing "
+		  "subexpression\n", TOKSTR(&curToken));
+      return -1;
+    }
+    return 0;
+
+  default:
+    /* unknown token */
+    diag_printf(stdout, "Unhandled token \'%s\'\n", TOKSTR(&curToken));
+    return -1;
+  }
+}
+
+/* operands joined by operators binding at least as tight as minPrec,
+ * by precedence climbing. the token after them is left in next */
+static int expr_parse_binary(struct ScanData *scanner, struct ExprCode *code,
+			     unsigned int start, int minPrec,
+			     struct Token *next) {
+  ExprOpcode opcode;
+  int prec;
+
+  if (expr_parse_operand(scanner, code, start) != 0) {
+    return -1;
+  }
+  get_token(next, scanner);
+  while ((prec = expr_find_binary(next, &opcode)) >= minPrec) {
+    if ((expr_parse_binary(scanner, code, start, prec + 1, next) != 0) ||
+	(expr_emit_op(code, start, opcode) != 0)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * expr_compile
+ *    read one operand off the scanner and append its ops to code.
+ * on failure anything appended is left for the caller to drop.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int expr_compile(struct ScanData *scanner, struct ExprCode *code) {
+  return expr_parse_operand(scanner, code, code->count);
+}
+
+/*
+ * expr_eval
+ *    evaluate the count ops starting at first.
+ *
+ * returns 0 on success, nonzero on failure (unknown symbol)
+ */
+int expr_eval(struct SymTab **curSyms, const struct ExprCode *code,
+	      unsigned int first, unsigned int count, unsigned int *pResult) {
+  const struct ExprOp *op, *end;
+  uint32_t stack[EXPR_STACK];
+  int value, sp = 0;
+
+  /* the usual case, already folded to a number */
+  if ((count == 1) && (code->ops[first].code == EXPR_CONST)) {
+    *pResult = code->ops[first].value;
+    return 0;
+  }
+
+  end = &code->ops[first + count];
+  for (op = &code->ops[first]; op < end; op++) {
+    switch (op->code) {
+    case EXPR_CONST:
+    case EXPR_SYMBOL:
+      if (sp == EXPR_STACK) {
+	diag_printf(stdout, "ERROR - Expression nested too deeply\n");
+	return -1;
+      }
+      if (op->code == EXPR_CONST) {
+	stack[sp++] = op->value;
+      }
+      else if (symtab_lookup_id(curSyms, op->value, NULL, &value) == 0) {
+	stack[sp++] = expr_limit(value, op->limLow, op->limHigh);
+      }
+      else {
+	diag_printf(stdout, "ERROR - Symbol '%s' Not Found\n",
+		    INTERN_STR(op->value));
+	return -1;
+      }
+      break;
+    case EXPR_NEG:
+    case EXPR_NOT:
+      expr_apply(op->code, stack[sp-1], 0, &stack[sp-1]);
+      break;
+    default:
+      sp -= 1;
+      if (expr_apply(op->code, stack[sp-1], stack[sp], &stack[sp-1]) != 0) {
+	return -1;
+      }
+      break;
+    }
+  }
+
+  *pResult = stack[0];
+  return 0;
+}
+
+/* check if every symbol the ops load is already defined */
+int expr_resolvable(struct SymTab **curSyms, const struct ExprCode *code,
+		    unsigned int first, unsigned int count) {
+  unsigned int x;
+
+  for (x=first; x<first+count; x++) {
+    if ((code->ops[x].code == EXPR_SYMBOL) &&
+	(symtab_lookup_id(curSyms, code->ops[x].value, NULL, NULL) != 0)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* check if any symbol the ops load is one of syms */
+int expr_uses(struct SymTab **syms, const struct ExprCode *code,
+	      unsigned int first, unsigned int count) {
+  unsigned int x;
+
+  for (x=first; x<first+count; x++) {
+    if ((code->ops[x].code == EXPR_SYMBOL) &&
+	(symtab_lookup_id(syms, code->ops[x].value, NULL, NULL) == 0)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void expr_free(struct ExprCode *code) {
+  free(code->ops);
+  memset(code, 0, sizeof(*code));
+}
@@ -0,0 +1,44 @@
+#ifndef EXPR_H
+#define EXPR_H
+
+#include "global.h"
+#include "scan.h"
+#include "symtab.h"
+
+/* steps of a compiled expression */
+typedef enum {
+  EXPR_CONST, EXPR_SYMBOL, EXPR_NEG, EXPR_NOT, EXPR_MUL, EXPR_DIV,
+  EXPR_MOD, EXPR_ADD, EXPR_SUB, EXPR_SHL, EXPR_SHR, EXPR_AND,
+  EXPR_XOR, EXPR_OR } ExprOpcode;
+
+/* one step, in postfix order */
+struct ExprOp {
+  uint8_t code;			/* an ExprOpcode */
+  uint8_t limLow;		/* bit slice of a symbol's value */
+  uint8_t limHigh;
+  uint32_t value;		/* constant, or a symbol's interned name */
+};
+
+/* compiled expressions, stored back to back. an expression is a
+ * run of ops */
+struct ExprCode {
+  struct ExprOp *ops;
+  unsigned int count;
+  unsigned int size;
+};
+
+/* deepest an expression may nest when evaluated */
+#define EXPR_STACK 32
+
+/* prototypes */
+
+int expr_compile(struct ScanData *scanner, struct ExprCode *code);
+int expr_eval(struct SymTab **curSyms, const struct ExprCode *code,
+	      unsigned int first, unsigned int count, unsigned int *pResult);
+int expr_resolvable(struct SymTab **curSyms, const struct ExprCode *code,
+		    unsigned int first, unsigned int count);
+int expr_uses(struct SymTab **syms, const struct ExprCode *code,
+	      unsigned int first, unsigned int count);
+void expr_free(struct ExprCode *code);
+
+#endif
@@ -2,6 +2,7 @@
 #define GLOBAL_H
 
 #include <inttypes.h>
+#include "stats.h"
 
 /* size of internal character buffers */
 #define MAX_TOKLEN 64
@@ -15,9 +16,13 @@
 #define GETBITS(x,y,val) ((val>>x)&(((UINT32)1<<(y-x+1))-1))
 #define GETBITS64(x,y,val) ((val>>x)&(((UINT64)1<<(y-x+1))-1))
 
-/* to save some typing while casting malloc & calloc */
-#define MALLOC(x)   (x*)malloc(sizeof(x))
-#define CALLOC(x,y) (x*)calloc(sizeof(x),y)
+/* to save some typing while casting malloc & calloc, and to count
+ * allocations for --stats */
+#define MALLOC(x)   (x*)stats_malloc(sizeof(x))
+#define CALLOC(x,y) (x*)stats_calloc(sizeof(x),y)
+#define MALLOC_BYTES(n) stats_malloc(n)
+#define REALLOC(p,n) stats_realloc((p),(n))
+#define STRDUP(s) stats_strdup(s)
 
 /* set macro to control debug levels */
 #define DEBUG_LEVEL 0
@@ -27,6 +32,6 @@
 /* #define CHECK_FIELD_TOO_SMALL(width, value) \ */
 /*  (((value) >= (1<<(width))) || ((value) < (0-(1<<(width-1))))) */
 #define CHECK_FIELD_TOO_SMALL(width, value) \
-  ((value) >= (1<<(width)))
+  (((width) < 32) && ((UINT64)(value) >= ((UINT64)1<<(width))))
 
 #endif 
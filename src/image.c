@@ -0,0 +1,255 @@
+/*
+ * image.c
+ *
+ * Holds the assembled program as a sparse set of segments. Writes
+ * normally land at the end of the segment written last, so emitting
+ * code in order is an append. A write anywhere else (after a .org)
+ * starts a new segment, and segments that come to touch or overlap
+ * are merged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+#include "diag.h"
+
+/* index of the last segment starting at or before offset, or -1 */
+static int image_find(struct Image *img, UINT64 offset) {
+  int lo = 0, hi = (int)img->count - 1, mid, found = -1;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (img->segs[mid].base <= offset) {
+      found = mid;
+      lo = mid + 1;
+    }
+    else {
+      hi = mid - 1;
+    }
+  }
+  return found;
+}
+
+/* make sure a segment can hold len bytes, zero filling the growth */
+static int image_grow(struct Segment *seg, UINT64 len) {
+  UINT64 newalloc;
+  char *newdata;
+
+  if (len > seg->alloc) {
+    newalloc = (seg->alloc < IMAGE_MIN_ALLOC) ? IMAGE_MIN_ALLOC : seg->alloc;
+    while (newalloc < len) {
+      newalloc *= 2;
+    }
+    if (newalloc > 0xffffffffULL) {
+      newalloc = 0xffffffffULL;
+    }
+    if ((newdata = REALLOC(seg->data, newalloc)) == NULL) {
+      diag_printf(stderr, "ERROR - Memory allocation failed\n");
+      return -1;
+    }
+    seg->data = newdata;
+    seg->alloc = newalloc;
+  }
+  if (len > seg->len) {
+    memset(&seg->data[seg->len], 0, len - seg->len);
+    seg->len = len;
+  }
+  return 0;
+}
+
+/* add an empty segment at index idx */
+static int image_insert(struct Image *img, int idx, uint32_t base) {
+  struct Segment *newsegs;
+  unsigned int newsize;
+
+  if (img->count == img->size) {
+    newsize = (img->size == 0) ? 8 : 2*img->size;
+    newsegs = REALLOC(img->segs, newsize*sizeof(struct Segment));
+    if (newsegs == NULL) {
+      diag_printf(stderr, "ERROR - Memory allocation failed\n");
+      return -1;
+    }
+    img->segs = newsegs;
+    img->size = newsize;
+  }
+  memmove(&img->segs[idx+1], &img->segs[idx],
+	  (img->count - idx)*sizeof(struct Segment));
+  img->segs[idx].base = base;
+  img->segs[idx].len = 0;
+  img->segs[idx].alloc = 0;
+  img->segs[idx].data = NULL;
+  img->count += 1;
+  return 0;
+}
+
+/*
+ * image_span
+ *    get a pointer to len bytes at offset, growing or creating a
+ * segment to cover them. bytes never written before read as zero.
+ * the pointer is only good until the next call.
+ *
+ * returns pointer into the image, or NULL on allocation failure
+ */
+char *image_span(struct Image *img, uint32_t offset, uint32_t len) {
+  struct Segment *seg, *next;
+  UINT64 stop, segEnd, nextEnd;
+  int idx;
+
+  stop = (UINT64)offset + len;
+
+  /* usually an append to (or rewrite of) the last segment used */
+  idx = img->cur;
+  if ((img->count == 0) || (img->segs[idx].base > offset) ||
+      ((UINT64)img->segs[idx].base + img->segs[idx].len < offset)) {
+    idx = image_find(img, offset);
+    if ((idx < 0) ||
+	((UINT64)img->segs[idx].base + img->segs[idx].len < offset)) {
+      /* not in or touching any segment, start a new one */
+      idx += 1;
+      if (image_insert(img, idx, offset) != 0) {
+	return NULL;
+      }
+    }
+  }
+  seg = &img->segs[idx];
+
+  /* extend it, absorbing any following segments it runs into */
+  if (stop > (UINT64)seg->base + seg->len) {
+    if (image_grow(seg, stop - seg->base) != 0) {
+      return NULL;
+    }
+    while ((unsigned int)idx + 1 < img->count) {
+      next = &img->segs[idx+1];
+      segEnd = (UINT64)seg->base + seg->len;
+      if (next->base > segEnd) {
+	break;
+      }
+      nextEnd = (UINT64)next->base + next->len;
+      if ((nextEnd > segEnd) &&
+	  (image_grow(seg, nextEnd - seg->base) != 0)) {
+	return NULL;
+      }
+      memcpy(&seg->data[next->base - seg->base], next->data, next->len);
+      free(next->data);
+      memmove(next, next + 1,
+	      (img->count - idx - 2)*sizeof(struct Segment));
+      img->count -= 1;
+    }
+  }
+
+  img->cur = idx;
+  if (stop > img->end) {
+    img->end = stop;
+  }
+  return &seg->data[offset - seg->base];
+}
+
+/*
+ * image_locate
+ *    get a pointer to len bytes at offset, only if one segment
+ * already covers them all. nothing in the image changes, so any
+ * number of threads may do this at once while no one is calling
+ * image_span.
+ *
+ * returns pointer into the image, or NULL if not covered
+ */
+char *image_locate(struct Image *img, uint32_t offset, uint32_t len) {
+  struct Segment *seg;
+  int idx;
+
+  if ((idx = image_find(img, offset)) < 0) {
+    return NULL;
+  }
+  seg = &img->segs[idx];
+  if ((UINT64)offset + len > (UINT64)seg->base + seg->len) {
+    return NULL;
+  }
+  return &seg->data[offset - seg->base];
+}
+
+/*
+ * image_read
+ *    copy len bytes at offset out of the image, zero where nothing
+ * was written.
+ */
+void image_read(struct Image *img, UINT64 offset, char *buf, unsigned int len) {
+  struct Segment *seg;
+  UINT64 from, to, stop = offset + len;
+  int idx;
+
+  memset(buf, 0, len);
+  idx = image_find(img, offset);
+  if (idx < 0) {
+    idx = 0;
+  }
+  for (; (unsigned int)idx < img->count; idx++) {
+    seg = &img->segs[idx];
+    if (seg->base >= stop) {
+      break;
+    }
+    from = (seg->base > offset) ? seg->base : offset;
+    to = (UINT64)seg->base + seg->len;
+    if (to > stop) {
+      to = stop;
+    }
+    if (from < to) {
+      memcpy(&buf[from - offset], &seg->data[from - seg->base], to - from);
+    }
+  }
+}
+
+/*
+ * image_next_data
+ *    find the first address at or after offset that lies in a
+ * segment, so writers can skip over the gaps.
+ *
+ * returns that address, or IMAGE_NO_DATA if there is none
+ */
+UINT64 image_next_data(struct Image *img, UINT64 offset) {
+  struct Segment *seg;
+  int idx;
+
+  idx = image_find(img, offset);
+  if (idx < 0) {
+    idx = 0;
+  }
+  for (; (unsigned int)idx < img->count; idx++) {
+    seg = &img->segs[idx];
+    if ((UINT64)seg->base + seg->len > offset) {
+      return (seg->base > offset) ? seg->base : offset;
+    }
+  }
+  return IMAGE_NO_DATA;
+}
+
+/*
+ * image_data_end
+ *    find where the data at offset stops, the end of the segment
+ * holding it, so writers can keep to what was emitted.
+ *
+ * returns that address, offset itself if nothing is there
+ */
+UINT64 image_data_end(struct Image *img, UINT64 offset) {
+  struct Segment *seg;
+  int idx;
+
+  if ((idx = image_find(img, offset)) < 0) {
+    return offset;
+  }
+  seg = &img->segs[idx];
+  if ((UINT64)seg->base + seg->len <= offset) {
+    return offset;
+  }
+  return (UINT64)seg->base + seg->len;
+}
+
+void image_free(struct Image *img) {
+  unsigned int x;
+
+  for (x=0; x<img->count; x++) {
+    free(img->segs[x].data);
+  }
+  free(img->segs);
+  IMAGE_INIT(img);
+}
@@ -0,0 +1,42 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "global.h"
+
+/* initial allocation for a segment growing on demand */
+#define IMAGE_MIN_ALLOC 4096
+
+/* no more image data, from image_next_data */
+#define IMAGE_NO_DATA 0xffffffffffffffffULL
+
+/* a run of contiguous bytes somewhere in the address space */
+struct Segment {
+  uint32_t base;		/* address of the first byte */
+  uint32_t len;			/* bytes in use */
+  uint32_t alloc;		/* bytes allocated */
+  char *data;
+};
+
+/* assembled program data, as segments in address order. memory
+ * scales with what is emitted, not with the addresses used, and
+ * anything between segments reads as zero */
+struct Image {
+  struct Segment *segs;		/* segments, ordered by base address */
+  unsigned int count;		/* segments in use */
+  unsigned int size;		/* segments allocated */
+  unsigned int cur;		/* segment last written, appends go here */
+  UINT64 end;			/* one past the highest byte written */
+};
+
+#define IMAGE_INIT(ptr) {(ptr)->segs=NULL; (ptr)->count=0; (ptr)->size=0; (ptr)->cur=0; (ptr)->end=0;}
+
+/* prototypes */
+
+char *image_span(struct Image *img, uint32_t offset, uint32_t len);
+char *image_locate(struct Image *img, uint32_t offset, uint32_t len);
+void image_read(struct Image *img, UINT64 offset, char *buf, unsigned int len);
+UINT64 image_next_data(struct Image *img, UINT64 offset);
+UINT64 image_data_end(struct Image *img, UINT64 offset);
+void image_free(struct Image *img);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * include.c
+ *
+ * Files pulled in with .include. Each is tokenized the first time
+ * any program asks for it and the tokens kept until include_flush,
+ * so programs of a batch sharing headers scan them once. Tokens
+ * hold interned ids, so a cache goes with an intern table: the
+ * command line's with the process wide one, an embedder's with the
+ * table of its context.
+ * A scanner returns an included file's tokens ahead of its own,
+ * and a program includes any one file only once, however many
+ * times it is asked to.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "scan.h"
+#include "depend.h"
+#include "diag.h"
+
+/* a file as tokenized, kept until include_flush */
+struct IncludeEntry {
+  char *path;			/* canonical name */
+  struct timespec mtime;	/* when it was tokenized */
+  off_t size;
+  struct TokenStream toks;	/* everything but the end of file */
+  struct IncludeEntry *next;
+};
+
+/* every file tokenized, shared by all threads using the cache.
+ * entries are never changed once added, a file edited since is
+ * added again */
+static struct IncludeCache include_global = {
+  NULL, PTHREAD_MUTEX_INITIALIZER
+};
+static __thread struct IncludeCache *include_cur = &include_global;
+
+/* scan a whole file into a new entry */
+static struct IncludeEntry *include_scan(char *path, struct stat *info) {
+  struct IncludeEntry *entry;
+  struct ScanData scanner;
+  struct Token tok;
+  FILE *handle;
+  int ret = 0;
+
+  if ((entry = CALLOC(struct IncludeEntry, 1)) == NULL) {
+    return NULL;
+  }
+  if ((handle = fopen(path, "r")) == NULL) {
+    diag_printf(stderr, "ERROR - Could not open include file %s\n", path);
+    free(entry);
+    return NULL;
+  }
+
+  SCANNER_INIT(&scanner, handle);
+  ret = scan_name(&scanner, path);
+  while ((ret == 0) && (scan_token(&tok, &scanner) != TOK_EOF)) {
+    ret = tokstream_append(&entry->toks, &tok);
+  }
+
+  /* a last line without a newline still has to end, or the line
+   * after the .include would be taken as more of it */
+  if ((ret == 0) && (entry->toks.count > 0) &&
+      (entry->toks.toks[entry->toks.count - 1].type != TOK_ENDL)) {
+    memset(&tok, 0, sizeof(tok));
+    tok.type = TOK_ENDL;
+    tok.str = intern_string("\n", 1);
+    tok.file = scanner.file;
+    tok.linenum = scanner.linecount;
+    ret = (tok.str == INTERN_NONE) ? -1 : tokstream_append(&entry->toks, &tok);
+  }
+  SCANNER_STOP(&scanner);
+  fclose(handle);
+
+  if ((ret != 0) || ((entry->path = STRDUP(path)) == NULL)) {
+    diag_printf(stderr, "ERROR - Memory allocation failed\n");
+    tokstream_free(&entry->toks);
+    free(entry);
+    return NULL;
+  }
+  entry->mtime = info->st_mtim;
+  entry->size = info->st_size;
+  return entry;
+}
+
+/*
+ * include_load
+ *    find the tokens of the file a string token names, scanning it
+ * if this is the first time it was asked for, or if it changed since.
+ *
+ * returns the entry, or NULL on failure
+ */
+static const struct IncludeEntry *include_load(const struct Token *name) {
+  struct IncludeCache *cache = include_cur;
+  struct IncludeEntry *entry;
+  struct stat info;
+  char where[PATH_MAX], path[PATH_MAX];
+
+  if (scan_path(where, name->file, TOKSTR(name)) != 0) {
+    diag_printf(stderr, "ERROR - Include file name %s is too long, %s:%d\n",
+		TOKSTR(name), TOKPOS(name));
+    return NULL;
+  }
+  if ((realpath(where, path) == NULL) || (stat(path, &info) != 0)) {
+    /* noted, so watch mode sees it turn up */
+    depend_note(where, 1);
+    diag_printf(stderr, "ERROR - Could not find include file %s, %s:%d\n",
+		TOKSTR(name), TOKPOS(name));
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  for (entry = cache->entries; entry != NULL; entry = entry->next) {
+    if ((strcmp(entry->path, path) == 0) && (entry->size == info.st_size) &&
+	(entry->mtime.tv_sec == info.st_mtim.tv_sec) &&
+	(entry->mtime.tv_nsec == info.st_mtim.tv_nsec)) {
+      break;
+    }
+  }
+  if ((entry == NULL) && ((entry = include_scan(path, &info)) != NULL)) {
+    entry->next = cache->entries;
+    cache->entries = entry;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return entry;
+}
+
+/*
+ * include_push
+ *    have the scanner return the tokens of the file a string token
+ * names next, unless it has already been included. a relative name
+ * is taken from the directory of the file holding the token.
+ *
+ * returns 0 on success (included or skipped), nonzero on failure
+ */
+int include_push(struct ScanData *data, const struct Token *name) {
+  const struct IncludeEntry *entry;
+  const char **newonce;
+  unsigned int x, newsize;
+
+  if (((entry = include_load(name)) == NULL) ||
+      (depend_note(entry->path, 0) != 0)) {
+    return -1;
+  }
+
+  /* only once */
+  for (x=0; x<data->numOnce; x++) {
+    if (strcmp(data->once[x], entry->path) == 0) {
+      return 0;
+    }
+  }
+
+  if (data->depth >= SCAN_MAX_INCLUDE) {
+    diag_printf(stderr, "ERROR - Includes nested too deeply at %s, %s:%d\n",
+		TOKSTR(name), TOKPOS(name));
+    return -1;
+  }
+  if (data->numOnce == data->sizeOnce) {
+    newsize = (data->sizeOnce == 0) ? 8 : 2*data->sizeOnce;
+    if ((newonce = REALLOC(data->once, newsize*sizeof(char *))) == NULL) {
+      diag_printf(stderr, "ERROR - Memory allocation failed\n");
+      return -1;
+    }
+    data->once = newonce;
+    data->sizeOnce = newsize;
+  }
+  data->once[data->numOnce++] = entry->path;
+
+  data->frames[data->depth].pos = entry->toks.toks;
+  data->frames[data->depth].end = entry->toks.toks + entry->toks.count;
+  data->depth += 1;
+  return 0;
+}
+
+/* drop every file in a cache */
+static void include_clear(struct IncludeCache *cache) {
+  struct IncludeEntry *temp;
+
+  pthread_mutex_lock(&cache->lock);
+  while (cache->entries != NULL) {
+    temp = cache->entries->next;
+    tokstream_free(&cache->entries->toks);
+    free(cache->entries->path);
+    free(cache->entries);
+    cache->entries = temp;
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/* set up an empty cache, for files kept apart from the rest of
+ * the process */
+void include_cache_init(struct IncludeCache *cache) {
+  cache->entries = NULL;
+  pthread_mutex_init(&cache->lock, NULL);
+}
+
+/* release a cache made by include_cache_init, and every file in
+ * it. no scanner may be using it */
+void include_cache_free(struct IncludeCache *cache) {
+  include_clear(cache);
+  pthread_mutex_destroy(&cache->lock);
+}
+
+/* keep included files in cache from now on, on this thread only,
+ * NULL for the process wide one. returns the one used before */
+struct IncludeCache *include_attach(struct IncludeCache *cache) {
+  struct IncludeCache *old = include_cur;
+
+  include_cur = (cache != NULL) ? cache : &include_global;
+  return old;
+}
+
+/* drop every file in this thread's cache, once no scanner is using
+ * them */
+void include_flush(void) {
+  include_clear(include_cur);
+}
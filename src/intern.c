@@ -0,0 +1,340 @@
+/*
+ * intern.c
+ *
+ * Interned strings. Every token's text is kept here once, however
+ * many times it is scanned and by whichever thread, and tokens carry
+ * a 32 bit id for it instead. Two ids are the same string exactly
+ * when they are equal, so names are compared as integers. Strings
+ * are kept until intern_flush, so a table only grows until then,
+ * up to INTERN_MAX_PAGES pages of ids.
+ *
+ * The command line uses one table for the whole process. Programs
+ * embedding the assembler give each context a table of its own
+ * (intern_init), attached to whichever thread is working for it,
+ * and free it along with the context.
+ *
+ * Adding a string takes a lock, finding one usually does not: each
+ * thread keeps a small cache of the ids it has seen recently, which
+ * it drops when it moves to another table, or the next time it looks
+ * anything up after a flush.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "intern.h"
+#include "diag.h"
+
+/* block of string storage, chained so strings never move */
+struct InternBlock {
+  struct InternBlock *next;
+  size_t used;
+  size_t size;
+  char data[1];
+};
+
+/* size of each block of string storage */
+#define INTERN_BLOCK 65536
+
+/* ids below this are single characters */
+#define INTERN_CHARS 256
+
+/* slots in each thread's cache of recent ids (power of two) */
+#define INTERN_CACHE 1024
+
+/* the first page is static and shared by every table, holding the
+ * empty string as id 0 and each single character as its own code,
+ * see intern_chars. other ids start on the second page */
+static struct InternEntry intern_first[INTERN_PAGE_SIZE] = {
+  { "", 0, 2166136261u }
+};
+static char intern_text[INTERN_CHARS][2];
+static pthread_once_t intern_once = PTHREAD_ONCE_INIT;
+
+/* the table used by default, for the whole process */
+static struct InternTable intern_global = {
+  { intern_first }, PTHREAD_MUTEX_INITIALIZER, INTERN_PAGE_SIZE,
+  NULL, 0, NULL, 1
+};
+__thread struct InternTable *intern_cur = &intern_global;
+
+/* serials handed out so far, never reused, so a table freed and
+ * another made in its place is not mistaken for it */
+static uint32_t intern_serials = 1;
+
+/* ids this thread interned or found lately, by hash, 0 if none,
+ * good for the table whose serial is intern_cache_serial */
+static __thread uint32_t intern_cache[INTERN_CACHE];
+static __thread uint32_t intern_cache_serial = 0;
+
+/* FNV-1a, quick and good enough for identifiers */
+uint32_t intern_hash(const char *str, size_t len) {
+  uint32_t hash = 2166136261u;
+
+  while (len-- > 0) {
+    hash ^= (unsigned char)*str++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* fill in the ids of single characters, which are never hashed */
+static void intern_chars(void) {
+  int x;
+
+  for (x=1; x<INTERN_CHARS; x++) {
+    intern_text[x][0] = (char)x;
+    intern_first[x].str = intern_text[x];
+    intern_first[x].len = 1;
+    intern_first[x].hash = intern_hash(intern_text[x], 1);
+  }
+}
+
+/* check if id is the given string */
+static int intern_equal(uint32_t id, const char *str, size_t len,
+			uint32_t hash) {
+  const struct InternEntry *entry = INTERN_ENTRY(id);
+
+  return (entry->hash == hash) && (entry->len == len) &&
+    (memcmp(entry->str, str, len) == 0);
+}
+
+/* find the slot holding a string, or the empty one where it belongs */
+static uint32_t *intern_probe(struct InternTable *table, const char *str,
+			      size_t len, uint32_t hash) {
+  uint32_t x;
+
+  for (x = hash & table->mask; ; x = (x + 1) & table->mask) {
+    if ((table->slots[x] == 0) ||
+	intern_equal(table->slots[x], str, len, hash)) {
+      return &table->slots[x];
+    }
+  }
+}
+
+/* double the slots, or make the first ones */
+static int intern_grow(struct InternTable *table) {
+  uint32_t *old, x, oldsize, newsize, hash;
+
+  old = table->slots;
+  oldsize = (old == NULL) ? 0 : table->mask + 1;
+  newsize = (old == NULL) ? 4096 : 2*oldsize;
+  if ((table->slots = CALLOC(uint32_t, newsize)) == NULL) {
+    table->slots = old;
+    return -1;
+  }
+  table->mask = newsize - 1;
+  for (x=0; x<oldsize; x++) {
+    if (old[x] != 0) {
+      hash = INTERN_HASH(old[x]);
+      while (table->slots[hash & table->mask] != 0) {
+	hash += 1;
+      }
+      table->slots[hash & table->mask] = old[x];
+    }
+  }
+  free(old);
+  return 0;
+}
+
+/* copy a string into storage, returning the stable copy */
+static const char *intern_store(struct InternTable *table, const char *str,
+				size_t len) {
+  struct InternBlock *block = table->blocks;
+  size_t size;
+  char *copy;
+
+  if ((block == NULL) || (block->size - block->used < len + 1)) {
+    /* start a new block, big enough for oversized strings too */
+    size = (len + 1 > INTERN_BLOCK) ? len + 1 : INTERN_BLOCK;
+    if ((block = MALLOC_BYTES(sizeof(struct InternBlock) + size)) == NULL) {
+      return NULL;
+    }
+    block->used = 0;
+    block->size = size;
+    block->next = table->blocks;
+    table->blocks = block;
+  }
+  copy = &block->data[block->used];
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  block->used += len + 1;
+  return copy;
+}
+
+/* add a string not there yet, under the lock */
+static uint32_t intern_add(struct InternTable *table, uint32_t *slot,
+			   const char *str, size_t len, uint32_t hash) {
+  struct InternEntry *entry;
+  uint32_t id = table->count;
+  const char *copy;
+
+  if ((id >> INTERN_PAGE_BITS) >= INTERN_MAX_PAGES) {
+    return INTERN_NONE;
+  }
+  if ((table->pages[id >> INTERN_PAGE_BITS] == NULL) &&
+      ((table->pages[id >> INTERN_PAGE_BITS] =
+	CALLOC(struct InternEntry, INTERN_PAGE_SIZE)) == NULL)) {
+    return INTERN_NONE;
+  }
+  if ((copy = intern_store(table, str, len)) == NULL) {
+    return INTERN_NONE;
+  }
+  entry = INTERN_ENTRY(id);
+  entry->str = copy;
+  entry->len = len;
+  entry->hash = hash;
+  *slot = id;
+  table->count += 1;
+  return id;
+}
+
+/* look a string up, adding it if asked to */
+static uint32_t intern_lookup(const char *str, size_t len, int add) {
+  struct InternTable *table = intern_cur;
+  uint32_t hash, id, serial, *cached, *slot;
+
+  if (len == 0) {
+    return INTERN_EMPTY;
+  }
+  if ((len == 1) && (str[0] != '\0')) {
+    pthread_once(&intern_once, intern_chars);
+    return (unsigned char)str[0];
+  }
+
+  /* seen it lately? */
+  serial = __atomic_load_n(&table->serial, __ATOMIC_ACQUIRE);
+  if (intern_cache_serial != serial) {
+    memset(intern_cache, 0, sizeof(intern_cache));
+    intern_cache_serial = serial;
+  }
+  hash = intern_hash(str, len);
+  cached = &intern_cache[hash & (INTERN_CACHE - 1)];
+  if ((*cached != 0) && intern_equal(*cached, str, len, hash)) {
+    return *cached;
+  }
+
+  pthread_mutex_lock(&table->lock);
+  id = INTERN_NONE;
+  slot = NULL;
+  if (table->slots != NULL) {
+    slot = intern_probe(table, str, len, hash);
+    if (*slot != 0) {
+      id = *slot;
+    }
+  }
+  if ((id == INTERN_NONE) && add) {
+    /* keep the load under 3/4 */
+    if ((table->slots == NULL) ||
+	(table->count + 1 > table->mask - table->mask/4)) {
+      slot = (intern_grow(table) == 0) ?
+	intern_probe(table, str, len, hash) : NULL;
+    }
+    if (slot != NULL) {
+      id = intern_add(table, slot, str, len, hash);
+    }
+  }
+  pthread_mutex_unlock(&table->lock);
+
+  if (id != INTERN_NONE) {
+    *cached = id;
+  }
+  else if (add) {
+    diag_printf(stderr, "ERROR - Could not intern string, out of memory "
+		"or too many names\n");
+  }
+  return id;
+}
+
+/*
+ * intern_string
+ *    the id of len characters of str, which need not be terminated.
+ * the same string always gives the same id, from any thread using
+ * the same table.
+ *
+ * returns the id, INTERN_NONE if out of memory
+ */
+uint32_t intern_string(const char *str, size_t len) {
+  return intern_lookup(str, len, 1);
+}
+
+/*
+ * intern_find
+ *    the id of a string only if it was interned already, for looking
+ * up names that need not be there.
+ *
+ * returns the id, INTERN_NONE if it has never been seen
+ */
+uint32_t intern_find(const char *str, size_t len) {
+  return intern_lookup(str, len, 0);
+}
+
+/* drop every string in a table */
+static void intern_clear(struct InternTable *table) {
+  struct InternBlock *temp;
+  uint32_t x;
+
+  while (table->blocks != NULL) {
+    temp = table->blocks->next;
+    free(table->blocks);
+    table->blocks = temp;
+  }
+  for (x=1; x<INTERN_MAX_PAGES; x++) {
+    free(table->pages[x]);
+    table->pages[x] = NULL;
+  }
+  free(table->slots);
+  table->slots = NULL;
+  table->mask = 0;
+  table->count = INTERN_PAGE_SIZE;
+}
+
+/*
+ * intern_init
+ *    set up an empty table, for a set of names kept apart from the
+ * rest of the process. see intern_attach.
+ */
+void intern_init(struct InternTable *table) {
+  memset(table, 0, sizeof(*table));
+  table->pages[0] = intern_first;
+  pthread_mutex_init(&table->lock, NULL);
+  table->count = INTERN_PAGE_SIZE;
+  table->serial = __atomic_add_fetch(&intern_serials, 1, __ATOMIC_RELAXED);
+}
+
+/* release a table made by intern_init, no thread may be using it */
+void intern_free(struct InternTable *table) {
+  intern_clear(table);
+  pthread_mutex_destroy(&table->lock);
+}
+
+/*
+ * intern_attach
+ *    intern into table from now on, and find the strings of ids in
+ * it, on this thread only. NULL goes back to the process wide one.
+ * threads start out with that too.
+ *
+ * returns the table this thread was using before
+ */
+struct InternTable *intern_attach(struct InternTable *table) {
+  struct InternTable *old = intern_cur;
+
+  intern_cur = (table != NULL) ? table : &intern_global;
+  return old;
+}
+
+/* drop every string in this thread's table, once no thread is using
+ * any of its ids. other threads clear their caches the next time
+ * they look one up */
+void intern_flush(void) {
+  struct InternTable *table = intern_cur;
+
+  pthread_mutex_lock(&table->lock);
+  intern_clear(table);
+  memset(intern_cache, 0, sizeof(intern_cache));
+  intern_cache_serial = __atomic_add_fetch(&intern_serials, 1,
+					   __ATOMIC_RELAXED);
+  __atomic_store_n(&table->serial, intern_cache_serial, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,60 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <pthread.h>
+#include "global.h"
+
+/* ids are found through a table of pages, which never move once
+ * allocated, so any thread can turn an id it holds into its string */
+#define INTERN_PAGE_BITS 12
+#define INTERN_PAGE_SIZE (1 << INTERN_PAGE_BITS)
+#define INTERN_MAX_PAGES 4096
+
+/* id of the empty string, there from the start */
+#define INTERN_EMPTY 0
+
+/* not an id, for strings that could not be interned or found */
+#define INTERN_NONE 0xffffffff
+
+/* one interned string */
+struct InternEntry {
+  const char *str;		/* terminated, never changes or moves */
+  uint32_t len;
+  uint32_t hash;		/* intern_hash of it */
+};
+
+/* a set of interned strings, ids from one mean nothing in another.
+ * the first page, the empty string and single characters, is the
+ * same in all of them */
+struct InternTable {
+  struct InternEntry *pages[INTERN_MAX_PAGES];
+  pthread_mutex_t lock;		/* held to change anything below */
+  uint32_t count;		/* ids handed out so far */
+  uint32_t *slots;		/* open addressing over ids, 0 unused */
+  uint32_t mask;		/* number of slots - 1 */
+  struct InternBlock *blocks;	/* string storage */
+  uint32_t serial;		/* new with every flush, see intern.c */
+};
+
+/* the table this thread interns into, see intern_attach */
+extern __thread struct InternTable *intern_cur;
+
+/* string, length and hash of an id, with no locking */
+#define INTERN_ENTRY(id) \
+  (&intern_cur->pages[(id) >> INTERN_PAGE_BITS] \
+		     [(id) & (INTERN_PAGE_SIZE - 1)])
+#define INTERN_STR(id) (INTERN_ENTRY(id)->str)
+#define INTERN_LEN(id) (INTERN_ENTRY(id)->len)
+#define INTERN_HASH(id) (INTERN_ENTRY(id)->hash)
+
+/* prototypes */
+
+uint32_t intern_hash(const char *str, size_t len);
+uint32_t intern_string(const char *str, size_t len);
+uint32_t intern_find(const char *str, size_t len);
+void intern_init(struct InternTable *table);
+void intern_free(struct InternTable *table);
+struct InternTable *intern_attach(struct InternTable *table);
+void intern_flush(void);
+
+#endif
@@ -1,114 +1,205 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "asm.h"
 #include "symtab.h"
+#include "build.h"
 
-int guess_output(struct SymTab **prgSyms, char *out) {
-  int x, pIdx = -1;
-  char fmtname[MAX_TOKLEN];
-  
-  if (symtab_lookup(prgSyms, "$outfmt", fmtname, NULL) != 0) {
-    printf("INFO: Unknown output format, defaulting to mif\n");
-    sprintf(fmtname, "mif");
-  }
-  
-  for (x=0; out[x] != '\0'; x++) {
-    if (out[x] == '.') {
-      pIdx = x;
-    }
-  }
-  
-  if (pIdx == -1) {
-    return -1;
-  }
-  
-  sprintf(&out[pIdx+1], "%s", fmtname);
-  return 0;
+void usage(char *name) {
+  printf("Usage:\n\t%s [options] <input> [<output>]\n", name);
+  printf("\t%s [options] --batch <input|@manifest> ...\n", name);
+  printf("\t%s [options] --link [-o <output>] <object> ...\n\n", name);
+  printf("Options:\n");
+  printf("\t-1, --one-pass   assemble in a single pass, patching forward\n"
+	 "\t                 references at the end (keeps no token stream)\n");
+  printf("\t-c, --object     assemble each input as one module of a\n"
+	 "\t                 program, to an object file (.obj) for --link\n");
+  printf("\t--link           link object files into one program, placed\n"
+	 "\t                 in the order given. the output is named by\n"
+	 "\t                 -o, or else after the first object\n");
+  printf("\t-o <output>      name the output, as <output> does, or the\n"
+	 "\t                 linked program. not for --batch\n");
+  printf("\t--no-mif-ranges  write every MIF word on its own line, rather\n"
+	 "\t                 than [start..end] ranges for repeated values\n");
+  printf("\t--format <list>  output formats to write, overriding .outfmt, as\n"
+	 "\t                 a comma separated list of mif, bin, ihex, memh,\n"
+	 "\t                 memb and rom. with several, the output name's\n"
+	 "\t                 extension is replaced for each\n");
+  printf("\t--batch          assemble each input to its own output, the\n"
+	 "\t                 name guessed from its output format\n");
+  printf("\t--watch          keep running, assembling the input again\n"
+	 "\t                 each time it changes\n");
+  printf("\t-j <n>           number of worker threads, for the programs\n"
+	 "\t                 of a --batch or else for the second pass of\n"
+	 "\t                 one program (default is one per online cpu)\n");
+  printf("\t--cache <dir>    keep builds in dir, by the contents of the\n"
+	 "\t                 source, the files it uses and the options, and\n"
+	 "\t                 put a build's outputs back from there rather\n"
+	 "\t                 than assemble it again\n");
+  printf("\t--deps           also write a make rule (.d, named after the\n"
+	 "\t                 output) of the files the output depends on\n");
+  printf("\t--stats <file>   write phase timings, counters and peak memory\n"
+	 "\t                 as JSON to file, '-' for standard output\n\n");
+  printf("An input of '-' reads from standard input. In batch mode an\n"
+	 "input of '@file' reads a manifest, one \"<input> [<output>]\"\n"
+	 "per line.\n");
 }
-  
+
 int main(int argc, char **argv) {
   /* local vars */
-  struct SymTab *prgSyms = NULL;
-  FILE *inFile;
-  char *data, outfmt[64];
-  char *outName, guessed[1024];
-  int prgSize, ret;
-  
-  symtab_clear(&prgSyms);
+  struct BuildOpts opts;
+  struct BuildList list;
+  char *outName = NULL;
+  int argi, batch = 0, watch = 0, link = 0, workers = 0, ret;
+  
+  memset(&opts, 0, sizeof(opts));
+  memset(&list, 0, sizeof(list));
+  
+  /* pick off any options */
+  for (argi = 1; (argi < argc) && (argv[argi][0] == '-') &&
+	 (argv[argi][1] != '\0'); argi++) {
+    if ((strcmp(argv[argi], "-1") == 0) ||
+	(strcmp(argv[argi], "--one-pass") == 0)) {
+      opts.onePass = 1;
+    }
+    else if ((strcmp(argv[argi], "-c") == 0) ||
+	     (strcmp(argv[argi], "--object") == 0)) {
+      opts.object = 1;
+    }
+    else if (strcmp(argv[argi], "--link") == 0) {
+      link = 1;
+    }
+    else if ((strcmp(argv[argi], "-o") == 0) && (argi + 1 < argc)) {
+      outName = argv[++argi];
+    }
+    else if (strcmp(argv[argi], "--no-mif-ranges") == 0) {
+      opts.noRanges = 1;
+    }
+    else if (strcmp(argv[argi], "--batch") == 0) {
+      batch = 1;
+    }
+    else if (strcmp(argv[argi], "--watch") == 0) {
+      watch = 1;
+    }
+    else if ((strcmp(argv[argi], "--format") == 0) && (argi + 1 < argc)) {
+      opts.formats = argv[++argi];
+    }
+    else if ((strcmp(argv[argi], "--cache") == 0) && (argi + 1 < argc)) {
+      opts.cacheDir = argv[++argi];
+    }
+    else if (strcmp(argv[argi], "--deps") == 0) {
+      opts.deps = 1;
+    }
+    else if ((strcmp(argv[argi], "--stats") == 0) && (argi + 1 < argc)) {
+      opts.statsName = argv[++argi];
+    }
+    else if ((strcmp(argv[argi], "-j") == 0) && (argi + 1 < argc)) {
+      workers = atoi(argv[++argi]);
+      if (workers <= 0) {
+	printf("Bad worker count %s\n\n", argv[argi]);
+	usage(argv[0]);
+	return -1;
+      }
+    }
+    else {
+      printf("Unknown option %s\n\n", argv[argi]);
+      usage(argv[0]);
+      return -1;
+    }
+  }
   
   /* check if there was a file specified as an argument */
-  if (argc < 2) {
+  if (argi >= argc) {
     printf("No input specified\n\n");
-    printf("Usage:\n\t%s <input> [<output>]\n", argv[0]);
+    usage(argv[0]);
     return 0;
   }
   
-  /* open input file */
-  if ((inFile = fopen(argv[1], "r")) == NULL) {
-    perror("FATAL - Could not open input file");
-    return -1;
+  if (workers == 0) {
+    workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
   }
   
-  /* load the symbol table from the input file given */
-  if (asmgen_parse_syms(&prgSyms, inFile) != 0) {
-    /* failed */
-    fprintf(stderr, "FATAL - Could not parse input\n");
-    symtab_clear(&prgSyms);
+  if (watch && (batch || link || opts.object)) {
+    printf("Only a single program can be watched\n\n");
+    usage(argv[0]);
     return -1;
   }
-  
-  /* display known symbols */
-  if (0) {
-    symtab_show(&prgSyms);
-  }
-  
-  /* allocate space to write binary program data */
-  if (symtab_lookup(&prgSyms, "$filesize", NULL, &prgSize) != 0) {
-    fprintf(stderr, "ERROR - Unknown file size\n");
+  if (link && (batch || opts.object)) {
+    printf("--link takes object files, on their own\n\n");
+    usage(argv[0]);
     return -1;
   }
-  if ((data = CALLOC(char, prgSize)) == NULL) {
-    fprintf(stderr, "ERROR - Memory allocation failed\n");
+  if ((outName != NULL) && batch) {
+    printf("-o names one output, each in a batch is named apart\n\n");
+    usage(argv[0]);
     return -1;
   }
-  
-  /* rewind input file to beginning for second pass */
-  if (fseek(inFile, 0L, SEEK_SET) != 0) {
-    perror("FATAL - Could not rewind file");
+  if ((outName != NULL) && !link && (argi + 1 < argc)) {
+    printf("Output named both by -o and after the input\n\n");
+    usage(argv[0]);
     return -1;
   }
-  
-  /* attempt to assemble */
-  if (asmgen_assemble(&prgSyms, inFile, data) != 0) {
-    fprintf(stderr, "FATAL - Could not assemble\n");
-    return -1;
+  if ((outName == NULL) && !link && (argi + 1 < argc)) {
+    outName = argv[argi + 1];
+  }
+  if (link) {
+    /* every input is an object, in order */
+    opts.passWorkers = workers;
+    ret = build_link(&argv[argi], argc - argi, outName, &opts);
+    asmrec_unload_all();
+    intern_flush();
+    return ret;
+  }
+  if (watch) {
+    /* one program, for as long as it takes */
+    opts.passWorkers = workers;
+    ret = build_watch(argv[argi], outName, &opts);
+    asmrec_unload_all();
+    include_flush();
+    intern_flush();
+    return ret;
+  }
+  
+  if (!batch) {
+    /* single program, optional output name */
+    opts.passWorkers = workers;
+    if (build_add_job(&list, argv[argi], outName) != 0) {
+      return -1;
+    }
+    ret = build_file(list.jobs[0].inName, list.jobs[0].outName, &opts,
+		     &list.jobs[0].srcBytes,
+		     (opts.statsName != NULL) ? &list.jobs[0].stats : NULL);
+    list.jobs[0].status = ret;
+    goto done;
   }
   
-  /* identify output filename */
-  if (argc < 3) {
-    outName = guessed;
-    strncpy(guessed, argv[1], 1024);
-    guess_output(&prgSyms, guessed);
-  }
-  else {
-    /* specified, use that */
-    outName = argv[2];
+  /* gather up the batch */
+  for (; argi < argc; argi++) {
+    if (argv[argi][0] == '@') {
+      ret = build_read_manifest(&list, &argv[argi][1]);
+    }
+    else {
+      ret = build_add_job(&list, argv[argi], NULL);
+    }
+    if (ret != 0) {
+      build_free_list(&list);
+      return -1;
+    }
   }
-  printf("Output name is \'%s\'\n", outName);
   
-  /* write file */
-  symtab_lookup(&prgSyms, "$outfmt", outfmt, NULL);
-  if (strcmp(outfmt, "mif") == 0) {
-    ret = asmout_make_mif(&prgSyms, outName, data) != 0;
-  }
-  else {
-    ret = asmout_make_rom(&prgSyms, outName, data) != 0;
-  }
-  if (ret != 0) {
-    fprintf(stderr, "FATAL - File output failed\n");
-    return -1;
-  }
+  /* programs are already spread over the cpus */
+  opts.passWorkers = 1;
+  ret = build_batch(&list, workers, &opts);
   
-  return 0;
+ done:
+  if ((opts.statsName != NULL) &&
+      (build_write_stats(&list, opts.statsName) != 0)) {
+    ret = -1;
+  }
+  build_free_list(&list);
+  asmrec_unload_all();
+  include_flush();
+  intern_flush();
+  return ret;
 }
@@ -0,0 +1,525 @@
+/*
+ * object.c
+ *
+ * Relocatable object files, so the modules of a program can be
+ * assembled apart (in parallel, and only when edited) and linked
+ * afterwards. An object holds a module's code as assembled from
+ * offset 0, every symbol it defines, and its relocations: the
+ * fixups of each operand using a label or a symbol from another
+ * module, with their compiled ops, symbol names and source files.
+ *
+ * Linking places the modules one after the other, in the order
+ * given, and patches each relocation in with asmgen_resolve_fixups.
+ * A module sees its own symbols first, then those of the others,
+ * which must be defined by exactly one module. Settings (names
+ * starting with '$') apply to the whole program, later modules
+ * overriding earlier ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "object.h"
+
+/* strings of an object being written, each name stored once */
+struct ObjectStrings {
+  char *text;
+  uint32_t len;
+  uint32_t size;
+  struct SymTab *offsets;	/* offset of each name, by id */
+};
+
+/* one module read back for linking */
+struct ObjectModule {
+  char *name;			/* file it came from */
+  char *data;			/* the whole file */
+  struct ObjectHeader *hdr;
+  struct ObjectSegment *segs;
+  struct ObjectSymbol *syms;
+  struct Fixup *relocs;
+  struct ExprOp *ops;
+  char *code;
+  char *strings;
+  uint32_t base;		/* where it was placed */
+  struct SymTab *table;		/* its symbols, then those it imports */
+};
+
+/* add a string to an object, returning its offset in pOff. names
+ * are given by id, and only stored once */
+static int object_string(struct ObjectStrings *strs, const char *str,
+			 uint32_t id, uint32_t *pOff) {
+  uint32_t len = strlen(str) + 1, newsize;
+  char *newtext;
+  int off;
+
+  if ((id != INTERN_NONE) &&
+      (symtab_lookup_id(&strs->offsets, id, NULL, &off) == 0)) {
+    *pOff = off;
+    return 0;
+  }
+
+  if (strs->len + len > strs->size) {
+    for (newsize = (strs->size == 0) ? 4096 : strs->size;
+	 newsize < strs->len + len; newsize *= 2) { }
+    if ((newtext = REALLOC(strs->text, newsize)) == NULL) {
+      diag_printf(stderr, "ERROR - Memory allocation failed\n");
+      return -1;
+    }
+    strs->text = newtext;
+    strs->size = newsize;
+  }
+  memcpy(&strs->text[strs->len], str, len);
+  *pOff = strs->len;
+  strs->len += len;
+  if ((id != INTERN_NONE) &&
+      (symtab_record_id(&strs->offsets, id, NULL, *pOff) != 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+/* order symbols by name, see object_write */
+static int object_by_name(const void *a, const void *b) {
+  return strcmp((*(const struct SymEntry * const *)a)->name,
+		(*(const struct SymEntry * const *)b)->name);
+}
+
+/*
+ * object_write
+ *    write an object file for a module assembled by
+ * asmgen_assemble_object, from its symbols, code and relocations.
+ * symbols go in name order, so a module always makes the same
+ * bytes, whatever else the process has assembled.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int object_write(struct SymTab **curSyms, struct Image *image,
+		 struct FixupList *relocs, char *out) {
+  struct ObjectHeader hdr;
+  struct ObjectStrings strs;
+  struct ObjectSegment *segs = NULL;
+  struct ObjectSymbol *syms = NULL;
+  struct Fixup *fixes = NULL;
+  struct ExprOp *ops = NULL;
+  const struct SymEntry *entry, **order = NULL;
+  const struct Fixup *fix;
+  unsigned int iter, x;
+  int filesize, ok = 0;
+  FILE *handle;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memset(&strs, 0, sizeof(strs));
+  memcpy(hdr.magic, OBJECT_MAGIC, 8);
+  hdr.version = OBJECT_VERSION;
+  hdr.fixupSize = sizeof(struct Fixup);
+  hdr.opSize = sizeof(struct ExprOp);
+  hdr.size = image->end;
+  if ((symtab_lookup(curSyms, "$filesize", NULL, &filesize) == 0) &&
+      ((unsigned int)filesize > hdr.size)) {
+    /* a trailing .org reserves space too */
+    hdr.size = filesize;
+  }
+  hdr.numSegs = image->count;
+  hdr.numSyms = (*curSyms != NULL) ? (*curSyms)->count : 0;
+  hdr.numRelocs = relocs->count;
+  hdr.numOps = relocs->code.count;
+
+  if (((segs = CALLOC(struct ObjectSegment, hdr.numSegs + 1)) == NULL) ||
+      ((syms = CALLOC(struct ObjectSymbol, hdr.numSyms + 1)) == NULL) ||
+      ((order = CALLOC(const struct SymEntry *, hdr.numSyms + 1)) == NULL) ||
+      ((fixes = CALLOC(struct Fixup, hdr.numRelocs + 1)) == NULL) ||
+      ((ops = CALLOC(struct ExprOp, hdr.numOps + 1)) == NULL)) {
+    diag_printf(stderr, "ERROR - Memory allocation failed\n");
+    goto done;
+  }
+  for (x=0; x<hdr.numSegs; x++) {
+    segs[x].base = image->segs[x].base;
+    segs[x].len = image->segs[x].len;
+    hdr.codeSize += segs[x].len;
+  }
+
+  /* symbols, relocations and ops refer to names by offset, not
+   * by id */
+  iter = 0;
+  for (x=0; (x<hdr.numSyms) &&
+	 ((order[x] = symtab_next(curSyms, &iter)) != NULL); x++) { }
+  hdr.numSyms = x;
+  qsort(order, x, sizeof(order[0]), object_by_name);
+  for (x=0; x<hdr.numSyms; x++) {
+    entry = order[x];
+    if (object_string(&strs, entry->name, entry->id, &syms[x].name) != 0) {
+      goto done;
+    }
+    syms[x].strVal = OBJECT_NO_STRING;
+    if ((entry->strVal != NULL) &&
+	(object_string(&strs, entry->strVal, INTERN_NONE,
+		       &syms[x].strVal) != 0)) {
+      goto done;
+    }
+    syms[x].intVal = entry->intVal;
+    syms[x].flags =
+      (symtab_lookup_id(&relocs->labels, entry->id, NULL, NULL) == 0) ?
+      OBJECT_SYM_LABEL : 0;
+  }
+  for (x=0; x<hdr.numRelocs; x++) {
+    /* field by field, so padding and unused fields stay zero */
+    fix = &relocs->list[x];
+    fixes[x].offset = fix->offset;
+    fixes[x].byte_count = fix->byte_count;
+    fixes[x].width = fix->width;
+    fixes[x].num_fields = fix->num_fields;
+    memcpy(fixes[x].fieldOffset, fix->fieldOffset, fix->num_fields);
+    fixes[x].file = fix->file;
+    fixes[x].linenum = fix->linenum;
+    fixes[x].first = fix->first;
+    fixes[x].count = fix->count;
+    if (object_string(&strs, INTERN_STR(fixes[x].file), fixes[x].file,
+		      &fixes[x].file) != 0) {
+      goto done;
+    }
+  }
+  for (x=0; x<hdr.numOps; x++) {
+    ops[x].code = relocs->code.ops[x].code;
+    ops[x].limLow = relocs->code.ops[x].limLow;
+    ops[x].limHigh = relocs->code.ops[x].limHigh;
+    ops[x].value = relocs->code.ops[x].value;
+    if ((ops[x].code == EXPR_SYMBOL) &&
+	(object_string(&strs, INTERN_STR(ops[x].value), ops[x].value,
+		       &ops[x].value) != 0)) {
+      goto done;
+    }
+  }
+  hdr.strSize = strs.len;
+
+  if ((handle = fopen(out, "wb")) == NULL) {
+    diag_printf(stderr, "ERROR - Could not open output file %s: %s\n", out,
+		strerror(errno));
+    goto done;
+  }
+  ok = (fwrite(&hdr, sizeof(hdr), 1, handle) == 1);
+  ok = ok && (fwrite(segs, sizeof(struct ObjectSegment), hdr.numSegs,
+		     handle) == hdr.numSegs);
+  ok = ok && (fwrite(syms, sizeof(struct ObjectSymbol), hdr.numSyms,
+		     handle) == hdr.numSyms);
+  ok = ok && ((hdr.numRelocs == 0) ||
+	      (fwrite(fixes, sizeof(struct Fixup), hdr.numRelocs,
+		      handle) == hdr.numRelocs));
+  ok = ok && (fwrite(ops, sizeof(struct ExprOp), hdr.numOps,
+		     handle) == hdr.numOps);
+  for (x=0; ok && (x<hdr.numSegs); x++) {
+    ok = (fwrite(image->segs[x].data, 1, segs[x].len, handle) == segs[x].len);
+  }
+  ok = ok && (fwrite(strs.text, 1, strs.len, handle) == strs.len);
+  ok = (fclose(handle) == 0) && ok;
+  if (!ok) {
+    diag_printf(stderr, "ERROR - Could not write output file %s\n", out);
+  }
+
+ done:
+  free(segs);
+  free(syms);
+  free(order);
+  free(fixes);
+  free(ops);
+  free(strs.text);
+  symtab_clear(&strs.offsets);
+  return ok ? 0 : -1;
+}
+
+/* check a string offset lands inside a module's strings */
+#define OBJECT_STRING_OK(mod, off) ((off) < (mod)->hdr->strSize)
+
+/* check a relocation's ops leave exactly one value, never taking
+ * more off the stack than is on it */
+static int object_check_ops(const struct ExprOp *ops, uint32_t first,
+			    uint32_t count) {
+  uint32_t x;
+  int depth = 0;
+
+  for (x=first; x<first+count; x++) {
+    switch (ops[x].code) {
+    case EXPR_CONST:
+    case EXPR_SYMBOL:
+      depth += 1;
+      break;
+    case EXPR_NEG:
+    case EXPR_NOT:
+      if (depth < 1) {
+	return -1;
+      }
+      break;
+    default:
+      if ((ops[x].code > EXPR_OR) || (depth < 2)) {
+	return -1;
+      }
+      depth -= 1;
+      break;
+    }
+  }
+  return (depth == 1) ? 0 : -1;
+}
+
+/* read an object file and find its parts, with the names its ops
+ * and relocations use turned back into ids */
+static int object_read(struct ObjectModule *mod) {
+  struct ObjectHeader *hdr;
+  struct Fixup *fix;
+  struct stat info;
+  FILE *handle;
+  UINT64 expect, end;
+  char *p;
+  uint32_t x, y;
+
+  if ((handle = fopen(mod->name, "rb")) == NULL) {
+    diag_printf(stderr, "ERROR - Could not open object file %s\n", mod->name);
+    return -1;
+  }
+  if ((fstat(fileno(handle), &info) != 0) ||
+      (info.st_size < (off_t)sizeof(struct ObjectHeader)) ||
+      ((mod->data = MALLOC_BYTES(info.st_size)) == NULL) ||
+      (fread(mod->data, 1, info.st_size, handle) != (size_t)info.st_size)) {
+    diag_printf(stderr, "ERROR - Could not read object file %s\n", mod->name);
+    fclose(handle);
+    return -1;
+  }
+  fclose(handle);
+
+  /* check it is ours, with the same layout, and all there */
+  hdr = mod->hdr = (struct ObjectHeader*)mod->data;
+  expect = sizeof(struct ObjectHeader) +
+    (UINT64)hdr->numSegs * sizeof(struct ObjectSegment) +
+    (UINT64)hdr->numSyms * sizeof(struct ObjectSymbol) +
+    (UINT64)hdr->numRelocs * sizeof(struct Fixup) +
+    (UINT64)hdr->numOps * sizeof(struct ExprOp) +
+    hdr->codeSize + hdr->strSize;
+  if ((memcmp(hdr->magic, OBJECT_MAGIC, 8) != 0) ||
+      (hdr->version != OBJECT_VERSION) ||
+      (hdr->fixupSize != sizeof(struct Fixup)) ||
+      (hdr->opSize != sizeof(struct ExprOp)) ||
+      (expect != (UINT64)info.st_size) ||
+      ((hdr->strSize > 0) && (mod->data[info.st_size - 1] != '\0'))) {
+    diag_printf(stderr, "ERROR - %s is not an object file, or is from "
+		"another version\n", mod->name);
+    return -1;
+  }
+
+  p = mod->data + sizeof(struct ObjectHeader);
+  mod->segs = (struct ObjectSegment*)p;
+  p += hdr->numSegs * sizeof(struct ObjectSegment);
+  mod->syms = (struct ObjectSymbol*)p;
+  p += hdr->numSyms * sizeof(struct ObjectSymbol);
+  mod->relocs = (struct Fixup*)p;
+  p += hdr->numRelocs * sizeof(struct Fixup);
+  mod->ops = (struct ExprOp*)p;
+  p += hdr->numOps * sizeof(struct ExprOp);
+  mod->code = p;
+  p += hdr->codeSize;
+  mod->strings = p;
+
+  /* nothing may point outside the file */
+  for (x=0, end=0; x<hdr->numSegs; x++) {
+    end += mod->segs[x].len;
+    if (((UINT64)mod->segs[x].base + mod->segs[x].len > hdr->size) ||
+	(end > hdr->codeSize)) {
+      goto bad;
+    }
+  }
+  for (x=0; x<hdr->numSyms; x++) {
+    if (!OBJECT_STRING_OK(mod, mod->syms[x].name) ||
+	((mod->syms[x].strVal != OBJECT_NO_STRING) &&
+	 !OBJECT_STRING_OK(mod, mod->syms[x].strVal))) {
+      goto bad;
+    }
+  }
+  for (x=0; x<hdr->numRelocs; x++) {
+    fix = &mod->relocs[x];
+    if (((UINT64)fix->first + fix->count > hdr->numOps) ||
+	(object_check_ops(mod->ops, fix->first, fix->count) != 0) ||
+	(fix->num_fields > MAX_ASM_ARGS) || (fix->byte_count > 4) ||
+	(fix->width > 32) || !OBJECT_STRING_OK(mod, fix->file) ||
+	((UINT64)fix->offset + fix->byte_count > hdr->size)) {
+      goto bad;
+    }
+    for (y=0; y<fix->num_fields; y++) {
+      if (fix->fieldOffset[y] >= 32) {
+	goto bad;
+      }
+    }
+    p = &mod->strings[fix->file];
+    if ((fix->file = intern_string(p, strlen(p))) == INTERN_NONE) {
+      return -1;
+    }
+  }
+  for (x=0; x<hdr->numOps; x++) {
+    if (mod->ops[x].code == EXPR_SYMBOL) {
+      if (!OBJECT_STRING_OK(mod, mod->ops[x].value)) {
+	goto bad;
+      }
+      p = &mod->strings[mod->ops[x].value];
+      if ((mod->ops[x].value = intern_string(p, strlen(p))) == INTERN_NONE) {
+	return -1;
+      }
+    }
+  }
+  return 0;
+
+ bad:
+  diag_printf(stderr, "ERROR - Object file %s is damaged\n", mod->name);
+  return -1;
+}
+
+/* put a module's code in the image at its base, and its symbols in
+ * its own table and the program's. names defined more than once go
+ * in dups, so using them can be refused */
+static int object_place(struct ObjectModule *mod, struct SymTab **prgSyms,
+			struct SymTab **dups, struct Image *image) {
+  struct ObjectSymbol *sym;
+  const char *name, *code = mod->code;
+  char *out;
+  uint32_t x, id;
+  int value;
+
+  for (x=0; x<mod->hdr->numSegs; x++) {
+    if ((out = image_span(image, mod->base + mod->segs[x].base,
+			  mod->segs[x].len)) == NULL) {
+      return -1;
+    }
+    memcpy(out, code, mod->segs[x].len);
+    code += mod->segs[x].len;
+  }
+
+  symtab_reserve(&mod->table, mod->hdr->numSyms);
+  for (x=0; x<mod->hdr->numSyms; x++) {
+    sym = &mod->syms[x];
+    name = &mod->strings[sym->name];
+    if (strcmp(name, "$filesize") == 0) {
+      /* the program's is set once everything is placed */
+      continue;
+    }
+    id = intern_string(name, strlen(name));
+    value = sym->intVal;
+    if (sym->flags & OBJECT_SYM_LABEL) {
+      value += mod->base;
+    }
+    if (name[0] == '$') {
+      /* a setting, for the whole program */
+      if (symtab_record_id(prgSyms, id, (sym->strVal == OBJECT_NO_STRING) ?
+			   NULL : &mod->strings[sym->strVal], value) != 0) {
+	return -1;
+      }
+      continue;
+    }
+    if ((symtab_lookup_id(prgSyms, id, NULL, NULL) == 0) &&
+	(symtab_record_id(dups, id, NULL, 0) != 0)) {
+      return -1;
+    }
+    if ((symtab_record_id(&mod->table, id, NULL, value) != 0) ||
+	(symtab_record_id(prgSyms, id, NULL, value) != 0)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* bring in what a module's relocations use from other modules, then
+ * patch them into the image */
+static int object_relocate(struct ObjectModule *mod, struct SymTab **prgSyms,
+			   struct SymTab **dups, struct Image *image) {
+  struct FixupList fixups;
+  uint32_t x, id;
+  int value;
+
+  for (x=0; x<mod->hdr->numOps; x++) {
+    if (mod->ops[x].code != EXPR_SYMBOL) {
+      continue;
+    }
+    id = mod->ops[x].value;
+    if (symtab_lookup_id(&mod->table, id, NULL, NULL) == 0) {
+      continue;
+    }
+    if (symtab_lookup_id(dups, id, NULL, NULL) == 0) {
+      diag_printf(stderr, "ERROR - Symbol %s used by %s is defined by more "
+		  "than one module\n", INTERN_STR(id), mod->name);
+      return -1;
+    }
+    if (symtab_lookup_id(prgSyms, id, NULL, &value) != 0) {
+      diag_printf(stderr, "ERROR - Symbol %s used by %s is not defined by "
+		  "any module\n", INTERN_STR(id), mod->name);
+      return -1;
+    }
+    if (symtab_record_id(&mod->table, id, NULL, value) != 0) {
+      return -1;
+    }
+  }
+
+  for (x=0; x<mod->hdr->numRelocs; x++) {
+    mod->relocs[x].offset += mod->base;
+  }
+  memset(&fixups, 0, sizeof(fixups));
+  fixups.list = mod->relocs;
+  fixups.count = mod->hdr->numRelocs;
+  fixups.code.ops = mod->ops;
+  fixups.code.count = mod->hdr->numOps;
+  if (asmgen_resolve_fixups(&mod->table, &fixups, image) != 0) {
+    diag_printf(stderr, "ERROR - Could not relocate %s\n", mod->name);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * object_link
+ *    link count object files into one program, in the image and
+ * the program's symbol table, each module placed right after the
+ * one before it.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int object_link(char **names, int count, struct SymTab **prgSyms,
+		struct Image *image) {
+  struct ObjectModule *mods;
+  struct SymTab *dups = NULL;
+  UINT64 end = 0;
+  int x, ret = -1;
+
+  if ((mods = CALLOC(struct ObjectModule, count)) == NULL) {
+    diag_printf(stderr, "ERROR - Memory allocation failed\n");
+    return -1;
+  }
+  for (x=0; x<count; x++) {
+    mods[x].name = names[x];
+    if (object_read(&mods[x]) != 0) {
+      goto done;
+    }
+    mods[x].base = end;
+    end += mods[x].hdr->size;
+    if (end > 0xffffffffULL) {
+      diag_printf(stderr, "ERROR - Program too large once %s is placed\n",
+		  names[x]);
+      goto done;
+    }
+    DEBUG(1) printf("Placed %s at 0x%x\n", names[x], mods[x].base);
+    if (object_place(&mods[x], prgSyms, &dups, image) != 0) {
+      goto done;
+    }
+  }
+  symtab_record(prgSyms, "$filesize", NULL, end);
+
+  for (x=0; x<count; x++) {
+    if (object_relocate(&mods[x], prgSyms, &dups, image) != 0) {
+      goto done;
+    }
+  }
+  ret = 0;
+
+ done:
+  for (x=0; x<count; x++) {
+    free(mods[x].data);
+    symtab_clear(&mods[x].table);
+  }
+  free(mods);
+  symtab_clear(&dups);
+  return ret;
+}
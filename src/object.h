@@ -0,0 +1,53 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include "asm.h"
+
+/* extension of object files, as written by -c */
+#define OBJECT_SUFFIX "obj"
+
+/* header of a relocatable object file, followed by segments,
+ * symbols, relocations, their ops, the code bytes of each segment
+ * and the strings, in turn */
+#define OBJECT_MAGIC "CASPROBJ"
+#define OBJECT_VERSION 2
+struct ObjectHeader {
+  char     magic[8];
+  uint32_t version;
+  uint32_t fixupSize;		/* sizeof(struct Fixup), layout guard */
+  uint32_t opSize;		/* sizeof(struct ExprOp), likewise */
+  uint32_t size;		/* bytes the module spans, from 0 */
+  uint32_t numSegs;
+  uint32_t numSyms;
+  uint32_t numRelocs;
+  uint32_t numOps;
+  uint32_t codeSize;		/* bytes in all the segments */
+  uint32_t strSize;
+};
+
+/* code the module emits, at an offset from its start */
+struct ObjectSegment {
+  uint32_t base;
+  uint32_t len;
+};
+
+/* a symbol the module defines, all of which other modules can use */
+struct ObjectSymbol {
+  uint32_t name;		/* offset of name into strings */
+  uint32_t strVal;		/* offset of string value, OBJECT_NO_STRING if none */
+  int32_t  intVal;
+  uint32_t flags;
+};
+#define OBJECT_NO_STRING 0xffffffff
+
+/* symbol flags */
+#define OBJECT_SYM_LABEL 1	/* an offset, moves with the module */
+
+/* prototypes */
+
+int object_write(struct SymTab **curSyms, struct Image *image,
+		 struct FixupList *relocs, char *out);
+int object_link(char **names, int count, struct SymTab **prgSyms,
+		struct Image *image);
+
+#endif
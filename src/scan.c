@@ -1,19 +1,372 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "scan.h"
-
-/* actions to take on the current buffered character */
-typedef enum
-  { SAVE, TRASH, RETURN }
-ChAction;
+#include "diag.h"
 
 /* states in state machine */
 typedef enum
   { START, COMMENT, IDENT, IDLIMIT1, IDLIMIT2, NUMER_DEC,
-    NUMER_OCT, NUMER_HEX, FORMAT, SUBFORMAT, DONE }
+    NUMER_OCT, NUMER_HEX, FORMAT, SUBFORMAT, STRING, SHIFT_LEFT,
+    SHIFT_RIGHT, DONE, NUM_STATES }
 StateType;
 
+/* classes of characters, the machine treats all of a class alike */
+typedef enum
+  { C_OTHER, C_SPACE, C_CR, C_NEWLINE, C_ZERO, C_ONE, C_OCTAL,
+    C_DIGIT, C_HEXALPHA, C_X, C_ALPHA, C_UNDER, C_DOT, C_SEMI,
+    C_LBRACE, C_RBRACE, C_DOLLAR, C_QUOTE, C_LPAREN, C_RPAREN,
+    C_MINUS, C_OP, C_LESS, C_GREATER, C_COLON, C_COMMA, NUM_CLASSES }
+CharClass;
+
+/* what to do with a character, besides moving to the next state */
+#define ACT_SAVE	0x001	/* add it to the token, lower case */
+#define ACT_RAW		0x002	/* add it to the token as is */
+#define ACT_RETURN	0x004	/* push it back for the next token */
+#define ACT_LINE	0x008	/* count a line */
+#define ACT_DIGIT	0x010	/* add it to the value being read */
+#define ACT_MARK	0x020	/* a bit limit starts, the name ends here */
+#define ACT_LOW		0x040	/* lower end of a bit limit read */
+#define ACT_HEX		0x080	/* '$', save a "0x" instead */
+#define ACT_COMMENT	0x100	/* skip the rest of a comment */
+#define ACT_BLANK	0x200	/* skip any more blanks */
+#define ACT_RUN		0x400	/* take any more characters moving the same way */
+
+/* leave the token type as it is */
+#define TYPE_KEEP 0xff
+
+/* one transition of the machine */
+struct ScanMove {
+  uint8_t  next;		/* state after this character */
+  uint8_t  type;		/* token type from here on, or TYPE_KEEP */
+  uint16_t action;		/* ACT_ flags */
+};
+
+/* the machine, built once by scan_build */
+static uint8_t scan_class[256];		/* class of each character */
+static char scan_fold[256];		/* each character in lower case */
+static uint8_t scan_digit[256];		/* value of each digit */
+static uint8_t scan_base[NUM_STATES];	/* radix of numbers read there */
+static struct ScanMove scan_moves[NUM_STATES][NUM_CLASSES];
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+#define CL(c) ((uint32_t)1 << (c))
+#define CL_ALL (CL(NUM_CLASSES) - 1)
+#define CL_DIGITS (CL(C_ZERO) | CL(C_ONE) | CL(C_OCTAL) | CL(C_DIGIT))
+#define CL_LETTERS (CL(C_HEXALPHA) | CL(C_X) | CL(C_ALPHA))
+
+/* put each of the characters in a class */
+static void scan_class_of(const char *chars, CharClass class) {
+  for (; *chars != '\0'; chars++) {
+    scan_class[(unsigned char)*chars] = class;
+  }
+}
+
+/* set the moves out of a state on each of a set of classes */
+static void scan_rule(StateType state, uint32_t classes, StateType next,
+		      int action, int type) {
+  int x;
+
+  for (x=0; x<NUM_CLASSES; x++) {
+    if (classes & CL(x)) {
+      scan_moves[state][x].next = next;
+      scan_moves[state][x].type = type;
+      scan_moves[state][x].action = action;
+    }
+  }
+}
+
+/* fill in the class tables and the machine, later rules for a state
+ * override earlier ones */
+static void scan_build(void) {
+  int x;
+
+  for (x=0; x<256; x++) {
+    scan_class[x] = C_OTHER;
+    scan_fold[x] = (char)x;
+  }
+  for (x=0; x<26; x++) {
+    scan_class['a' + x] = scan_class['A' + x] = (x < 6) ? C_HEXALPHA : C_ALPHA;
+    scan_fold['A' + x] = 'a' + x;
+    scan_digit['a' + x] = scan_digit['A' + x] = 10 + x;
+  }
+  for (x=0; x<10; x++) {
+    scan_class['0' + x] = (x < 2) ? C_ZERO + x : (x < 8) ? C_OCTAL : C_DIGIT;
+    scan_digit['0' + x] = x;
+  }
+  scan_class_of("xX", C_X);
+  scan_class_of(" \t\v\f", C_SPACE);
+  scan_class_of("\r", C_CR);
+  scan_class_of("\n", C_NEWLINE);
+  scan_class_of("_", C_UNDER);
+  scan_class_of(".", C_DOT);
+  scan_class_of(";", C_SEMI);
+  scan_class_of("{", C_LBRACE);
+  scan_class_of("}", C_RBRACE);
+  scan_class_of("$", C_DOLLAR);
+  scan_class_of("\"", C_QUOTE);
+  scan_class_of("(", C_LPAREN);
+  scan_class_of(")", C_RPAREN);
+  scan_class_of("-", C_MINUS);
+  scan_class_of("+*/%&|^~", C_OP);
+  scan_class_of("<", C_LESS);
+  scan_class_of(">", C_GREATER);
+  scan_class_of(":", C_COLON);
+  scan_class_of(",", C_COMMA);
+
+  scan_base[NUMER_DEC] = scan_base[IDLIMIT1] = scan_base[IDLIMIT2] = 10;
+  scan_base[NUMER_OCT] = 8;
+  scan_base[NUMER_HEX] = 16;
+
+  /* initial state, anything unknown is an error on its own */
+  scan_rule(START, CL_ALL, DONE, ACT_SAVE, TOK_ERROR);
+  scan_rule(START, CL(C_SPACE) | CL(C_CR), START, ACT_BLANK, TYPE_KEEP);
+  scan_rule(START, CL_LETTERS, IDENT, ACT_SAVE | ACT_RUN, TOK_IDENT);
+  scan_rule(START, CL(C_DOT), IDENT, ACT_SAVE | ACT_RUN, TOK_DIRECTIVE);
+  scan_rule(START, CL(C_ZERO), NUMER_OCT, ACT_SAVE | ACT_DIGIT | ACT_RUN,
+	    TOK_INT);
+  scan_rule(START, CL(C_ONE) | CL(C_OCTAL) | CL(C_DIGIT), NUMER_DEC,
+	    ACT_SAVE | ACT_DIGIT | ACT_RUN, TOK_INT);
+  scan_rule(START, CL(C_DOLLAR), NUMER_HEX, ACT_HEX | ACT_SAVE, TOK_INT);
+  scan_rule(START, CL(C_SEMI), COMMENT, ACT_COMMENT, TYPE_KEEP);
+  scan_rule(START, CL(C_LBRACE), FORMAT, 0, TOK_ERROR);
+  scan_rule(START, CL(C_QUOTE), STRING, 0, TOK_ERROR);
+  scan_rule(START, CL(C_NEWLINE), DONE, ACT_SAVE | ACT_LINE, TOK_ENDL);
+  scan_rule(START, CL(C_LPAREN), DONE, ACT_SAVE, TOK_LPAREN);
+  scan_rule(START, CL(C_RPAREN), DONE, ACT_SAVE, TOK_RPAREN);
+  scan_rule(START, CL(C_COMMA), DONE, ACT_SAVE, TOK_COMMA);
+  scan_rule(START, CL(C_MINUS) | CL(C_OP), DONE, ACT_SAVE, TOK_ARITHOP);
+  scan_rule(START, CL(C_LESS), SHIFT_LEFT, ACT_SAVE, TOK_ERROR);
+  scan_rule(START, CL(C_GREATER), SHIFT_RIGHT, ACT_SAVE, TOK_ERROR);
+
+  /* comment, up to the end of the line */
+  scan_rule(COMMENT, CL_ALL, COMMENT, ACT_COMMENT, TYPE_KEEP);
+  scan_rule(COMMENT, CL(C_NEWLINE) | CL(C_CR), START, ACT_RETURN, TYPE_KEEP);
+
+  /* identifier or directive, a ':' makes it a label */
+  scan_rule(IDENT, CL_ALL, DONE, ACT_RETURN, TYPE_KEEP);
+  scan_rule(IDENT, CL_LETTERS | CL_DIGITS | CL(C_UNDER), IDENT,
+	    ACT_SAVE | ACT_RUN, TYPE_KEEP);
+  scan_rule(IDENT, CL(C_COLON), DONE, 0, TOK_LABEL);
+  scan_rule(IDENT, CL(C_LESS), IDLIMIT1, ACT_MARK | ACT_SAVE, TOK_ERROR);
+
+  /* bit limit of an identifier, <low-high>, anything else is an error */
+  scan_rule(IDLIMIT1, CL_ALL, DONE, ACT_SAVE, TYPE_KEEP);
+  scan_rule(IDLIMIT1, CL_DIGITS, IDLIMIT1, ACT_SAVE | ACT_DIGIT, TYPE_KEEP);
+  scan_rule(IDLIMIT1, CL(C_MINUS), IDLIMIT2, ACT_LOW | ACT_SAVE, TYPE_KEEP);
+  scan_rule(IDLIMIT2, CL_ALL, DONE, ACT_SAVE, TYPE_KEEP);
+  scan_rule(IDLIMIT2, CL_DIGITS, IDLIMIT2, ACT_SAVE | ACT_DIGIT, TYPE_KEEP);
+  scan_rule(IDLIMIT2, CL(C_GREATER), DONE, ACT_SAVE, TOK_IDENT_LIMIT);
+
+  /* integer literals, decimal, octal (leading 0) or hex (0x or $) */
+  scan_rule(NUMER_DEC, CL_ALL, DONE, ACT_RETURN, TYPE_KEEP);
+  scan_rule(NUMER_DEC, CL_DIGITS, NUMER_DEC, ACT_SAVE | ACT_DIGIT | ACT_RUN,
+	    TYPE_KEEP);
+  scan_rule(NUMER_OCT, CL_ALL, DONE, ACT_RETURN, TYPE_KEEP);
+  scan_rule(NUMER_OCT, CL(C_ZERO) | CL(C_ONE) | CL(C_OCTAL), NUMER_OCT,
+	    ACT_SAVE | ACT_DIGIT | ACT_RUN, TYPE_KEEP);
+  scan_rule(NUMER_OCT, CL(C_DIGIT), NUMER_OCT, ACT_SAVE, TOK_ERROR);
+  scan_rule(NUMER_OCT, CL(C_X), NUMER_HEX, ACT_SAVE, TYPE_KEEP);
+  scan_rule(NUMER_HEX, CL_ALL, DONE, ACT_RETURN, TYPE_KEEP);
+  scan_rule(NUMER_HEX, CL_DIGITS | CL(C_HEXALPHA), NUMER_HEX,
+	    ACT_SAVE | ACT_DIGIT | ACT_RUN, TYPE_KEEP);
+
+  /* { ... } format descriptor, bits and (n) subfields, may span lines */
+  scan_rule(FORMAT, CL_ALL, DONE, ACT_SAVE, TYPE_KEEP);
+  scan_rule(FORMAT, CL(C_SPACE) | CL(C_CR), FORMAT, 0, TYPE_KEEP);
+  scan_rule(FORMAT, CL(C_NEWLINE), FORMAT, ACT_LINE, TYPE_KEEP);
+  scan_rule(FORMAT, CL(C_ZERO) | CL(C_ONE), FORMAT, ACT_SAVE, TYPE_KEEP);
+  scan_rule(FORMAT, CL(C_LPAREN), SUBFORMAT, ACT_SAVE, TYPE_KEEP);
+  scan_rule(FORMAT, CL(C_RBRACE), DONE, 0, TOK_FORMAT);
+  scan_rule(SUBFORMAT, CL_ALL, DONE, ACT_SAVE, TYPE_KEEP);
+  scan_rule(SUBFORMAT, CL(C_SPACE) | CL(C_CR), SUBFORMAT, 0, TYPE_KEEP);
+  scan_rule(SUBFORMAT, CL(C_NEWLINE), SUBFORMAT, ACT_LINE, TYPE_KEEP);
+  scan_rule(SUBFORMAT, CL_DIGITS, SUBFORMAT, ACT_SAVE, TYPE_KEEP);
+  scan_rule(SUBFORMAT, CL(C_RPAREN), FORMAT, ACT_SAVE, TYPE_KEEP);
+
+  /* "..." string, kept as is, unterminated at the end of the line */
+  scan_rule(STRING, CL_ALL, STRING, ACT_RAW, TYPE_KEEP);
+  scan_rule(STRING, CL(C_QUOTE), DONE, 0, TOK_STRING);
+  scan_rule(STRING, CL(C_NEWLINE), DONE, ACT_RETURN, TYPE_KEEP);
+
+  /* second half of a shift operator, the same again */
+  scan_rule(SHIFT_LEFT, CL_ALL, DONE, ACT_RETURN, TYPE_KEEP);
+  scan_rule(SHIFT_LEFT, CL(C_LESS), DONE, ACT_SAVE, TOK_ARITHOP);
+  scan_rule(SHIFT_RIGHT, CL_ALL, DONE, ACT_RETURN, TYPE_KEEP);
+  scan_rule(SHIFT_RIGHT, CL(C_GREATER), DONE, ACT_SAVE, TOK_ARITHOP);
+}
+
+/*
+ * scan_attach
+ *    set up a scanner to read from the given file. regular files
+ * are mapped into memory whole, from the current file position on.
+ * anything else (pipes, terminals) is read in large blocks. should
+ * neither work, characters are read one at a time from the handle.
+ */
+void scan_attach(struct ScanData *data, FILE *handle) {
+  struct stat info;
+  long start;
+  void *map;
+
+  data->input = handle;
+  data->linecount = 1;
+  data->file = INTERN_EMPTY;
+  data->tokCount = 0;
+  data->replay = NULL;
+  data->replayEnd = NULL;
+  data->record = NULL;
+  data->buf = NULL;
+  data->pos = NULL;
+  data->end = NULL;
+  data->block = NULL;
+  data->mapLen = 0;
+  data->depth = 0;
+  data->once = NULL;
+  data->numOnce = 0;
+  data->sizeOnce = 0;
+  data->text = NULL;
+  data->textSize = 0;
+  pthread_once(&scan_once, scan_build);
+
+  if (handle == NULL) {
+    return;
+  }
+
+  /* try mapping it */
+  if ((fstat(fileno(handle), &info) == 0) && S_ISREG(info.st_mode) &&
+      (info.st_size > 0) && ((start = ftell(handle)) >= 0) &&
+      (start <= info.st_size)) {
+    map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE,
+	       fileno(handle), 0);
+    if (map != MAP_FAILED) {
+      data->buf = map;
+      data->pos = data->buf + start;
+      data->end = data->buf + info.st_size;
+      data->mapLen = info.st_size;
+      return;
+    }
+  }
+
+  /* otherwise read blocks, with room to keep one character before
+   * the block so the last one read can always be pushed back */
+  if ((data->block = MALLOC_BYTES(SCAN_BLOCK + 1)) != NULL) {
+    data->buf = data->block;
+    data->pos = data->block + 1;
+    data->end = data->block + 1;
+  }
+}
+
+/*
+ * scan_attach_text
+ *    set up a scanner to read len characters straight out of memory.
+ * the text is not copied, and must stay put until scan_detach.
+ */
+void scan_attach_text(struct ScanData *data, const char *text, size_t len) {
+  scan_attach(data, NULL);
+  data->buf = text;
+  data->pos = text;
+  data->end = text + len;
+}
+
+/*
+ * scan_name
+ *    give the input a name, which every token scanned from it
+ * carries for messages, and which files it names are found from.
+ * NULL names source that is not from a file.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int scan_name(struct ScanData *data, const char *name) {
+  if (name == NULL) {
+    name = SCAN_NO_NAME;
+  }
+  if ((data->file = intern_string(name, strlen(name))) == INTERN_NONE) {
+    data->file = INTERN_EMPTY;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * scan_detach
+ *    release the scanner's buffering. a mapped file is left
+ * positioned just past the last character scanned.
+ */
+void scan_detach(struct ScanData *data) {
+  if (data->mapLen != 0) {
+    fseek(data->input, data->pos - data->buf, SEEK_SET);
+    munmap((void*)data->buf, data->mapLen);
+  }
+  free(data->block);
+  free(data->once);
+  free(data->text);
+  data->buf = NULL;
+  data->pos = NULL;
+  data->end = NULL;
+  data->block = NULL;
+  data->mapLen = 0;
+  data->depth = 0;
+  data->once = NULL;
+  data->numOnce = 0;
+  data->sizeOnce = 0;
+  data->text = NULL;
+  data->textSize = 0;
+}
+
+/* refill the read block, keeping the last character read */
+static int scan_fill(struct ScanData *data) {
+  size_t count;
+
+  if (data->block == NULL) {
+    /* mapped input or text is simply done, unbuffered falls back
+     * to stdio */
+    return ((data->mapLen != 0) || (data->input == NULL)) ? EOF :
+      fgetc(data->input);
+  }
+
+  data->block[0] = data->end[-1];
+  count = fread(data->block + 1, 1, SCAN_BLOCK, data->input);
+  data->pos = data->block + 1;
+  data->end = data->block + 1 + count;
+  if (count == 0) {
+    return EOF;
+  }
+  return (unsigned char)*data->pos++;
+}
+
+/* make room for a longer token, returning where it now is */
+static char *scan_grow(struct ScanData *data) {
+  unsigned int newsize;
+  char *newtext;
+
+  newsize = (data->textSize == 0) ? MAX_TOKLEN : 2*data->textSize;
+  if ((newtext = REALLOC(data->text, newsize)) == NULL) {
+    diag_printf(stderr, "ERROR - Out of memory for a token\n");
+    return NULL;
+  }
+  data->text = newtext;
+  data->textSize = newsize;
+  return newtext;
+}
+
+/* where the comment being skipped ends, at the next line terminator
+ * or else the end of what is buffered */
+static const char *scan_comment_end(const char *p, const char *end) {
+  const char *nl, *cr;
+
+  if (p == end) {
+    return p;
+  }
+  if ((nl = memchr(p, '\n', end - p)) == NULL) {
+    nl = end;
+  }
+  cr = memchr(p, '\r', nl - p);
+  return (cr != NULL) ? cr : nl;
+}
+
 /*
  * Primary Scanner Function - scan_token
  *
@@ -27,338 +380,159 @@ StateType;
 TokenType scan_token(struct Token *inToken, struct ScanData *data) {
   
   /* local function variables */
-  StateType curState;		/* current state machine status/state */
-  ChAction chStatus;		/* what to do with this character */
+  const struct ScanMove *move;	/* what to do with this character */
+  const char *p, *end;		/* buffered characters left */
+  char *text;			/* token so far */
+  int state;			/* current state machine status/state */
+  int type;			/* type of token so far */
   int ch;			/* current character */
   int tIdx;			/* position in token */
+  int nameLen = 0;		/* length of name before a bit limit */
+  uint32_t acc = 0, low = 0;	/* value of digits read */
   
   /* sanity check for NULL pointers */
-  if ((inToken == NULL) || (data->input == NULL)) {
+  if ((inToken == NULL) || ((data->input == NULL) && (data->buf == NULL))) {
     return TOK_ERROR;
   }
   
   /* initialize scanner token and state machine */
-  inToken->type = TOK_EOF;	/* this will be an EOF if nothing read */
+  type = TOK_EOF;		/* this will be an EOF if nothing read */
   tIdx = 0;			/* position in string token */
-  curState = START;		/* start state machine */
-  
-  /* set token bit limits */
-  inToken->limLow = 0;
-  inToken->limHigh = 8*sizeof(inToken->value)-1;
+  state = START;		/* start state machine */
+  text = data->text;
+  p = data->pos;
+  end = data->end;
   
   /*
    * Main Scanner Loop (state machine)
    *   [ implementation of discrete finite state autonoma ]
    *
-   * loop until machine is in DONE state or, scanner is out
-   * of token buffer space.
+   * each character is looked up by its class in the move table,
+   * until the machine is in DONE state.
    */
-  while ((curState != DONE) && (tIdx < (MAX_TOKLEN - 1)))  {
-    
-    /* grab next character if able */
-    ch = fgetc(data->input);		/* read next character */
-    chStatus = SAVE;		/* set save status on character */
+  while (1) {
     
-    /* if uppercase, switch to lower */
-    if (isupper(ch)) {
-      ch = tolower(ch);
+    /* room for what one character can add, and a terminator */
+    if ((tIdx + 3 > (int)data->textSize) && ((text = scan_grow(data)) == NULL)) {
+      data->pos = p;
+      inToken->type = TOK_ERROR;
+      inToken->str = INTERN_EMPTY;
+      return TOK_ERROR;
     }
     
-    /* if we hit EOF, set DONE state, and kick out */
-    if (ch == EOF) {
-      curState = DONE;
-      continue;
+    /* grab next character if able, stopping at EOF */
+    if (p < end) {
+      ch = (unsigned char)*p++;
     }
-
-    /* traverse states */
-    switch (curState) {
-
-    case START:			/* initial state */
-
-      /* decide what sort of character this is */
-      if (isspace(ch) && (ch != '\n')) {
-	/* this is whitespace, throw it away */
-	chStatus = TRASH;
-	curState = START;
-      }
-      else if (isalpha(ch)) {
-	/* alphabetic character - start of identifier */
-	inToken->type = TOK_IDENT;
-	curState = IDENT;
-      }
-      else if (ch == '0') {
-	/* starts with zero, octal number */
-	inToken->type = TOK_INT;
-	curState = NUMER_OCT;
-      }	
-      else if (isdigit(ch)) {
-	/* numerical value - start of integer literal */
-	inToken->type = TOK_INT;
-	curState = NUMER_DEC;
-      }
-      
-      /*
-       * the big multicharacter tests didn't claim this character,
-       * so use a switch to determine what sort of character this is
-       */
-      else switch(ch) {
-      case '.':
-	/* period - start of a assembly directive */
-	inToken->type = TOK_DIRECTIVE;
-	curState = IDENT;	/* piggy back off identifier logic */
-	break;
-      case ';':
-	/* semicolon, comment char */
-	curState = COMMENT;
+    else {
+      data->pos = p;
+      ch = scan_fill(data);
+      p = data->pos;
+      end = data->end;
+      if (ch == EOF) {
 	break;
-      case '{':
-	/* left brace, start of format descriptor */
-	inToken->type = TOK_ERROR;	/* only until it finishes */
-	chStatus = TRASH;
-	curState = FORMAT;
-	break;
-      case '\n':
-	/* newline (next line) */
-	inToken->type = TOK_ENDL;
-	curState = DONE;
-	data->linecount += 1;
-	break;
-      case '$':
-	/* specifier for a hex number,
-	 * ignore the '$', but replace it with a '0x' */
-	chStatus = TRASH;
-	curState = START;
-	ungetc('x',data->input);	/* tricky tricky */
-	ungetc('0',data->input);
-	break;
-      case '(':
-	/* left parentheses */
-	inToken->type = TOK_LPAREN;
-	curState = DONE;
-	break;
-      case ')':
-	/* right parentheses */
-	inToken->type = TOK_RPAREN;
-	curState = DONE;
-	break;
-      case '+':
-      case '-':
-	/* arithmetic operator */
-	inToken->type = TOK_ARITHOP;
-	curState = DONE;
-	break;
-	
-      default:
-	/* unhandled character */
-	inToken->type = TOK_ERROR;
-	curState = DONE;
-	break;
-      }
-      break;
-
-    case COMMENT:
-      /* comment state, stay here until line terminator */
-      if ((ch == '\n') || (ch == '\r')) {
-	/* end of comment */
-	curState = START;
-	tIdx = 0;
-	chStatus = RETURN;
       }
-      else {
-	chStatus = TRASH;		/* throw characters away */
-      }
-      break;
-
-    case IDENT:
-      /* part of an identifier, or possibly an assembly directive */
-      /* stay here reading alphabetic, numeric, and '_' characters */
-      if (ch == ':') {
-	/* ends up being a label */
-	inToken->type = TOK_LABEL;
-	chStatus = TRASH;
-	curState = DONE;
-      }
-      else if (ch == '<') {
-	/* beginning of identifier with a bit limit attached */
-	inToken->type = TOK_ERROR;	/* until completed */
-	curState = IDLIMIT1;
-      }
-      else if ((!isalnum(ch)) && (ch != '_')) {
-	/* not alphabetic, numeric, or a '_' */
-	chStatus = RETURN;	/* push back into stream */
-	curState = DONE;	/* we're done with this token */
+    }
+    
+    move = &scan_moves[state][scan_class[ch]];
+    state = move->next;
+    if (move->type != TYPE_KEEP) {
+      type = move->type;
+    }
+    
+    if (move->action != 0) {
+      /* numbers and bit limits are read as they go by */
+      if (move->action & ACT_MARK) {
+	nameLen = tIdx;
+	acc = 0;
       }
-      break;
-      
-    case IDLIMIT1:
-      /* part of an identifier with bit limit */
-      if (ch == '-') {
-	/* beginning of second part */
-	curState = IDLIMIT2;
+      if (move->action & ACT_LOW) {
+	low = acc;
+	acc = 0;
       }
-      else if (!isdigit(ch)) {
-	/* numbers or colons only here, bomb */
-	curState = DONE;
+      if (move->action & ACT_DIGIT) {
+	acc = acc * scan_base[state] + scan_digit[ch];
       }
-      break;
       
-    case IDLIMIT2:
-      /* part of an identifier with bit limit */
-      if (ch == '>') {
-	/* end of second part */
-	inToken->type = TOK_IDENT_LIMIT;
-	curState = DONE;
+      /* keep the character, push it back, or throw it away */
+      if (move->action & ACT_HEX) {
+	text[tIdx++] = '0';
+	ch = 'x';
       }
-      else if (!isdigit(ch)) {
-	/* numbers or colons only here, bomb */
-	curState = DONE;
+      if (move->action & ACT_SAVE) {
+	text[tIdx++] = scan_fold[ch];
       }
-      break;
-      
-    case NUMER_DEC:
-      /* part of an decimal integer literal */
-      /* stay here while reading numeric digit characters */
-      if (!isdigit(ch)) {
-	/* not a numeric digit */
-	chStatus = RETURN;		/* push back into stream */
-	curState = DONE;		/* we're done with this token */
-      }
-      break;
-      
-    case NUMER_OCT:
-      /* part of an octal integer literal */
-      /* stay here while reading numeric digit characters */
-      if (ch == 'x') {
-	/* hexadecimal number */
-	curState = NUMER_HEX;
+      else if (move->action & ACT_RAW) {
+	text[tIdx++] = (char)ch;
       }
-      else if (isdigit(ch)) {
-	if (ch > '7') {
-	  /* outside of octal range */
+      else if (move->action & ACT_RETURN) {
+	if (data->buf != NULL) {
+	  p -= 1;
+	}
+	else if (ungetc(ch, data->input) == EOF) {
+	  /* ungetc failed, this is extremely bad */
+	  diag_printf(stderr, "Cannot push back to stream\n");
 	  inToken->type = TOK_ERROR;
+	  return TOK_ERROR;
 	}
       }
-      else {
-	/* not a numeric digit */
-	chStatus = RETURN;		/* push back into stream */
-	curState = DONE;		/* we're done with this token */
-      }
-      break;
       
-    case NUMER_HEX:
-      /* part of an hexadecimal integer literal */
-      /* stay here while reading numeric digit characters */
-      if (!isxdigit(ch)) {
-	/* not a numeric digit */
-	chStatus = RETURN;		/* push back into stream */
-	curState = DONE;		/* we're done with this token */
-      }
-      break;
-      
-    case FORMAT:
-      /* part of a { ... } format descriptor */
-      if (ch == '\n') {
-	/* may hit one inside format, tick the counter */
-	chStatus = TRASH;
+      if (move->action & ACT_LINE) {
 	data->linecount += 1;
       }
-      else if (isspace(ch)) {
-	/* other whitespace .. ignore it and move on */
-	chStatus = TRASH;
-      } 
-      else if ((ch == '0') || (ch == '1')) {
-	/* binary bits will be added the returned packet */
-      }
-      else if (ch == '(') {
-	/* subfield start - ie "00 (2) 00" */
-	curState = SUBFORMAT;
-      }
-      else if (ch == '}') {
-	/* end of format descriptor */
-	inToken->type = TOK_FORMAT;
-	chStatus = TRASH;
-	curState = DONE;
-      }
-      else {
-	/* unknown character in expression */
-	curState = DONE;
-      }
-      break;
       
-    case SUBFORMAT:
-      /* part of a { ... } format descriptor */
-      if (ch == '\n') {
-	/* may hit one inside format, tick the counter */
-	chStatus = TRASH;
-	data->linecount += 1;
+      /* runs of blanks and comments need no trip through the table */
+      if (move->action & ACT_COMMENT) {
+	p = scan_comment_end(p, end);
       }
-      else if (isspace(ch)) {
-	/* other whitespace .. ignore it and move on */
-	chStatus = TRASH;
-      } 
-      else if (isdigit(ch)) {
-	/* decimal digits will be added to the returned packet */
-      }
-      else if (ch == ')') {
-	/* subfield end - ie "00 (2) 00" */
-	/* go back and finish the format */
-	curState = FORMAT;
+      else if (move->action & ACT_BLANK) {
+	while ((p < end) && (scan_class[(unsigned char)*p] == C_SPACE)) {
+	  p++;
+	}
       }
-      else {
-	/* unknown character in expression */
-	curState = DONE;
+      else if (move->action & ACT_RUN) {
+	while ((p < end) && (tIdx + 3 <= (int)data->textSize) &&
+	       (scan_moves[state][scan_class[(unsigned char)*p]].action ==
+		move->action)) {
+	  ch = (unsigned char)*p++;
+	  acc = acc * scan_base[state] + scan_digit[ch];
+	  text[tIdx++] = scan_fold[ch];
+	}
       }
-      break;
-      
-    default:
-      /* should always have a defined state, but just in case */
-      fprintf(stderr, "Invalid State in State Machine\n");
-      inToken->type = TOK_ERROR;
-      curState = DONE;
-      break;
-    }
-
-    /* current state processed, what did it say to do? */
-    if (chStatus == SAVE) {
-      /* save character to token */
-      inToken->token[tIdx] = (char)ch;	/* load into token */
-      tIdx += 1;				/* increment index */
     }
-    else if (chStatus == RETURN) {
-      /* return character to stream */
-      if (ungetc(ch,data->input) == EOF) {
-	/* ungetc failed, this is extremely bad */
-	fprintf(stderr,"Cannot push back to stream\n");
-	exit(1);
-      }
+    
+    if (state == DONE) {
+      break;
     }
-    /* if chStatus == TRASH, then this character is ignored */
   }
+  data->pos = p;
   
-  /* main loop terminates right above here, so once here, state
-     machine is done, and the token is almost formed */
-  
-  /* state machine is done, so terminate this token string */
-  inToken->token[tIdx] = '\0';
-  
-  /* set line for this token */
+  /* state machine is done, set the type and line for this token */
+  inToken->type = type;
+  inToken->file = data->file;
   inToken->linenum = data->linecount;
   
-  /* if this is an numerical integer, calculate its equivalent value */
-  if (inToken->type == TOK_INT) {
-    /* stdio to scan this for an integer value */
-    //sscanf(inToken->token,"%d",&(inToken->value));
-    inToken->value = (int)strtol(inToken->token, (char **)NULL, 0);
+  /* integers already have their value, as do bit limits, which
+   * are cut off the name */
+  inToken->value = (type == TOK_INT) ? (int)acc : -1;
+  if (type == TOK_IDENT_LIMIT) {
+    tIdx = nameLen;
+    inToken->type = TOK_IDENT;
+    inToken->limLow = low;
+    inToken->limHigh = acc;
   }
   else {
-    inToken->value = -1;
+    inToken->limLow = 0;
+    inToken->limHigh = 8*sizeof(inToken->value)-1;
   }
   
-  /* do bit limits if needed */
-  if (inToken->type == TOK_IDENT_LIMIT) {
-    chop_token_limits(inToken);
+  /* and its text, kept once for everyone */
+  if ((inToken->str = intern_string(text, tIdx)) == INTERN_NONE) {
+    inToken->type = TOK_ERROR;
+    inToken->str = INTERN_EMPTY;
   }
   
   /* return this token type */
+  STATS_COUNT(tokens, 1);
   return inToken->type;
 }
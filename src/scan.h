@@ -1,48 +1,118 @@
 #ifndef SCANNER_H
 #define SCANNER_H
 
+#include <pthread.h>
 #include "global.h"
+#include "intern.h"
 
 /* this is the enumerated type of what tokens are recognized */
 typedef enum {
   TOK_EOF, TOK_ERROR, TOK_IDENT, TOK_IDENT_LIMIT, TOK_LABEL,
   TOK_DIRECTIVE, TOK_INT, TOK_ENDL, TOK_FORMAT, TOK_LPAREN,
-  TOK_RPAREN, TOK_ARITHOP } TokenType;
+  TOK_RPAREN, TOK_ARITHOP, TOK_STRING, TOK_COMMA } TokenType;
 
-/* here is the generalized Token structure */
+/* here is the generalized Token structure, small enough to copy
+ * freely. its text is interned, see TOKSTR */
 struct Token {
-  TokenType type;		/* what type of token this is */
-  char token[MAX_TOKLEN];	/* the actual token string */
+  uint8_t type;			/* a TokenType, what sort of token this is */
+  uint8_t limLow;		/* lower end of bit limit */
+  uint8_t limHigh;		/* higher end of bit limit */
+  uint32_t str;			/* interned token string */
   int value;			/* relevant for integers only */
-  int linenum;			/* where the token is in the input */
-  int limLow;			/* lower end of bit limit */
-  int limHigh;			/* higher end of bit limit */
+  uint32_t file;		/* interned name of the file it is in */
+  int linenum;			/* where the token is in that file */
 };
 
-/* linked list stack of tokens for utility functions */
-struct StackNode {
-  struct Token token;
-  struct StackNode *next;
+/* the text of a token */
+#define TOKSTR(tok) INTERN_STR((tok)->str)
+
+/* where a token is, as the arguments to a "%s:%d" in a message */
+#define TOKPOS(tok) INTERN_STR((tok)->file), (tok)->linenum
+
+/* name given to source that is not from a file */
+#define SCAN_NO_NAME "<input>"
+
+/* depth of the pushed back token stack, more than the parser needs */
+#define SCAN_LOOKAHEAD 8
+
+/* growable array of tokens, to capture and later replay them */
+struct TokenStream {
+  struct Token *toks;
+  unsigned int count;
+  unsigned int size;
+};
+
+/* tokens of an included file still to be read */
+struct ScanFrame {
+  const struct Token *pos;
+  const struct Token *end;
 };
 
+/* how deep .include may nest */
+#define SCAN_MAX_INCLUDE 16
+
+/* size of read blocks when the input cannot be mapped */
+#define SCAN_BLOCK 65536
+
 /* stuff for scanner, for multiple instances */
 struct ScanData {
   FILE *input;
+  const char *buf;		/* start of mapped file or read block */
+  const char *pos;		/* next character to scan */
+  const char *end;		/* end of valid characters */
+  char *block;			/* read block, if not mapped */
+  size_t mapLen;		/* length of mapping, 0 if not mapped */
   unsigned int linecount;
-  struct StackNode *tokBuf;
+  uint32_t file;		/* interned name of the input, for tokens */
+  char *text;			/* token being scanned, grown as needed */
+  unsigned int textSize;
+  struct Token tokBuf[SCAN_LOOKAHEAD];	/* stack of pushed back tokens */
+  unsigned int tokCount;		/* tokens on the stack */
+  const struct Token *replay;	/* captured tokens to return instead */
+  const struct Token *replayEnd;
+  struct TokenStream *record;	/* if set, keep everything scanned */
+  struct ScanFrame frames[SCAN_MAX_INCLUDE];	/* open includes, innermost last */
+  unsigned int depth;		/* frames in use */
+  const char **once;		/* files included so far, never again */
+  unsigned int numOnce;
+  unsigned int sizeOnce;
 };
 
-#define SCANNER_INIT(ptr, handle) {(ptr)->input=handle; (ptr)->linecount = 1; (ptr)->tokBuf=NULL;}
-#define SCANNER_STOP(ptr) {clear_token_buffer((ptr)->tokBuf);}
+#define SCANNER_INIT(ptr, handle) {scan_attach((ptr), (handle));}
+#define SCANNER_INIT_TEXT(ptr, text, len) {scan_attach_text((ptr), (text), (len));}
+#define SCANNER_REPLAY(ptr, toks, n) {(ptr)->replay=(toks); (ptr)->replayEnd=(toks)+(n);}
+#define SCANNER_STOP(ptr) {clear_token_buffer(ptr); scan_detach(ptr);}
   
 /* actual scanner function (unbuffered) */
 TokenType scan_token(struct Token *inToken, struct ScanData *data);
 
+/* set up and tear down the scanner's input buffering */
+void scan_attach(struct ScanData *data, FILE *handle);
+void scan_attach_text(struct ScanData *data, const char *text, size_t len);
+void scan_detach(struct ScanData *data);
+int scan_name(struct ScanData *data, const char *name);
+
 /* utility/wrapper functions for scanner */
 TokenType get_token(struct Token *inToken, struct ScanData *data);
 int push_token(struct Token *inToken, struct ScanData *data);
 TokenType peek_token(struct ScanData *data);
-void clear_token_buffer(struct StackNode *data);
-int chop_token_limits(struct Token *tok);
+void clear_token_buffer(struct ScanData *data);
+int tokstream_append(struct TokenStream *stream, struct Token *inToken);
+void tokstream_free(struct TokenStream *stream);
+int scan_path(char *path, uint32_t from, const char *name);
+
+/* included files, tokenized once and shared by every scanner using
+ * the same cache. the command line has one for the process,
+ * embedders one per context, see include_attach */
+struct IncludeCache {
+  struct IncludeEntry *entries;
+  pthread_mutex_t lock;
+};
+
+int include_push(struct ScanData *data, const struct Token *name);
+void include_cache_init(struct IncludeCache *cache);
+void include_cache_free(struct IncludeCache *cache);
+struct IncludeCache *include_attach(struct IncludeCache *cache);
+void include_flush(void);
 
 #endif
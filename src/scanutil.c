@@ -11,34 +11,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include <limits.h>
 #include "scan.h"
+#include "diag.h"
 
 /*
  * push_token
  *    utility function to take the a pointer to a Token struct
- * and then create a cloned copy of it to use later. Memory
+ * and then copy it onto the scanner's stack to use later. Memory
  * passed to this function IS NOT claimed, local variables are
  * safe to pass.
  *
- * returns 0 on sucess, nonzero on failure
+ * returns 0 on sucess, nonzero on failure (stack full)
  */
 int push_token(struct Token *inToken, struct ScanData *data) {
-  struct StackNode *newnode;
   
-  /* allocate space for this token on the stack */
-  newnode = MALLOC(struct StackNode);
-
-  /* check for failed allocation */
-  if (newnode == NULL) {
-    /* allocation failure */
+  STATS_COUNT(pushes, 1);
+  
+  /* check for a full stack */
+  if (data->tokCount >= SCAN_LOOKAHEAD) {
     return -1;
   }
   
-  /* otherwise clone input node, and move onto stack */
-  memcpy((char*)(&(newnode->token)),(char*)inToken,sizeof(struct Token));
-  newnode->next = data->tokBuf;
-  data->tokBuf = newnode;
+  /* otherwise copy input token onto stack */
+  memcpy((char*)(&data->tokBuf[data->tokCount]),(char*)inToken,
+	 sizeof(struct Token));
+  data->tokCount += 1;
   
   /* success */
   return 0;
@@ -53,21 +51,52 @@ int push_token(struct Token *inToken, struct ScanData *data) {
  * returns type of token returned
  */
 TokenType get_token(struct Token *inToken, struct ScanData *data) {
-  struct StackNode *newnode;
-  
-  /* get top of stack */
-  newnode = data->tokBuf;
+  struct ScanFrame *frame;
   
   /* check empty stack */
-  if (newnode == NULL) {
-    /* empty stack, try scanning instead */
-    return scan_token(inToken, data);
+  if (data->tokCount == 0) {
+    /* finish any included files first, innermost out */
+    while ((data->depth > 0) &&
+	   (data->frames[data->depth - 1].pos ==
+	    data->frames[data->depth - 1].end)) {
+      data->depth -= 1;
+    }
+    if (data->depth > 0) {
+      frame = &data->frames[data->depth - 1];
+      memcpy((char*)inToken,(char*)frame->pos,sizeof(struct Token));
+      frame->pos += 1;
+    }
+    
+    /* else replay captured tokens if there are any */
+    else if (data->replay != NULL) {
+      if (data->replay == data->replayEnd) {
+	inToken->type = TOK_EOF;
+	inToken->str = INTERN_EMPTY;
+	return TOK_EOF;
+      }
+      memcpy((char*)inToken,(char*)data->replay,sizeof(struct Token));
+      data->replay += 1;
+      return inToken->type;
+    }
+    
+    /* otherwise try scanning instead */
+    else if (scan_token(inToken, data) == TOK_EOF) {
+      return TOK_EOF;
+    }
+    
+    /* keeping a copy if asked */
+    if ((data->record != NULL) &&
+	(tokstream_append(data->record, inToken) != 0)) {
+      diag_printf(stderr, "Cannot record token, out of memory\n");
+      inToken->type = TOK_ERROR;
+    }
+    return inToken->type;
   }
   
-  /* otherwise pull token and copy contents */
-  memcpy((char*)inToken,(char*)(&(newnode->token)),sizeof(struct Token));
-  data->tokBuf = newnode->next;
-  free(newnode);	/* delete this node */
+  /* otherwise pull token off the top of the stack */
+  data->tokCount -= 1;
+  memcpy((char*)inToken,(char*)(&data->tokBuf[data->tokCount]),
+	 sizeof(struct Token));
 
   /* success */
   return inToken->type;
@@ -81,66 +110,80 @@ TokenType get_token(struct Token *inToken, struct ScanData *data) {
  * returns type of token to be read next
  */
 TokenType peek_token(struct ScanData *data) {
-  struct Token myToken;
+  
+  STATS_COUNT(peeks, 1);
   
   /* if the token is on the stack, this is easy */
-  if (data->tokBuf != NULL) {
-    return data->tokBuf->token.type;
+  if (data->tokCount != 0) {
+    return data->tokBuf[data->tokCount - 1].type;
   }
 
-  /* else get a copy of the next token */
-  (void)get_token(&myToken,data);
-  if (push_token(&myToken, data) != 0) {
-    /* cannot push back to stack, very bad */
-    fprintf(stderr,"Cannot push token back into buffer\n");
-    exit(1);
-  }
+  /* else read the next token straight onto the stack */
+  (void)get_token(&data->tokBuf[0], data);
+  data->tokCount = 1;
   
   /* return its type */
-  return myToken.type;
+  return data->tokBuf[0].type;
 }
 
-void clear_token_buffer(struct StackNode *data) {
-  struct StackNode *temp;
-  while (data != NULL) {
-    temp = data->next;
-    free(data);
-    data = temp;
-  }
+void clear_token_buffer(struct ScanData *data) {
+  data->tokCount = 0;
 }
 
-/* bit of a cheap hack to do this, but oh well */
-int chop_token_limits(struct Token *tok) {
-  int x, tokLen;
-  
-  if (tok->type != TOK_IDENT_LIMIT) {
-    return -1;
-  }
+/*
+ * tokstream_append
+ *    add a copy of a token to the end of a token stream, growing
+ * it as needed. a zeroed TokenStream is a valid empty stream.
+ *
+ * returns 0 on success, nonzero on allocation failure
+ */
+int tokstream_append(struct TokenStream *stream, struct Token *inToken) {
+  struct Token *newtoks;
+  unsigned int newsize;
   
-  tokLen = strlen(tok->token);
-  for (x=0; x<tokLen; x++) {
-    if ((!isalnum(tok->token[x])) &&
-	(tok->token[x] != '_')) {
-      tok->token[x] = '\0';
+  if (stream->count == stream->size) {
+    newsize = (stream->size == 0) ? 256 : 2*stream->size;
+    newtoks = REALLOC(stream->toks, newsize*sizeof(struct Token));
+    if (newtoks == NULL) {
+      return -1;
     }
+    stream->toks = newtoks;
+    stream->size = newsize;
   }
   
-  /* advance to first number */
-  x=0;
-  while (tok->token[x] != '\0') { x++; }
-  while (tok->token[x] == '\0') { x++; }
-  
-  /* scan first number */
-  tok->limLow = (int)strtol(&tok->token[x], (char **)NULL, 0);
-  
-  /* advance to second number */
-  while (tok->token[x] != '\0') { x++; }
-  while (tok->token[x] == '\0') { x++; }
-  
-  /* scan first number */
-  tok->limHigh = (int)strtol(&tok->token[x], (char **)NULL, 0);
-  tok->type = TOK_IDENT;
-  
+  memcpy((char*)(&stream->toks[stream->count]),(char*)inToken,
+	 sizeof(struct Token));
+  stream->count += 1;
   return 0;
 }
 
+void tokstream_free(struct TokenStream *stream) {
+  free(stream->toks);
+  stream->toks = NULL;
+  stream->count = 0;
+  stream->size = 0;
+}
+
+/*
+ * scan_path
+ *    find a file named in the input, such as by .include. a relative
+ * name is taken from the directory of the file it is named in (from,
+ * the file of its token), so the same source finds the same files
+ * wherever it is assembled from. path must hold PATH_MAX bytes.
+ *
+ * returns 0 on success, nonzero if the name is too long
+ */
+int scan_path(char *path, uint32_t from, const char *name) {
+  const char *dir, *slash;
+  int len;
+
+  dir = INTERN_STR(from);
+  slash = strrchr(dir, '/');
+  if ((name[0] == '/') || (slash == NULL)) {
+    len = snprintf(path, PATH_MAX, "%s", name);
+  }
+  else {
+    len = snprintf(path, PATH_MAX, "%.*s/%s", (int)(slash - dir), dir, name);
+  }
+  return ((len < 0) || (len >= PATH_MAX)) ? -1 : 0;
+}
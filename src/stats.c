@@ -0,0 +1,127 @@
+/*
+ * stats.c
+ *
+ * Counters and timers for --stats. Each thread counts into the
+ * Stats it has attached, if any, so programs assembled side by side
+ * are kept apart and the hot paths need no locking. Threads that
+ * help with one program count into their own and are merged after.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+__thread struct Stats *stats_cur = NULL;
+
+/* names of the phases, for reports */
+static const char *stats_phase_names[STATS_PHASES] =
+  { "arch", "pass1", "pass2", "output" };
+
+/* count into st from now on (NULL to stop), returning what this
+ * thread was counting into before */
+struct Stats *stats_attach(struct Stats *st) {
+  struct Stats *old = stats_cur;
+
+  stats_cur = st;
+  return old;
+}
+
+static double stats_clock(clockid_t id) {
+  struct timespec now;
+
+  clock_gettime(id, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void stats_start(struct StatsTimer *timer) {
+  timer->wall = stats_clock(CLOCK_MONOTONIC);
+  timer->cpu = stats_clock(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/* add the time since stats_start to a phase */
+void stats_stop(struct StatsTimer *timer, int phase) {
+  if (stats_cur == NULL) {
+    return;
+  }
+  stats_cur->wall[phase] += stats_clock(CLOCK_MONOTONIC) - timer->wall;
+  stats_cur->cpu[phase] += stats_clock(CLOCK_THREAD_CPUTIME_ID) - timer->cpu;
+}
+
+/* add a helper thread's counts in. wall time is left alone, the
+ * helpers ran during the owner's */
+void stats_merge(struct Stats *into, struct Stats *from) {
+  int x;
+
+  for (x=0; x<STATS_PHASES; x++) {
+    into->cpu[x] += from->cpu[x];
+  }
+  into->tokens += from->tokens;
+  into->pushes += from->pushes;
+  into->peeks += from->peeks;
+  into->symLookups += from->symLookups;
+  into->symProbes += from->symProbes;
+  into->asmLookups += from->asmLookups;
+  into->asmProbes += from->asmProbes;
+  into->allocs += from->allocs;
+}
+
+/* most memory the process has held, in KB */
+long stats_peak_rss(void) {
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return -1;
+  }
+  return usage.ru_maxrss;
+}
+
+/* write the phases and counters as JSON members, each line
+ * starting with indent */
+void stats_write_json(FILE *out, struct Stats *st, const char *indent) {
+  int x;
+
+  fprintf(out, "%s\"phases\": {\n", indent);
+  for (x=0; x<STATS_PHASES; x++) {
+    fprintf(out, "%s  \"%s\": { \"wall_s\": %.6f, \"cpu_s\": %.6f }%s\n",
+	    indent, stats_phase_names[x], st->wall[x], st->cpu[x],
+	    (x + 1 < STATS_PHASES) ? "," : "");
+  }
+  fprintf(out, "%s},\n", indent);
+  fprintf(out, "%s\"counters\": {\n", indent);
+  fprintf(out, "%s  \"tokens\": %lu,\n", indent, st->tokens);
+  fprintf(out, "%s  \"push_token\": %lu,\n", indent, st->pushes);
+  fprintf(out, "%s  \"peek_token\": %lu,\n", indent, st->peeks);
+  fprintf(out, "%s  \"symbol_lookups\": %lu,\n", indent, st->symLookups);
+  fprintf(out, "%s  \"symbol_avg_probe\": %.3f,\n", indent,
+	  st->symLookups ? (double)st->symProbes / st->symLookups : 0.0);
+  fprintf(out, "%s  \"mnemonic_lookups\": %lu,\n", indent, st->asmLookups);
+  fprintf(out, "%s  \"mnemonic_avg_probe\": %.3f,\n", indent,
+	  st->asmLookups ? (double)st->asmProbes / st->asmLookups : 0.0);
+  fprintf(out, "%s  \"allocations\": %lu\n", indent, st->allocs);
+  fprintf(out, "%s}", indent);
+}
+
+/* heap allocation, counted. used by the MALLOC family of macros,
+ * and STRDUP */
+void *stats_malloc(size_t size) {
+  STATS_COUNT(allocs, 1);
+  return malloc(size);
+}
+
+void *stats_calloc(size_t size, size_t count) {
+  STATS_COUNT(allocs, 1);
+  return calloc(size, count);
+}
+
+void *stats_realloc(void *ptr, size_t size) {
+  STATS_COUNT(allocs, 1);
+  return realloc(ptr, size);
+}
+
+char *stats_strdup(const char *str) {
+  STATS_COUNT(allocs, 1);
+  return strdup(str);
+}
@@ -0,0 +1,55 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* parts of an assembly that are timed */
+enum StatsPhase {
+  STATS_ARCH,			/* loading architectures */
+  STATS_PASS1,			/* labels, not counting the above */
+  STATS_PASS2,			/* encoding, cpu summed over threads */
+  STATS_OUTPUT,			/* writing the output file */
+  STATS_PHASES
+};
+
+/* costs of assembling one program */
+struct Stats {
+  double wall[STATS_PHASES];	/* seconds */
+  double cpu[STATS_PHASES];
+  unsigned long tokens;		/* tokens scanned */
+  unsigned long pushes;		/* push_token calls */
+  unsigned long peeks;		/* peek_token calls */
+  unsigned long symLookups;	/* symbol table searches */
+  unsigned long symProbes;	/* slots looked at by them */
+  unsigned long asmLookups;	/* mnemonic searches */
+  unsigned long asmProbes;	/* slots looked at by them */
+  unsigned long allocs;		/* heap allocations made (not by libc itself) */
+};
+
+/* start of something being timed */
+struct StatsTimer {
+  double wall;
+  double cpu;
+};
+
+/* what this thread is counting into, NULL if nothing */
+extern __thread struct Stats *stats_cur;
+
+#define STATS_COUNT(field, n) {if (stats_cur != NULL) {stats_cur->field += (n);}}
+
+/* prototypes */
+
+struct Stats *stats_attach(struct Stats *st);
+void stats_start(struct StatsTimer *timer);
+void stats_stop(struct StatsTimer *timer, int phase);
+void stats_merge(struct Stats *into, struct Stats *from);
+long stats_peak_rss(void);
+void stats_write_json(FILE *out, struct Stats *st, const char *indent);
+
+void *stats_malloc(size_t size);
+void *stats_calloc(size_t size, size_t count);
+void *stats_realloc(void *ptr, size_t size);
+char *stats_strdup(const char *str);
+
+#endif
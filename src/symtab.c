@@ -3,110 +3,342 @@
 #include <string.h>
 #include "symtab.h"
 #include "scan.h"
+#include "diag.h"
+
+/* copy a string value into the table's pool, returning the stable
+ * copy or NULL if out of memory */
+static const char *symtab_store(struct SymTab *tab, const char *str) {
+  struct SymPool *block;
+  size_t len, size;
+  char *copy;
+
+  len = strlen(str) + 1;
+  block = tab->pool;
+  if ((block == NULL) || (block->size - block->used < len)) {
+    /* start a new block, big enough for oversized strings too */
+    size = (len > SYMTAB_POOL_BLOCK) ? len : SYMTAB_POOL_BLOCK;
+    if ((block = MALLOC_BYTES(sizeof(struct SymPool) + size)) == NULL) {
+      diag_printf(stderr, "FATAL - Could not allocate space\n");
+      return NULL;
+    }
+    block->used = 0;
+    block->size = size;
+    block->next = tab->pool;
+    tab->pool = block;
+  }
+
+  copy = &block->data[block->used];
+  memcpy(copy, str, len);
+  block->used += len;
+  tab->poolUsed += len;
+  return copy;
+}
+
+/* copy every string value into one new block, dropping the copies
+ * left behind by redefinitions. nothing changes if out of memory */
+static void symtab_compact(struct SymTab *tab) {
+  struct SymPool *block, *temp;
+  struct SymEntry *slot;
+  size_t len, size = 0;
+  unsigned int x;
+
+  for (x=0; x<tab->size; x++) {
+    if (tab->slots[x].strVal != NULL) {
+      size += strlen(tab->slots[x].strVal) + 1;
+    }
+  }
+  if ((block = MALLOC_BYTES(sizeof(struct SymPool) + size)) == NULL) {
+    return;
+  }
+  block->used = 0;
+  block->size = size;
+  for (x=0; x<tab->size; x++) {
+    slot = &tab->slots[x];
+    if (slot->strVal != NULL) {
+      len = strlen(slot->strVal) + 1;
+      memcpy(&block->data[block->used], slot->strVal, len);
+      slot->strVal = &block->data[block->used];
+      block->used += len;
+    }
+  }
+
+  while (tab->pool != NULL) {
+    temp = tab->pool->next;
+    free(tab->pool);
+    tab->pool = temp;
+  }
+  block->next = NULL;
+  tab->pool = block;
+  tab->poolUsed = size;
+  tab->poolWaste = 0;
+}
+
+/* set an entry's string value. an equal value keeps its copy, one
+ * of the same length goes over it, and other old copies are counted
+ * as waste, which is reclaimed once it is most of the pool */
+static int symtab_set_string(struct SymTab *tab, struct SymEntry *slot,
+			     const char *str) {
+  size_t len, oldlen = 0;
+
+  len = (str != NULL) ? strlen(str) + 1 : 1;
+  if (slot->strVal != NULL) {
+    if (strcmp(slot->strVal, (str != NULL) ? str : "") == 0) {
+      return 0;
+    }
+    oldlen = strlen(slot->strVal) + 1;
+    if (len == oldlen) {
+      memcpy((char*)slot->strVal, str, len);
+      return 0;
+    }
+    tab->poolWaste += oldlen;
+    slot->strVal = NULL;
+  }
+
+  if ((len > 1) && ((slot->strVal = symtab_store(tab, str)) == NULL)) {
+    return -1;
+  }
+  if ((tab->poolWaste > SYMTAB_POOL_BLOCK) &&
+      (tab->poolWaste > tab->poolUsed / 2)) {
+    symtab_compact(tab);
+  }
+  return 0;
+}
+
+/* find the slot holding id, or the empty slot where it belongs */
+static struct SymEntry *symtab_probe(struct SymTab *tab, uint32_t id) {
+  unsigned int idx, mask = tab->size - 1;
+  struct SymEntry *slot;
+
+  STATS_COUNT(symLookups, 1);
+  for (idx = SYMTAB_HASH(id) & mask; ; idx = (idx + 1) & mask) {
+    STATS_COUNT(symProbes, 1);
+    slot = &tab->slots[idx];
+    if ((slot->name == NULL) || (slot->id == id)) {
+      return slot;
+    }
+  }
+}
+
+/* rehash all entries into a table of newsize slots */
+static int symtab_resize(struct SymTab *tab, unsigned int newsize) {
+  struct SymEntry *old, *slot;
+  struct Stats *saved;
+  unsigned int x, oldsize;
+
+  old = tab->slots;
+  oldsize = tab->size;
+  if ((tab->slots = CALLOC(struct SymEntry, newsize)) == NULL) {
+    diag_printf(stderr, "FATAL - Could not allocate space\n");
+    tab->slots = old;
+    return -1;
+  }
+  tab->size = newsize;
+
+  /* moving entries is not looking anything up */
+  saved = stats_attach(NULL);
+  for (x=0; x<oldsize; x++) {
+    if (old[x].name != NULL) {
+      slot = symtab_probe(tab, old[x].id);
+      *slot = old[x];
+    }
+  }
+  stats_attach(saved);
+  free(old);
+  return 0;
+}
 
 int symtab_clear(struct SymTab **curSyms) {
-  struct SymTab *temp;
-  
+  struct SymPool *temp;
+
   /* sanity check */
   if (curSyms == NULL) {
     return -1;
   }
-  
-  while (*curSyms != NULL) {
-    temp = (*curSyms)->next;
+
+  if (*curSyms != NULL) {
+    while ((*curSyms)->pool != NULL) {
+      temp = (*curSyms)->pool->next;
+      free((*curSyms)->pool);
+      (*curSyms)->pool = temp;
+    }
+    free((*curSyms)->slots);
     free(*curSyms);
-    *curSyms = temp;
+    *curSyms = NULL;
   }
-  
+
   return 0;
 }
 
-int symtab_record(struct SymTab **curSyms, char *name, char *strVal, int intVal) {
-  struct SymTab *newsym, *loop;
-  
+/* make room for count symbols without any further rehashing */
+int symtab_reserve(struct SymTab **curSyms, unsigned int count) {
+  struct SymTab *tab;
+  unsigned int size;
+
   /* sanity check */
-  if ((curSyms == NULL) || (name == NULL)){
+  if (curSyms == NULL) {
     return -1;
   }
-  
-  for (loop = *curSyms; loop != NULL; loop = loop->next) {
-    if (strcmp(loop->name, name)==0) {
-      /* already exists, overwrite */
-      loop->intVal = intVal;
-      if (strVal != NULL) {
-	strcpy(loop->strVal, strVal);
-      }
-      else {
-	loop->strVal[0] = '\0';
-      }
-      return 0;
+
+  /* keep load factor under 3/4 */
+  for (size = SYMTAB_MIN_SIZE; size - size/4 <= count; size <<= 1) { }
+
+  if (*curSyms == NULL) {
+    /* first use, set up an empty table */
+    if ((tab = MALLOC(struct SymTab)) == NULL) {
+      diag_printf(stderr, "FATAL - Could not allocate space\n");
+      return -1;
     }
+    tab->slots = NULL;
+    tab->size = 0;
+    tab->count = 0;
+    tab->pool = NULL;
+    tab->poolUsed = 0;
+    tab->poolWaste = 0;
+    *curSyms = tab;
   }
-  
-  /* not found, record new */
-  if ((newsym = MALLOC(struct SymTab)) == NULL) {
-    /* allocation error */
-    fprintf(stderr, "FATAL - Could not allocate space\n");
-    exit(-1);
+
+  if ((*curSyms)->size < size) {
+    return symtab_resize(*curSyms, size);
   }
-  
-  /* record and add into list */
-  strcpy(newsym->name, name);
-  newsym->intVal = intVal;
-  if (strVal != NULL) {
-    strcpy(newsym->strVal, strVal);
+  return 0;
+}
+
+/*
+ * symtab_record_id
+ *    set a symbol's value, by the interned id of its name, adding
+ * it if it is new.
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int symtab_record_id(struct SymTab **curSyms, uint32_t id, char *strVal,
+		     int intVal) {
+  struct SymEntry *slot;
+
+  /* sanity check */
+  if ((curSyms == NULL) || (id == INTERN_NONE)){
+    return -1;
   }
-  else {
-    newsym->strVal[0] = '\0';
+
+  /* grow if this one might push us past the load factor */
+  if (((*curSyms == NULL) ||
+       ((*curSyms)->count + 1 > (*curSyms)->size - (*curSyms)->size/4)) &&
+      (symtab_reserve(curSyms,
+		      (*curSyms == NULL) ? 1 : 2*(*curSyms)->count) != 0)) {
+    return -1;
   }
-  newsym->next = *curSyms;
-  *curSyms = newsym;
 
-  return 0;
+  slot = symtab_probe(*curSyms, id);
+  if (slot->name == NULL) {
+    /* not found, record new */
+    slot->name = INTERN_STR(id);
+    slot->strVal = NULL;
+    slot->id = id;
+    (*curSyms)->count += 1;
+  }
+
+  /* new or already existing, (over)write value */
+  slot->intVal = intVal;
+  return symtab_set_string(*curSyms, slot, strVal);
 }
 
-int symtab_lookup(struct SymTab **curSyms, char *name, char *strOut, int *intOut) {
-  struct SymTab *loop;
-  
+int symtab_record(struct SymTab **curSyms, char *name, char *strVal, int intVal) {
   /* sanity check */
-  if ((curSyms == NULL) || (name == NULL)){
+  if (name == NULL) {
     return -1;
   }
-  
-  for (loop = *curSyms; loop != NULL; loop = loop->next) {
-    if (strcmp(loop->name, name)==0) {
-      if (intOut != NULL) {
-	*intOut = loop->intVal;
-      }
-      if (strOut != NULL) {
-	strcpy(strOut, loop->strVal);
-      }
-      return 0;
-    }
+  return symtab_record_id(curSyms, intern_string(name, strlen(name)),
+			  strVal, intVal);
+}
+
+/*
+ * symtab_lookup_id
+ *    find a symbol by the interned id of its name, copying out its
+ * values where asked to.
+ *
+ * returns 0 if found, nonzero if not
+ */
+int symtab_lookup_id(struct SymTab **curSyms, uint32_t id, char *strOut,
+		     int *intOut) {
+  struct SymEntry *slot;
+
+  /* sanity check */
+  if ((curSyms == NULL) || (id == INTERN_NONE)){
+    return -1;
+  }
+
+  /* nothing recorded yet */
+  if ((*curSyms == NULL) || ((*curSyms)->count == 0)) {
+    return -1;
+  }
+
+  slot = symtab_probe(*curSyms, id);
+  if (slot->name == NULL) {
+    /* not found */
+    return -1;
+  }
+
+  if (intOut != NULL) {
+    *intOut = slot->intVal;
   }
-  
-  /* not found */
-  return -1;
+  if (strOut != NULL) {
+    strcpy(strOut, (slot->strVal != NULL) ? slot->strVal : "");
+  }
+  return 0;
+}
+
+int symtab_lookup(struct SymTab **curSyms, char *name, char *strOut, int *intOut) {
+  /* sanity check, a name never interned cannot be a symbol */
+  if (name == NULL) {
+    return -1;
+  }
+  return symtab_lookup_id(curSyms, intern_find(name, strlen(name)),
+			  strOut, intOut);
 }
 
 int symtab_show(struct SymTab **curSyms) {
-  struct SymTab *loop = *curSyms;
-  
+  struct SymEntry *slot;
+  unsigned int x;
+
   /* sanity check */
   if (curSyms == NULL){
     return -1;
   }
-  
+
   printf("Listing of known symbols\n");
-  for (loop = *curSyms; loop != NULL; loop = loop->next) {
-    if (loop->strVal[0] != '\0') {
+  if (*curSyms == NULL) {
+    return 0;
+  }
+  for (x=0; x<(*curSyms)->size; x++) {
+    slot = &(*curSyms)->slots[x];
+    if (slot->name == NULL) {
+      continue;
+    }
+    if (slot->strVal != NULL) {
       printf("-> %-15s%s\n",
-	     loop->name, loop->strVal);
+	     slot->name, slot->strVal);
     }
     else {
       printf("-> %-15s%d (0x%x)\n",
-	     loop->name, loop->intVal, loop->intVal);
+	     slot->name, slot->intVal, slot->intVal);
     }
   }
   return 0;
 }
+
+/* walk every symbol, in no particular order. start with *iter
+ * set to 0, returns NULL once all have been seen */
+const struct SymEntry *symtab_next(struct SymTab **curSyms, unsigned int *iter) {
+  struct SymEntry *slot;
+
+  if ((curSyms == NULL) || (*curSyms == NULL)) {
+    return NULL;
+  }
+
+  while (*iter < (*curSyms)->size) {
+    slot = &(*curSyms)->slots[(*iter)++];
+    if (slot->name != NULL) {
+      return slot;
+    }
+  }
+  return NULL;
+}
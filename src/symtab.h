@@ -2,20 +2,58 @@
 #define SYMTAB_H
 
 #include "global.h"
+#include "intern.h"
 
-/* simple linked list to hold symbols (hash table would be better) */
+/* initial number of slots in a fresh table (power of two) */
+#define SYMTAB_MIN_SIZE 64
+
+/* rough guess of source bytes per symbol, for pre-sizing */
+#define SYMTAB_BYTES_PER_SYM 32
+
+/* size of each block in the interned string pool */
+#define SYMTAB_POOL_BLOCK 4096
+
+/* one slot in the open addressing table */
+struct SymEntry {
+  const char *name;		/* text of id, NULL if slot unused */
+  const char *strVal;		/* string value from the pool, NULL if none */
+  int intVal;			/* integer value */
+  uint32_t id;			/* interned name, what the table is keyed on */
+};
+
+/* slot an id hashes to, ids are dense so a multiply spreads them */
+#define SYMTAB_HASH(id) ((uint32_t)(id) * 2654435761u)
+
+/* block of string values, chained so entries never move, until
+ * enough old values pile up to be worth copying out (see symtab.c) */
+struct SymPool {
+  struct SymPool *next;
+  size_t used;
+  size_t size;
+  char data[1];
+};
+
+/* open addressing hash table to hold symbols */
 struct SymTab {
-  char name[MAX_TOKLEN];
-  char strVal[MAX_TOKLEN];
-  int intVal;
-  struct SymTab *next;
+  struct SymEntry *slots;	/* table of entries, linear probing */
+  unsigned int size;		/* number of slots, always a power of two */
+  unsigned int count;		/* number of slots in use */
+  struct SymPool *pool;		/* string values */
+  size_t poolUsed;		/* bytes stored in the pool */
+  size_t poolWaste;		/* of those, old values since replaced */
 };
 
 /* prototypes */
 
 int symtab_clear(struct SymTab **curSyms);
+int symtab_reserve(struct SymTab **curSyms, unsigned int count);
 int symtab_record(struct SymTab **curSyms, char *name, char *strVal, int intVal);
 int symtab_lookup(struct SymTab **curSyms, char *name, char *strOut, int *intOut);
+int symtab_record_id(struct SymTab **curSyms, uint32_t id, char *strVal,
+		     int intVal);
+int symtab_lookup_id(struct SymTab **curSyms, uint32_t id, char *strOut,
+		     int *intOut);
 int symtab_show(struct SymTab **curSyms);
+const struct SymEntry *symtab_next(struct SymTab **curSyms, unsigned int *iter);
 
 #endif
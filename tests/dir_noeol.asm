@@ -0,0 +1,5 @@
+; a directive on the last line, with no newline after it
+.arch tiny
+	add 1
+	cla
+.mifwords 4
\ No newline at end of file
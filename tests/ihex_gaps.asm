@@ -0,0 +1,8 @@
+; Intel HEX records stop where emitted data does
+.arch tiny
+.org 0
+	.db 1
+.org $100
+	.db 2
+.org $fff8
+	.fill 20, 1, 3
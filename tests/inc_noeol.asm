@@ -0,0 +1,5 @@
+; an included file whose last line has no newline
+.arch tiny
+	.include "inc_noeol.inc"
+	add ONEV
+	cla